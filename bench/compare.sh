@@ -0,0 +1,42 @@
+#!/usr/bin/env bash
+#
+# Compares a benchmark run against a baseline, both in the format printed by
+# bench/run.sh. Fails when a benchmark's median is slower than the baseline by
+# more than BENCH_THRESHOLD (a fraction, default 0.15), or when a benchmark
+# that used to pass now fails.
+#
+# Usage: bench/compare.sh baseline.tsv current.tsv
+
+set -u
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 baseline.tsv current.tsv" >&2
+    exit 64
+fi
+
+awk -F '\t' -v threshold="${BENCH_THRESHOLD:-0.15}" '
+    FNR == 1 { next }
+    NR == FNR {
+        status[$1 FS $2] = $3
+        median[$1 FS $2] = $5
+        next
+    }
+    ($1 FS $2) in status {
+        key = $1 FS $2
+        if (status[key] != "ok") {
+            next
+        }
+        if ($3 != "ok") {
+            printf "REGRESSION %s %s: %s (baseline ok)\n", $1, $2, $3
+            regressed = 1
+            next
+        }
+        change = ($5 - median[key]) / median[key]
+        verdict = change > threshold ? "REGRESSION" : "ok"
+        printf "%-10s %s %s: %.6fs -> %.6fs (%+.1f%%)\n", verdict, $1, $2, median[key], $5, change * 100
+        if (change > threshold) {
+            regressed = 1
+        }
+    }
+    END { exit regressed }
+' "$1" "$2"
@@ -0,0 +1,94 @@
+#!/usr/bin/env bash
+#
+# Stack VM vs register engine vs template JIT.
+#
+# Runs every bench/*.lox with --engine=stack, --engine=register and --jit
+# and prints one tab-separated line per benchmark:
+#
+#   benchmark  status  stack_insns  register_insns  insn_ratio  stack_s  register_s  speedup  jit_s  jit_speedup
+#
+# The instruction counts come from clox-profile --stats (release builds do
+# not count instructions, and instructions run as machine code are never
+# counted), the times are the median wall time of BENCH_TRIALS runs of clox.
+# The speedups are relative to the stack VM. status is "ok", "error(N)" when
+# the script fails on the stack VM, or "differs" when another engine prints
+# different output. jit_s is "-" when clox was built without the JIT.
+#
+# Usage: bench/engines.sh   (builds nothing; run make clox clox-profile first)
+
+set -u
+
+script_dir=$(cd "$(dirname "$0")" && pwd)
+root_dir=$(dirname "${script_dir}")
+trials=${BENCH_TRIALS:-5}
+clox="${root_dir}/clox"
+profile="${root_dir}/clox-profile"
+
+for binary in "${clox}" "${profile}"; do
+    if [ ! -x "${binary}" ]; then
+        echo "$(basename "${binary}") is not built (make clox clox-profile)" >&2
+        exit 1
+    fi
+done
+
+tmp=$(mktemp -d)
+trap 'rm -rf "${tmp}"' EXIT
+
+now() {
+    date +%s.%N
+}
+
+# 中央値の秒数
+median_time() {
+    local times=()
+    for ((i = 0; i < trials; i++)); do
+        start=$(now)
+        "${clox}" "$@" > /dev/null 2>&1
+        end=$(now)
+        times+=("$(echo "${start} ${end}" | awk '{ printf "%.6f", $2 - $1 }')")
+    done
+    printf "%s\n" "${times[@]}" | sort -g | awk '{ t[NR] = $1 } END { printf "%.4f", (NR % 2) ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2 }'
+}
+
+instructions() {
+    "${profile}" --stats "$@" 2>&1 > /dev/null | awk '$1 == "instructions" { print $2 }'
+}
+
+# x86-64のLinux以外のビルドは--jitを受け付けない
+jit=false
+if echo "" | "${clox}" --jit - > /dev/null 2>&1; then
+    jit=true
+fi
+
+printf "benchmark\tstatus\tstack_insns\tregister_insns\tinsn_ratio\tstack_s\tregister_s\tspeedup\tjit_s\tjit_speedup\n"
+
+for bench in "${script_dir}"/*.lox; do
+    bench_name=$(basename "${bench}" .lox)
+    "${clox}" --engine=stack "${bench}" > "${tmp}/stack" 2>&1
+    code=$?
+    if [ "${code}" -ne 0 ]; then
+        printf "%s\terror(%d)\t-\t-\t-\t-\t-\t-\t-\t-\n" "${bench_name}" "${code}"
+        continue
+    fi
+    "${clox}" --engine=register "${bench}" > "${tmp}/register" 2>&1
+    if ${jit}; then
+        "${clox}" --jit "${bench}" > "${tmp}/jit" 2>&1
+    else
+        cp "${tmp}/stack" "${tmp}/jit"
+    fi
+    if ! cmp -s "${tmp}/stack" "${tmp}/register" || ! cmp -s "${tmp}/stack" "${tmp}/jit"; then
+        printf "%s\tdiffers\t-\t-\t-\t-\t-\t-\t-\t-\n" "${bench_name}"
+        continue
+    fi
+
+    stack_insns=$(instructions --engine=stack "${bench}")
+    register_insns=$(instructions --engine=register "${bench}")
+    stack_s=$(median_time --engine=stack "${bench}")
+    register_s=$(median_time --engine=register "${bench}")
+    jit_s=-
+    if ${jit}; then
+        jit_s=$(median_time --jit "${bench}")
+    fi
+    echo "${bench_name} ${stack_insns} ${register_insns} ${stack_s} ${register_s} ${jit_s}" \
+        | awk '{ printf "%s\tok\t%s\t%s\t%.3f\t%s\t%s\t%.2f\t%s\t%s\n", $1, $2, $3, $3 / $2, $4, $5, $4 / $5, $6, $6 == "-" ? "-" : sprintf("%.2f", $4 / $6) }'
+done
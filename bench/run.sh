@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+#
+# Lox benchmark harness.
+#
+# Runs every bench/*.lox on each available interpreter, BENCH_TRIALS times,
+# and prints one tab-separated line per interpreter and benchmark:
+#
+#   interpreter  benchmark  status  trials  median_s  stddev_s  ops_per_sec
+#
+# status is "ok", or "error(N)" when the script exited with status N
+# (for example a feature the interpreter does not support yet).
+# The number of operations is read from the "// ops: N" header of each script.
+#
+# Usage: bench/run.sh [interpreter...]   (default: ./clox ./jlox)
+
+set -u
+
+script_dir=$(cd "$(dirname "$0")" && pwd)
+root_dir=$(dirname "${script_dir}")
+trials=${BENCH_TRIALS:-5}
+
+if [ $# -gt 0 ]; then
+    interpreters=("$@")
+else
+    interpreters=("${root_dir}/clox" "${root_dir}/jlox")
+fi
+
+available() {
+    case "$(basename "$1")" in
+        jlox) [ -d "${root_dir}/build/java" ] && command -v java > /dev/null ;;
+        *) [ -x "$1" ] ;;
+    esac
+}
+
+now() {
+    date +%s.%N
+}
+
+printf "interpreter\tbenchmark\tstatus\ttrials\tmedian_s\tstddev_s\tops_per_sec\n"
+
+for interpreter in "${interpreters[@]}"; do
+    name=$(basename "${interpreter}")
+    if ! available "${interpreter}"; then
+        echo "skipping ${name}: not built" >&2
+        continue
+    fi
+
+    for bench in "${script_dir}"/*.lox; do
+        bench_name=$(basename "${bench}" .lox)
+        ops=$(sed -n 's|^// ops: *\([0-9][0-9]*\).*|\1|p' "${bench}" | head -n 1)
+        status=ok
+        times=()
+        for ((i = 0; i < trials; i++)); do
+            start=$(now)
+            "${interpreter}" "${bench}" > /dev/null 2>&1
+            code=$?
+            end=$(now)
+            if [ "${code}" -ne 0 ]; then
+                status="error(${code})"
+                break
+            fi
+            times+=("$(echo "${start} ${end}" | awk '{ printf "%.6f", $2 - $1 }')")
+        done
+
+        if [ "${status}" != ok ]; then
+            printf "%s\t%s\t%s\t0\t-\t-\t-\n" "${name}" "${bench_name}" "${status}"
+            continue
+        fi
+
+        printf "%s\n" "${times[@]}" | sort -n | awk -v name="${name}" -v bench="${bench_name}" -v ops="${ops:-1}" '
+            { t[NR] = $1; sum += $1 }
+            END {
+                n = NR
+                median = (n % 2 == 1) ? t[(n + 1) / 2] : (t[n / 2] + t[n / 2 + 1]) / 2
+                mean = sum / n
+                for (i = 1; i <= n; i++) {
+                    variance += (t[i] - mean) ^ 2
+                }
+                stddev = n > 1 ? sqrt(variance / (n - 1)) : 0
+                rate = median > 0 ? ops / median : 0
+                printf "%s\t%s\tok\t%d\t%.6f\t%.6f\t%.0f\n", name, bench, n, median, stddev, rate
+            }'
+    done
+done
@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+#
+# Scanner throughput benchmark.
+#
+# Generates a large synthetic Lox source (BENCH_SCAN_LINES blocks, default
+# 200000) with identifiers, keywords, numbers, strings, comments and
+# indentation, then scans it with "clox --scan", which reports tokens/sec
+# without compiling.
+#
+# Usage: bench/scanner.sh [clox]
+
+set -u
+
+script_dir=$(cd "$(dirname "$0")" && pwd)
+clox=${1:-$(dirname "${script_dir}")/clox}
+lines=${BENCH_SCAN_LINES:-200000}
+source=$(mktemp)
+trap 'rm -f "${source}"' EXIT
+
+awk -v n="${lines}" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "// block %d: generated for the scanner benchmark\n", i
+        printf "var value_%d = %d.25 * (counter + %d) - offset;\n", i, i, i % 97
+        printf "if (value_%d >= 10 and !done or flag_%d != nil) {\n", i, i % 13
+        printf "        print \"value %d is \" + label;\n", i
+        printf "} else {\n"
+        printf "    while (false) { this.field_%d = super.method; break; }\n", i
+        printf "}\n"
+    }
+}' > "${source}"
+
+echo "$(wc -c < "${source}") bytes" >&2
+"${clox}" --scan "${source}"
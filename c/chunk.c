@@ -1,4 +1,5 @@
 #include "chunk.h"
+#include "jit.h"
 #include "memory.h"
 
 void initChunk(Chunk* chunk) {
@@ -6,16 +7,50 @@ void initChunk(Chunk* chunk) {
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->maxStack = 0;
     initValueArray(&(chunk->constants));
+    chunk->registerCode = NULL;
+    chunk->registerLines = NULL;
+    chunk->registerCount = 0;
+    chunk->registerCapacity = 0;
+    chunk->frameSize = 0;
+    chunk->hotness = 0;
+    chunk->jit = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&(chunk->constants));
+    freeRegisterCode(chunk);
+#ifdef TEMPLATE_JIT
+    freeJit(chunk);
+#endif
     initChunk(chunk);
 }
 
+void freeRegisterCode(Chunk* chunk) {
+    FREE_ARRAY(uint32_t, chunk->registerCode, chunk->registerCapacity);
+    FREE_ARRAY(int, chunk->registerLines, chunk->registerCapacity);
+    chunk->registerCode = NULL;
+    chunk->registerLines = NULL;
+    chunk->registerCount = 0;
+    chunk->registerCapacity = 0;
+    chunk->frameSize = 0;
+}
+
+void writeRegisterCode(Chunk* chunk, uint32_t instruction, int line) {
+    if (chunk->registerCapacity < chunk->registerCount + 1) {
+        int oldCapacity = chunk->registerCapacity;
+        chunk->registerCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->registerCode = GROW_ARRAY(uint32_t, chunk->registerCode, oldCapacity, chunk->registerCapacity);
+        chunk->registerLines = GROW_ARRAY(int, chunk->registerLines, oldCapacity, chunk->registerCapacity);
+    }
+    chunk->registerCode[chunk->registerCount] = instruction;
+    chunk->registerLines[chunk->registerCount] = line;
+    chunk->registerCount++;
+}
+
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
@@ -9,6 +9,12 @@
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
+  OP_POP,
+  OP_GET_LOCAL,
+  OP_SET_LOCAL,
+  OP_GET_GLOBAL,
+  OP_DEFINE_GLOBAL,
+  OP_SET_GLOBAL,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -16,12 +22,94 @@
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  // quickening: 実行時に汎用命令から書き換えられる数値専用の命令
+  // コンパイラはこれらを出力しない
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  OP_ADD_NUM,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
   OP_NOT,
   OP_NEGATE,
   OP_PRINT,
-  OP_RETURN,
+  OP_JUMP, // 16bitのoffsetだけ前方にジャンプする
+  OP_JUMP_IF_FALSE, // スタックトップがfalseyなら前方にジャンプする(popはしない)
+  OP_LOOP, // 16bitのoffsetだけ後方にジャンプする
+  OP_CALL, // 引数の数(1byte)。スタックの[関数, 引数...]を戻り値に置き換える
+  OP_TAIL_CALL, // return f(...)のOP_CALL。呼び出し元のCallFrameとスロットをそのまま使い回す
+  OP_BUILD_LIST, // 要素の数(1byte)。スタックの要素をまとめてlistにする
+  OP_BUILD_MAP, // entryの数(1byte)。スタックのkey, valueの組をまとめてmapにする
+  OP_INDEX_GET, // [list, index]をlist[index]に置き換える(mapならkeyの値、なければnil)
+  OP_INDEX_SET, // [list, index, value]をvalueに置き換える
+  OP_RETURN, // 戻り値をpopして呼び出し元に戻る(トップレベルなら実行を終える)
  } OpCode;
 
+/**
+ * レジスタ命令(--engine=register)
+ *
+ * allocateRegistersがスタック命令から翻訳する3番地の命令
+ * 1命令は32bitで、下位からop, A, B, Cの8bitずつ
+ * A, B, Cはフレームの先頭から数えたスロット(レジスタ)の番号で、_Kの命令ではCが定数の番号
+ * ジャンプする命令は次の32bitにジャンプ先の命令の位置を持つ
+ */
+ typedef enum {
+  REG_MOVE, // R[A] = R[B]
+  REG_LOAD_CONSTANT, // R[A] = K[B]
+  REG_LOAD_NIL, // R[A] = nil
+  REG_LOAD_TRUE, // R[A] = true
+  REG_LOAD_FALSE, // R[A] = false
+  REG_GET_GLOBAL, // R[A] = K[B]という名前のグローバル変数
+  REG_DEFINE_GLOBAL, // K[B]という名前のグローバル変数をR[A]で定義する
+  REG_SET_GLOBAL, // K[B]という名前のグローバル変数にR[A]を代入する
+  REG_EQUAL, // R[A] = R[B] == R[C]
+  REG_EQUAL_K, // R[A] = R[B] == K[C]
+  REG_GREATER,
+  REG_GREATER_K,
+  REG_LESS,
+  REG_LESS_K,
+  REG_ADD,
+  REG_ADD_K,
+  REG_SUBTRACT,
+  REG_SUBTRACT_K,
+  REG_MULTIPLY,
+  REG_MULTIPLY_K,
+  REG_DIVIDE,
+  REG_DIVIDE_K,
+  REG_NOT, // R[A] = !R[B]
+  REG_NEGATE, // R[A] = -R[B]
+  REG_PRINT, // print R[A]
+  REG_JUMP,
+  REG_JUMP_IF_FALSE, // R[A]がfalseyならジャンプする
+  // 比較と条件ジャンプを1命令にしたもの: R[B]とR[C](_KならK[C])を比べ、成り立てばジャンプする
+  REG_JUMP_IF_EQUAL,
+  REG_JUMP_IF_EQUAL_K,
+  REG_JUMP_IF_NOT_EQUAL,
+  REG_JUMP_IF_NOT_EQUAL_K,
+  REG_JUMP_IF_GREATER,
+  REG_JUMP_IF_GREATER_K,
+  REG_JUMP_IF_NOT_GREATER,
+  REG_JUMP_IF_NOT_GREATER_K,
+  REG_JUMP_IF_LESS,
+  REG_JUMP_IF_LESS_K,
+  REG_JUMP_IF_NOT_LESS,
+  REG_JUMP_IF_NOT_LESS_K,
+  REG_CALL, // R[A]の関数をR[A+1]からのB個の引数で呼び、戻り値をR[A]に置く
+  REG_TAIL_CALL, // return f(...)のREG_CALL
+  REG_BUILD_LIST, // R[A]からのB個の要素のlistをR[A]に置く
+  REG_BUILD_MAP, // R[A]からのB組のkey, valueのmapをR[A]に置く
+  REG_INDEX_GET, // R[A] = R[B][R[C]]
+  REG_INDEX_SET, // R[A][R[B]] = R[C]
+  REG_RETURN, // R[A]を返す
+ } RegisterOp;
+
+#define REG_INSTRUCTION(op, a, b, c) \
+    ((uint32_t)(op) | (uint32_t)(a) << 8 | (uint32_t)(b) << 16 | (uint32_t)(c) << 24)
+#define REG_OP(instruction) ((instruction) & 0xff)
+#define REG_A(instruction) (((instruction) >> 8) & 0xff)
+#define REG_B(instruction) (((instruction) >> 16) & 0xff)
+#define REG_C(instruction) ((instruction) >> 24)
+
 /**
  * A chunk is a sequence of bytes that represents a program.
  * dynamic array of bytes
@@ -32,11 +120,26 @@
    uint8_t* code; // code of the program
    int* lines; // line numbers for each bytecode
    ValueArray constants; // constant pool(定数プール)
+   int maxStack; // 実行に必要なスタックの深さ(verifyChunkが記録する)
+   // 以下は--engine=registerのときにallocateRegistersが作る(定数プールはスタック命令と共有する)
+   uint32_t* registerCode;
+   int* registerLines; // 命令ごとの行番号(ジャンプ先の32bitにも同じ行を入れる)
+   int registerCount;
+   int registerCapacity;
+   int frameSize; // 使うレジスタの数
+   // 以下は--jitのときに使う
+   int hotness; // 入った回数とループした回数の合計
+   struct JitCode* jit; // JITしたコード(まだならNULL)
  } Chunk;
 
  void initChunk(Chunk* chunk);
  void writeChunk(Chunk* chunk, uint8_t byte, int line);
  void freeChunk(Chunk* chunk);
+ void writeRegisterCode(Chunk* chunk, uint32_t instruction, int line);
+ /**
+  * レジスタ命令を捨てる(定数プールとスタック命令は残す)
+  */
+ void freeRegisterCode(Chunk* chunk);
  /**
   * Adds a constant to the constant pool.
   * @param chunk the chunk to add the constant to
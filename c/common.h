@@ -5,7 +5,28 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+#define UINT8_COUNT (UINT8_MAX + 1)
+
+// gccとclangではcomputed goto(ラベルのアドレス)によるthreaded dispatchを使う
+// -DNO_COMPUTED_GOTOでswitchによるdispatchに戻せる
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// x86-64のLinuxではテンプレートJIT(--jit)を使える
+// -DNO_JITで外せる
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define TEMPLATE_JIT
+#endif
+
+// DEBUG_TRACE_EXECUTIONはdebugビルド(make clox-debug)でのみ定義される
+// releaseビルドのrun()には実行トレースのためのコードが一切入らない
+
+// tableの探索長と実行した命令の数の集計(--statsのtable probesとinstructions)はdebugビルドとprofileビルドでのみ行う
+// findEntryはlookupのたびに、命令の数は命令ごとに通るので、releaseビルドには集計のコードを入れない
+#if defined(DEBUG_TRACE_EXECUTION) || defined(PROFILE_EXECUTION)
+#define TABLE_PROBE_STATS
+#define INSTRUCTION_STATS
+#endif
 
 #endif
\ No newline at end of file
@@ -1,15 +1,68 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "debug.h"
+#include "memory.h"
 #include "object.h"
+#include "verifier.h"
+#include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+/**
+ * ローカル変数
+ * depthが-1の間は宣言済みだが未初期化 (var a = a; を弾くため)
+ */
+typedef struct {
+    Token name;
+    int depth;
+} Local;
+
+/**
+ * コンパイル中のループ
+ * breakは後で終了位置にパッチするジャンプを記録しておく
+ */
+typedef struct Loop {
+    struct Loop* enclosing;
+    int scopeDepth; // ループ本体が始まるときのscopeの深さ
+    int breakJumps[UINT8_COUNT];
+    int breakCount;
+} Loop;
+
+typedef enum {
+    TYPE_FUNCTION,
+    TYPE_SCRIPT,
+} FunctionType;
+
+/**
+ * コンパイル中の関数(またはスクリプトのトップレベル)
+ * 関数宣言の中に入るたびに新しいCompilerを作り、enclosingでつなぐ
+ */
+typedef struct Compiler {
+    struct Compiler* enclosing;
+    ObjFunction* function; // スクリプトならNULL
+    FunctionType type;
+    Chunk* chunk; // 書き込み先のchunk
+    Local locals[UINT8_COUNT]; // 実行時のスタックのスロットと同じ順序で並ぶ
+    int localCount;
+    int scopeDepth; // 0ならグローバルスコープ
+    Loop* loop; // 一番内側のループ
+    int lastCall; // 最後に書いた関数呼び出しの直後の位置(末尾呼び出しの検出に使う)
+} Compiler;
+
+/**
+ * 1回のコンパイルの状態
+ * scannerも含めてすべてここに持つので、別々のスレッドで同時にコンパイルできる
+ */
 typedef struct {
     Token current; // the next token to be parsed
     Token previous; // the previous token parsed
     bool hadError;
     bool panicMode;
+    Scanner scanner;
+    Compiler* compiler; // 一番内側の関数のローカル変数とscopeの情報
+    Chunk* chunk; // スクリプトのトップレベルの書き込み先のchunk
+    VM* vm; // 文字列をinternするVM
 } Parser;
 
 /**
@@ -32,7 +85,11 @@ typedef enum {
   PREC_PRIMARY,     // true false nil this
 } Precedence;
 
-typedef void (*ParseFn)();
+/**
+ * @param canAssign 代入式の左辺として解析してよいか
+ * a * b = c のような不正な代入を弾くために使う
+ */
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 /**
  * パースルール表
@@ -44,49 +101,47 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
-Parser parser;
-Chunk* compileChunk;
-
-static Chunk* currentChunk() {
-    return compileChunk;
+static Chunk* currentChunk(Parser* parser) {
+    return parser->compiler->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-    if (parser.panicMode) {
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode) {
         return;
     }
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(parser->vm->err, "[line %d] Error", token->line);
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(parser->vm->err, " at end");
     } else if (token->type == TOKEN_ERROR) {
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->vm->err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    fprintf(parser->vm->err, ": %s\n", message);
+    parser->panicMode = true;
+    parser->hadError = true;
 }
 
 
-static void error(const char* message) {
-    errorAt(&(parser.previous), message);
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &(parser->previous), message);
 
 }
 
-static void errorAtCurrent(const char* message) {
-    errorAt(&(parser.current), message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &(parser->current), message);
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) {
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR) {
             break;
         }
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
@@ -95,61 +150,166 @@ static void advance() {
  * @param type The type to check.
  * @param message The error message to throw if the current token does not match the given type.
  */
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-    if (!check(type)) {
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) {
         return false;
     }
-    advance();
+    advance(parser);
     return true;
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(currentChunk(parser), byte, parser->previous.line);
+}
+
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
+}
+
+/**
+ * 前方ジャンプ命令を仮のoffsetで書き込む
+ * @return offsetを後でパッチするための位置
+ */
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+/**
+ * 後方ジャンプ命令を書き込む
+ * @param loopStart ジャンプ先(ループの先頭)
+ */
+static void emitLoop(Parser* parser, int loopStart) {
+    emitByte(parser, OP_LOOP);
+
+    // +2はOP_LOOP自身のoffsetオペランドの分
+    int offset = currentChunk(parser)->count - loopStart + 2;
+    if (offset > UINT16_MAX) {
+        error(parser, "Loop body too large.");
+    }
+
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static void emitReturn() {
-    emitByte(OP_RETURN);
+/**
+ * 本体の終わりまで来たらnilを返す(スクリプトのトップレベルも同じ)
+ */
+static void emitReturn(Parser* parser) {
+    emitByte(parser, OP_NIL);
+    emitByte(parser, OP_RETURN);
 }
 
-static uint8_t emitConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
+static uint8_t emitConstant(Parser* parser, Value value) {
+    // 同じ値がすでに定数プールにあれば再利用する
+    // 文字列はinternされているので、同じ名前の変数や同じリテラルも1つにまとまる
+    // プールは最大256個なので線形探索で十分
+    ValueArray* constants = &currentChunk(parser)->constants;
+    for (int i = 0; i < constants->count && i <= UINT8_MAX; i++) {
+        if (valuesEqual(constants->values[i], value)) {
+            return (uint8_t)i;
+        }
+    }
+
+    int constant = addConstant(currentChunk(parser), value);
     if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
     return (uint8_t)constant;
 }
 
-static void endCompiler() {
-    emitReturn();
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
+/**
+ * emitJumpで書き込んだ仮のoffsetを、現在位置へのジャンプに書き換える
+ * @param offset emitJumpが返した位置
+ */
+static void patchJump(Parser* parser, int offset) {
+    // -2はジャンプのoffsetオペランド自身の分
+    int jump = currentChunk(parser)->count - offset - 2;
+
+    if (jump > UINT16_MAX) {
+        error(parser, "Too much code to jump over.");
+    }
+
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
+}
+
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type) {
+    compiler->enclosing = parser->compiler;
+    compiler->function = NULL;
+    compiler->type = type;
+    compiler->chunk = parser->chunk;
+    compiler->localCount = 0;
+    compiler->scopeDepth = 0;
+    compiler->loop = NULL;
+    compiler->lastCall = -1;
+    parser->compiler = compiler;
+
+    if (type == TYPE_FUNCTION) {
+        compiler->function = newFunction(parser->vm);
+        compiler->function->name = copyString(parser->vm, parser->previous.start, parser->previous.length);
+        compiler->chunk = &compiler->function->chunk;
+
+        // スロット0は呼び出された関数自身が使う
+        Local* local = &compiler->locals[compiler->localCount++];
+        local->depth = 0;
+        local->name.start = "";
+        local->name.length = 0;
+    }
+}
+
+/**
+ * @return コンパイルした関数、スクリプトならNULL
+ */
+static ObjFunction* endCompiler(Parser* parser) {
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
+    if (parser->vm->printCode && !parser->hadError) {
+        disassembleChunk(currentChunk(parser), function != NULL ? function->name->chars : "code");
+    }
+    parser->compiler = parser->compiler->enclosing;
+    return function;
+}
+
+static void beginScope(Parser* parser) {
+    parser->compiler->scopeDepth++;
+}
+
+static void endScope(Parser* parser) {
+    Compiler* current = parser->compiler;
+    current->scopeDepth--;
+
+    // scopeを抜けるときにそのscopeのローカル変数をスタックから取り除く
+    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
+        emitByte(parser, OP_POP);
+        current->localCount--;
     }
-#endif
 }
 
-static void expression();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
+static uint8_t identifierConstant(Parser* parser, Token* name);
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name);
 
 /**
  * 二項演算子: + - * /
@@ -157,57 +317,57 @@ static void parsePrecedence(Precedence precedence);
  * 二項演算子は、二つのオペランド（被演算子）に対して作用する演算子です（例：1 + 2, x < y）。
  * 先に右のオペランドをコンパイルしてから二項演算子をコンパイルする
  */
-static void binary() {
-    TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
     ParseRule* rule = getRule(operatorType);
     // 右のオペランドの優先順位を1つ上げる
     // １つ目の+と次の+の優先順位の比較のため
     // 1 + 2 + 3 + 4 -> ((1 + 2) + 3) + 4
-    parsePrecedence(rule->precedence + 1);
+    parsePrecedence(parser, rule->precedence + 1);
 
     switch (operatorType) {
         case TOKEN_BANG_EQUAL: {
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitBytes(parser, OP_EQUAL, OP_NOT);
             break;
         }
         case TOKEN_EQUAL_EQUAL: {
-            emitByte(OP_EQUAL);
+            emitByte(parser, OP_EQUAL);
             break;
         }
         case TOKEN_GREATER: {
-            emitByte(OP_GREATER);
+            emitByte(parser, OP_GREATER);
             break;
         }
         case TOKEN_GREATER_EQUAL: {
             // a >= b
             // !(b < a)
-            emitBytes(OP_LESS, OP_NOT);
+            emitBytes(parser, OP_LESS, OP_NOT);
             break;
         }
         case TOKEN_LESS: {
-            emitByte(OP_LESS);
+            emitByte(parser, OP_LESS);
             break;
         }
         case TOKEN_LESS_EQUAL: {
             // a <= b
             // !(b > a)
-            emitBytes(OP_GREATER, OP_NOT);
+            emitBytes(parser, OP_GREATER, OP_NOT);
             break;
         }
         case TOKEN_PLUS: {
-            emitByte(OP_ADD);
+            emitByte(parser, OP_ADD);
             break;
         }
         case TOKEN_MINUS: {
-            emitByte(OP_SUBTRACT);
+            emitByte(parser, OP_SUBTRACT);
             break;
         }
         case TOKEN_STAR: {
-            emitByte(OP_MULTIPLY);
+            emitByte(parser, OP_MULTIPLY);
             break;
         }
         case TOKEN_SLASH: {
-            emitByte(OP_DIVIDE);
+            emitByte(parser, OP_DIVIDE);
             break;
         }
         default:
@@ -215,18 +375,18 @@ static void binary() {
     }
 }
 
-static void literal() {
-    switch (parser.previous.type) {
+static void literal(Parser* parser, bool canAssign) {
+    switch (parser->previous.type) {
         case TOKEN_FALSE: {
-            emitByte(OP_FALSE);
+            emitByte(parser, OP_FALSE);
             break;
         }
         case TOKEN_TRUE: {
-            emitByte(OP_TRUE);
+            emitByte(parser, OP_TRUE);
             break;
         }
         case TOKEN_NIL: {
-            emitByte(OP_NIL);
+            emitByte(parser, OP_NIL);
             break;
         }
         default:
@@ -234,20 +394,154 @@ static void literal() {
     }
 }
 
-static void grouping() {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+/**
+ * 引数を左から順にスタックに積む
+ * @return 引数の数
+ */
+static uint8_t argumentList(Parser* parser) {
+    uint8_t argCount = 0;
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            expression(parser);
+            if (argCount == 255) {
+                error(parser, "Can't have more than 255 arguments.");
+            }
+            argCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return argCount;
+}
+
+/**
+ * 関数呼び出し: 呼び出される値はすでにスタックにあり、その上に引数を積む
+ */
+static void call(Parser* parser, bool canAssign) {
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
+    parser->compiler->lastCall = currentChunk(parser)->count;
+}
+
+/**
+ * listリテラル: [a, b, c]
+ * 要素を順にスタックに積んでから、まとめて1つのlistにする
+ */
+static void list(Parser* parser, bool canAssign) {
+    uint8_t itemCount = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression(parser);
+            if (itemCount == 255) {
+                error(parser, "Can't have more than 255 items in a list literal.");
+            }
+            itemCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+    emitBytes(parser, OP_BUILD_LIST, itemCount);
+}
+
+/**
+ * mapリテラル: {key: value, ...}
+ * 文の先頭の { はブロックになるので、式の中でだけmapになる
+ */
+static void map(Parser* parser, bool canAssign) {
+    uint8_t entryCount = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACE)) {
+        do {
+            expression(parser);
+            consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+            expression(parser);
+            if (entryCount == 255) {
+                error(parser, "Can't have more than 255 entries in a map literal.");
+            }
+            entryCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    emitBytes(parser, OP_BUILD_MAP, entryCount);
+}
+
+/**
+ * 添字: list[index] と list[index] = value (mapならmap[key])
+ */
+static void subscript(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitByte(parser, OP_INDEX_SET);
+    } else {
+        emitByte(parser, OP_INDEX_GET);
+    }
+}
+
+static void grouping(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+static void number(Parser* parser, bool canAssign) {
+    double value = strtod(parser->previous.start, NULL);
+    uint8_t constant = emitConstant(parser, NUMBER_VAL(value));
+    emitBytes(parser, OP_CONSTANT, constant);
+}
+
+static void string(Parser* parser, bool canAssign) {
+    ObjString* value = copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2);
+    uint8_t constant = emitConstant(parser, OBJ_VAL((Obj*)value));
+    emitBytes(parser, OP_CONSTANT, constant);
+}
+
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
+    uint8_t getOp, setOp;
+    int arg = resolveLocal(parser, parser->compiler, &name);
+    if (arg != -1) {
+        getOp = OP_GET_LOCAL;
+        setOp = OP_SET_LOCAL;
+    } else {
+        arg = identifierConstant(parser, &name);
+        getOp = OP_GET_GLOBAL;
+        setOp = OP_SET_GLOBAL;
+    }
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, setOp, (uint8_t)arg);
+    } else {
+        emitBytes(parser, getOp, (uint8_t)arg);
+    }
 }
 
-static void number() {
-    double value = strtod(parser.previous.start, NULL);
-    uint8_t constant = emitConstant(NUMBER_VAL(value));
-    emitBytes(OP_CONSTANT, constant);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
-static void string() {
-    uint8_t constant = emitConstant(OBJ_VAL((Obj*)copyString(parser.previous.start + 1, parser.previous.length - 2)));
-    emitBytes(OP_CONSTANT, constant);
+/**
+ * 左辺がfalseyならそれを結果として残し、右辺を評価せずにスキップする
+ */
+static void and_(Parser* parser, bool canAssign) {
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
+
+    patchJump(parser, endJump);
+}
+
+/**
+ * 左辺がtruthyならそれを結果として残し、右辺を評価せずにスキップする
+ */
+static void or_(Parser* parser, bool canAssign) {
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
+
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
+
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
 /**
@@ -258,20 +552,20 @@ static void string() {
  * その値をポップして、逆転し、その結果をスタックにプッシュする。
  * なのでexpressionを呼び出したあとにunaryの命令を書く
  */
-static void unary() {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
 
     // ex) -1.2 + 3;
     // expressionは1.2 + 3を含めてしまうが、1.2だけを対象にしたい
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     switch (operatorType) {
         case TOKEN_BANG: {
-            emitByte(OP_NOT);
+            emitByte(parser, OP_NOT);
             break;
         }
         case TOKEN_MINUS: {
-            emitByte(OP_NEGATE);
+            emitByte(parser, OP_NEGATE);
             break;
         }
         default:
@@ -280,10 +574,12 @@ static void unary() {
 }
 
 ParseRule rules[] = {
-  [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+  [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
+  [TOKEN_LEFT_BRACE]    = {map,      NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -291,6 +587,7 @@ ParseRule rules[] = {
   [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
   [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
+  [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_BANG]          = {unary,     NULL,   PREC_NONE},
   [TOKEN_BANG_EQUAL]    = {NULL,     binary,   PREC_EQUALITY},
   [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
@@ -299,10 +596,11 @@ ParseRule rules[] = {
   [TOKEN_GREATER_EQUAL] = {NULL,     binary,   PREC_COMPARISON},
   [TOKEN_LESS]          = {NULL,     binary,   PREC_COMPARISON},
   [TOKEN_LESS_EQUAL]    = {NULL,     binary,   PREC_COMPARISON},
-  [TOKEN_IDENTIFIER]    = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
   [TOKEN_STRING]        = {string,     NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
-  [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
+  [TOKEN_BREAK]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,     NULL,   PREC_NONE},
@@ -310,7 +608,7 @@ ParseRule rules[] = {
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,     NULL,   PREC_NONE},
-  [TOKEN_OR]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
@@ -325,22 +623,132 @@ ParseRule rules[] = {
 /**
  * 優先順位に従って式を解析する
  */
-static void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
-    prefixRule();
+    // 代入より低い優先順位で解析しているときだけ = を代入として扱う
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    prefixRule(parser, canAssign);
 
     // 常に前後の演算子の優先順位を比較する
     // なぜなら次のtokenが演算子ではない場合は、binaryを呼び出して処理されるから
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
+    }
+
+    // 消費されずに残った = は不正な代入先
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
+    }
+}
+
+static uint8_t identifierConstant(Parser* parser, Token* name) {
+    return emitConstant(parser, OBJ_VAL((Obj*)copyString(parser->vm, name->start, name->length)));
+}
+
+static bool identifiersEqual(Token* a, Token* b) {
+    if (a->length != b->length) {
+        return false;
+    }
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+/**
+ * 後ろから探すことで内側のscopeの変数がshadowingする
+ * @return スタックのスロット番号、ローカル変数でなければ-1
+ */
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &compiler->locals[i];
+        if (identifiersEqual(name, &local->name)) {
+            if (local->depth == -1) {
+                error(parser, "Cannot read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+    // 外側の関数のローカル変数は実行時にはもうないかもしれないので読めない
+    // グローバル変数として扱うと別の変数を黙って読むことになるのでエラーにする
+    for (Compiler* enclosing = compiler->enclosing; enclosing != NULL; enclosing = enclosing->enclosing) {
+        for (int i = enclosing->localCount - 1; i >= 0; i--) {
+            if (identifiersEqual(name, &enclosing->locals[i].name)) {
+                error(parser, "Cannot capture a local variable of an enclosing function.");
+                return -1;
+            }
+        }
+    }
+    return -1;
+}
+
+static void addLocal(Parser* parser, Token name) {
+    Compiler* current = parser->compiler;
+    if (current->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
+        return;
     }
+
+    // streaming modeではscannerのバッファがすぐに解放されるので
+    // scopeの終わりまで残る名前はinternした文字列を指すようにする
+    ObjString* string = copyString(parser->vm, name.start, name.length);
+    name.start = string->chars;
+
+    Local* local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = -1;
+}
+
+static void declareVariable(Parser* parser) {
+    Compiler* current = parser->compiler;
+    if (current->scopeDepth == 0) {
+        return;
+    }
+
+    Token* name = &parser->previous;
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        Local* local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scopeDepth) {
+            break;
+        }
+        if (identifiersEqual(name, &local->name)) {
+            error(parser, "Already a variable with this name in this scope.");
+        }
+    }
+    addLocal(parser, *name);
+}
+
+static uint8_t parseVariable(Parser* parser, const char* errorMessage) {
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
+
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0) {
+        return 0;
+    }
+    return identifierConstant(parser, &parser->previous);
+}
+
+static void markInitialized(Parser* parser) {
+    Compiler* current = parser->compiler;
+    if (current->scopeDepth == 0) {
+        return;
+    }
+    current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
+/**
+ * ローカル変数は初期化子の値がそのままスタックのスロットになるので命令は不要
+ */
+static void defineVariable(Parser* parser, uint8_t global) {
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
+        return;
+    }
+    emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
 static ParseRule* getRule(TokenType type) {
@@ -356,40 +764,830 @@ static ParseRule* getRule(TokenType type) {
  * 文（statement）: 実行する命令（例：if文、while文、変数宣言）
  * 式（expression）: 値を計算する式（例：算術演算、関数呼び出し）
  */
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void statement();
-static void declaration();
+static void varDeclaration(Parser* parser) {
+    uint8_t global = parseVariable(parser, "Expect variable name.");
+
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+    } else {
+        emitByte(parser, OP_NIL);
+    }
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-static void declaration() {
-    statement();
+    defineVariable(parser, global);
 }
 
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
+/**
+ * 関数の本体をそれ専用のCompilerでコンパイルし、できた関数を定数としてスタックに積む
+ */
+static void function(Parser* parser, FunctionType type) {
+    Compiler compiler;
+    initCompiler(parser, &compiler, type);
+    beginScope(parser);
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            compiler.function->arity++;
+            if (compiler.function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
+            }
+            uint8_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
     }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
+
+    // 本体のscopeは関数から戻るときにスロットごと捨てるのでendScopeはいらない
+    ObjFunction* function = endCompiler(parser);
+    emitBytes(parser, OP_CONSTANT, emitConstant(parser, OBJ_VAL((Obj*)function)));
+}
+
+/**
+ * 関数の名前は本体より先に定義済みにするので、本体の中から自分を再帰的に呼べる
+ */
+static void funDeclaration(Parser* parser) {
+    uint8_t global = parseVariable(parser, "Expect function name.");
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-bool compile(const char* source, Chunk *chunk) {
-    initScanner(source);
-    compileChunk = chunk;
-    parser.panicMode = false;
-    parser.hadError = false;
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
+}
 
-    advance();
+static void beginLoop(Parser* parser, Loop* loop) {
+    Compiler* current = parser->compiler;
+    loop->enclosing = current->loop;
+    loop->scopeDepth = current->scopeDepth;
+    loop->breakCount = 0;
+    current->loop = loop;
+}
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+/**
+ * breakのジャンプを現在位置(ループの直後)にパッチする
+ */
+static void endLoop(Parser* parser, Loop* loop) {
+    for (int i = 0; i < loop->breakCount; i++) {
+        patchJump(parser, loop->breakJumps[i]);
     }
-    endCompiler();
-    return !parser.hadError;
-}
\ No newline at end of file
+    parser->compiler->loop = loop->enclosing;
+}
+
+/**
+ * for (初期化; 条件; 増分) 本体
+ * 
+ * 増分は本体の後に実行されるが、コード上は本体の前にあるので
+ * 本体 -> 増分 -> 条件 の順にジャンプでつなぐ
+ */
+static void forStatement(Parser* parser) {
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
+        // No initializer.
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
+    } else {
+        expressionStatement(parser);
+    }
+
+    Loop loop;
+    beginLoop(parser, &loop);
+
+    int loopStart = currentChunk(parser)->count;
+    int exitJump = -1;
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP);
+    }
+
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        emitLoop(parser, loopStart);
+        loopStart = incrementStart;
+        patchJump(parser, bodyJump);
+    }
+
+    statement(parser);
+    emitLoop(parser, loopStart);
+
+    if (exitJump != -1) {
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP);
+    }
+
+    endLoop(parser, &loop);
+    endScope(parser);
+}
+
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+
+    // thenを実行したらelseを飛ばす
+    int elseJump = emitJump(parser, OP_JUMP);
+
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
+
+    if (match(parser, TOKEN_ELSE)) {
+        statement(parser);
+    }
+    patchJump(parser, elseJump);
+}
+
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
+}
+
+static void whileStatement(Parser* parser) {
+    Loop loop;
+    beginLoop(parser, &loop);
+
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
+
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
+
+    endLoop(parser, &loop);
+}
+
+/**
+ * ループ本体で宣言されたローカル変数をpopしてから、ループの直後へジャンプする
+ * ジャンプ先はendLoopでパッチする
+ */
+static void breakStatement(Parser* parser) {
+    Compiler* current = parser->compiler;
+    if (current->loop == NULL) {
+        error(parser, "Must be inside a loop to use 'break'.");
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after 'break'.");
+        return;
+    }
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after 'break'.");
+
+    Loop* loop = current->loop;
+    for (int i = current->localCount - 1; i >= 0 && current->locals[i].depth > loop->scopeDepth; i--) {
+        emitByte(parser, OP_POP);
+    }
+
+    if (loop->breakCount == UINT8_COUNT) {
+        error(parser, "Too many break statements in one loop.");
+        return;
+    }
+    loop->breakJumps[loop->breakCount++] = emitJump(parser, OP_JUMP);
+}
+
+/**
+ * return 式;
+ * 式が関数呼び出しで終わっていれば(return f(x);)、その呼び出しをOP_TAIL_CALLに書き換える
+ * 末尾呼び出しは今の関数のスロットを再利用するので、末尾再帰はいくら深くてもスタックが増えない
+ */
+static void returnStatement(Parser* parser) {
+    Compiler* current = parser->compiler;
+    if (current->type == TYPE_SCRIPT) {
+        error(parser, "Cannot return from top-level code.");
+    }
+
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
+        return;
+    }
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    Chunk* chunk = currentChunk(parser);
+    if (current->lastCall == chunk->count) {
+        chunk->code[chunk->count - 2] = OP_TAIL_CALL;
+    }
+    emitByte(parser, OP_RETURN);
+}
+
+/**
+ * エラーの後、次の文の境界までtokenを読み飛ばす
+ * 1つのエラーから連鎖するエラーを報告しないため
+ */
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
+
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) {
+            return;
+        }
+        switch (parser->current.type) {
+            case TOKEN_CLASS:
+            case TOKEN_FUN:
+            case TOKEN_VAR:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_PRINT:
+            case TOKEN_RETURN:
+            case TOKEN_BREAK:
+                return;
+            default:
+                ;
+        }
+        advance(parser);
+    }
+}
+
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
+    } else {
+        statement(parser);
+    }
+
+    if (parser->panicMode) {
+        synchronize(parser);
+    }
+}
+
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_BREAK)) {
+        breakStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
+    } else {
+        expressionStatement(parser);
+    }
+}
+
+/**
+ * scannerを初期化した後に、ソース全体をparser->chunkにコンパイルする
+ */
+static bool compileScanned(Parser* parser) {
+    Compiler compiler;
+    initCompiler(parser, &compiler, TYPE_SCRIPT);
+    parser->panicMode = false;
+    parser->hadError = false;
+
+    advance(parser);
+
+    while (!match(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    endCompiler(parser);
+    return !parser->hadError;
+}
+
+static void initParser(Parser* parser, VM* vm, Chunk* chunk) {
+    parser->vm = vm;
+    parser->chunk = chunk;
+    parser->compiler = NULL;
+}
+
+bool compile(VM* vm, const char* source, Chunk* chunk) {
+    Parser parser;
+    initParser(&parser, vm, chunk);
+    initScanner(&parser.scanner, source);
+    return compileScanned(&parser);
+}
+
+bool compileStream(VM* vm, int fd, Chunk* chunk) {
+    Parser parser;
+    initParser(&parser, vm, chunk);
+    initScannerStream(&parser.scanner, fd);
+    bool result = compileScanned(&parser);
+    freeScanner(&parser.scanner);
+    return result;
+}
+
+/**
+ * レジスタ割り当て(--engine=register)
+ *
+ * 検査を通ったスタック命令を先頭から1命令ずつ読み、スタックを記号的にたどってレジスタ命令にする
+ * スタックの深さiの値はレジスタiに置く(レジスタはフレームのスロットそのもの)
+ * ただしローカル変数と定数を積む命令は何も書かず、値がどこにあるかだけを覚えておき、
+ * 使う命令のオペランドに直接書く。a + 1 は GET_LOCAL, CONSTANT, ADD の3命令が ADD_K の1命令になる
+ */
+
+typedef enum {
+    OPERAND_HOME, // 自分の深さのレジスタにある
+    OPERAND_REGISTER, // まだindexのレジスタ(ローカル変数)にある
+    OPERAND_CONSTANT, // まだ定数プールのindex番目にある
+} OperandType;
+
+typedef struct {
+    OperandType type;
+    int index;
+} Operand;
+
+typedef struct {
+    Chunk* chunk;
+    int start; // 翻訳するスタック命令の先頭
+    bool* targets; // ジャンプ先になるスタック命令
+    int* labels; // ジャンプ先のスタック命令に対応するレジスタ命令の位置
+    int* patches; // ジャンプ先(まだスタック命令の位置)を書いたレジスタ命令の位置
+    int patchCount;
+    int patchCapacity;
+    Operand stack[UINT8_COUNT];
+    int depth;
+    int line;
+    int producer; // 最後に書いた命令がスタックの先頭の値をAに書く命令なら、その位置(SET_LOCALで書き先を付け替える)
+} Allocator;
+
+static void emitRegister(Allocator* allocator, RegisterOp op, int a, int b, int c) {
+    writeRegisterCode(allocator->chunk, REG_INSTRUCTION(op, a, b, c), allocator->line);
+}
+
+/**
+ * ジャンプする命令を書く
+ * ジャンプ先はすべて翻訳してから、スタック命令の位置をレジスタ命令の位置に書き換える
+ */
+static void emitRegisterJump(Allocator* allocator, RegisterOp op, int a, int b, int c, int target) {
+    emitRegister(allocator, op, a, b, c);
+    if (allocator->patchCapacity < allocator->patchCount + 1) {
+        int oldCapacity = allocator->patchCapacity;
+        allocator->patchCapacity = GROW_CAPACITY(oldCapacity);
+        allocator->patches = GROW_ARRAY(int, allocator->patches, oldCapacity, allocator->patchCapacity);
+    }
+    allocator->patches[allocator->patchCount++] = allocator->chunk->registerCount;
+    writeRegisterCode(allocator->chunk, (uint32_t)target, allocator->line);
+}
+
+/**
+ * 深さiの値を自分のレジスタに置く
+ */
+static void materialize(Allocator* allocator, int i) {
+    Operand* operand = &allocator->stack[i];
+    if (operand->type == OPERAND_CONSTANT) {
+        emitRegister(allocator, REG_LOAD_CONSTANT, i, operand->index, 0);
+    } else if (operand->type == OPERAND_REGISTER) {
+        emitRegister(allocator, REG_MOVE, i, operand->index, 0);
+    }
+    operand->type = OPERAND_HOME;
+}
+
+/**
+ * 深さlimitより下の値をすべて自分のレジスタに置く
+ * ジャンプ先ではどの経路から来ても値がレジスタにあるようにする
+ */
+static void flushBelow(Allocator* allocator, int limit) {
+    for (int i = 0; i < limit; i++) {
+        materialize(allocator, i);
+    }
+}
+
+/**
+ * 深さiの値があるレジスタ(定数なら自分のレジスタに読み込む)
+ */
+static int registerOf(Allocator* allocator, int i) {
+    Operand* operand = &allocator->stack[i];
+    if (operand->type == OPERAND_CONSTANT) {
+        materialize(allocator, i);
+    }
+    return operand->type == OPERAND_REGISTER ? operand->index : i;
+}
+
+/**
+ * 深さiの値の場所(自分のレジスタにあれば、そのレジスタの番号)
+ */
+static Operand operandAt(Allocator* allocator, int i) {
+    Operand operand = allocator->stack[i];
+    if (operand.type == OPERAND_HOME) {
+        operand.type = OPERAND_REGISTER;
+        operand.index = i;
+    }
+    return operand;
+}
+
+static void setOperand(Allocator* allocator, int i, Operand operand) {
+    if (operand.type == OPERAND_REGISTER && operand.index == i) {
+        operand.type = OPERAND_HOME;
+    }
+    allocator->stack[i] = operand;
+}
+
+/**
+ * 直前に書いた命令が深さiのレジスタに結果を書いたことを記録する
+ */
+static void produced(Allocator* allocator, int i) {
+    allocator->stack[i].type = OPERAND_HOME;
+    allocator->producer = allocator->chunk->registerCount - 1;
+}
+
+/**
+ * スタックの先頭の2つの値を取り出し、左右のオペランドにする
+ * 左だけが定数なら、入れ替えても結果が同じ演算は入れ替えて_Kの命令を使えるようにする
+ * @return 入れ替えた後の命令(GREATERとLESSは入れ替えると互いに変わる)
+ */
+static RegisterOp binaryOperands(Allocator* allocator, RegisterOp op, Operand* left, Operand* right) {
+    int i = allocator->depth - 2;
+    *left = operandAt(allocator, i);
+    *right = operandAt(allocator, i + 1);
+    // a + bは文字列の連結なので入れ替えられない
+    bool swappable = op == REG_EQUAL || op == REG_MULTIPLY || op == REG_GREATER || op == REG_LESS;
+    if (swappable && left->type == OPERAND_CONSTANT && right->type != OPERAND_CONSTANT) {
+        Operand operand = *left;
+        *left = *right;
+        *right = operand;
+        return op == REG_GREATER ? REG_LESS : op == REG_LESS ? REG_GREATER : op;
+    }
+    if (left->type == OPERAND_CONSTANT) {
+        materialize(allocator, i);
+        left->type = OPERAND_REGISTER;
+        left->index = i;
+    }
+    return op;
+}
+
+/**
+ * 2項演算 A = B op C (Cが定数ならop + 1の_Kの命令)
+ */
+static void binaryRegister(Allocator* allocator, RegisterOp op) {
+    Operand left;
+    Operand right;
+    op = binaryOperands(allocator, op, &left, &right);
+    int i = allocator->depth - 2;
+    emitRegister(allocator, right.type == OPERAND_CONSTANT ? op + 1 : op, i, left.index, right.index);
+    produced(allocator, i);
+    allocator->depth--;
+}
+
+static RegisterOp genericBinary(uint8_t instruction) {
+    switch (instruction) {
+        case OP_EQUAL: return REG_EQUAL;
+        case OP_GREATER:
+        case OP_GREATER_NUM: return REG_GREATER;
+        case OP_LESS:
+        case OP_LESS_NUM: return REG_LESS;
+        case OP_ADD:
+        case OP_ADD_NUM: return REG_ADD;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM: return REG_SUBTRACT;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM: return REG_MULTIPLY;
+        default: return REG_DIVIDE;
+    }
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+static bool isTarget(Allocator* allocator, int offset) {
+    return allocator->targets[offset - allocator->start];
+}
+
+/**
+ * offsetのOP_JUMP_IF_FALSEの条件の値が、どちらへ進んでもすぐにpopされるか(ifとwhileの条件)
+ * そうなら条件の値をレジスタに置かずにジャンプできる
+ */
+static bool conditionDiscarded(Allocator* allocator, int offset) {
+    Chunk* chunk = allocator->chunk;
+    int next = offset + 3;
+    int target = jumpTarget(chunk, offset);
+    return next < chunk->count && chunk->code[next] == OP_POP && !isTarget(allocator, next)
+        && chunk->code[target] == OP_POP;
+}
+
+/**
+ * 比較の直後が(OP_NOTと)条件ジャンプなら、比較とジャンプを1命令にする
+ * @return 続きの命令の位置、1命令にできなければ-1
+ */
+static int fuseCompare(Allocator* allocator, RegisterOp op, int next) {
+    Chunk* chunk = allocator->chunk;
+    bool negated = false;
+    if (next < chunk->count && chunk->code[next] == OP_NOT && !isTarget(allocator, next)) {
+        negated = true;
+        next++;
+    }
+    if (next >= chunk->count || chunk->code[next] != OP_JUMP_IF_FALSE || isTarget(allocator, next)
+        || !conditionDiscarded(allocator, next)) {
+        return -1;
+    }
+
+    Operand left;
+    Operand right;
+    op = binaryOperands(allocator, op, &left, &right);
+    flushBelow(allocator, allocator->depth - 2);
+    // 条件がfalseのときにジャンプする
+    RegisterOp jump = op == REG_EQUAL ? REG_JUMP_IF_EQUAL
+        : op == REG_GREATER ? REG_JUMP_IF_GREATER
+        : REG_JUMP_IF_LESS;
+    if (!negated) {
+        jump += REG_JUMP_IF_NOT_EQUAL - REG_JUMP_IF_EQUAL;
+    }
+    if (right.type == OPERAND_CONSTANT) {
+        jump++;
+    }
+    emitRegisterJump(allocator, jump, 0, left.index, right.index, jumpTarget(chunk, next));
+    // 続きのOP_POPで条件の値を捨てる
+    return next + 4;
+}
+
+/**
+ * offsetの命令を1つ翻訳する
+ * @param next 次の命令の位置
+ * @return 続きの命令の位置(比較とジャンプを1命令にしたときはその後ろ)
+ */
+static int translateInstruction(Allocator* allocator, int offset, int next) {
+    Chunk* chunk = allocator->chunk;
+    uint8_t* code = chunk->code;
+    int top = allocator->depth - 1;
+    switch (code[offset]) {
+        case OP_CONSTANT: {
+            allocator->stack[top + 1] = (Operand){OPERAND_CONSTANT, code[offset + 1]};
+            allocator->depth++;
+            break;
+        }
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            RegisterOp op = code[offset] == OP_NIL ? REG_LOAD_NIL
+                : code[offset] == OP_TRUE ? REG_LOAD_TRUE
+                : REG_LOAD_FALSE;
+            emitRegister(allocator, op, top + 1, 0, 0);
+            produced(allocator, top + 1);
+            allocator->depth++;
+            break;
+        }
+        case OP_POP: {
+            allocator->depth--;
+            allocator->producer = -1;
+            break;
+        }
+        case OP_GET_LOCAL: {
+            allocator->stack[top + 1] = operandAt(allocator, code[offset + 1]);
+            allocator->depth++;
+            break;
+        }
+        case OP_SET_LOCAL: {
+            int slot = code[offset + 1];
+            if (slot == top) {
+                break;
+            }
+            // 代入する前の値を参照している値を先に自分のレジスタへ移す
+            for (int i = 0; i < allocator->depth; i++) {
+                if (allocator->stack[i].type == OPERAND_REGISTER && allocator->stack[i].index == slot) {
+                    materialize(allocator, i);
+                }
+            }
+            Operand value = allocator->stack[top];
+            if (value.type == OPERAND_HOME && allocator->producer == chunk->registerCount - 1
+                && REG_A(chunk->registerCode[allocator->producer]) == (uint32_t)top) {
+                // 値を計算した命令の書き先を、一時的なレジスタからローカル変数に付け替える
+                uint32_t instruction = chunk->registerCode[allocator->producer];
+                chunk->registerCode[allocator->producer] = (instruction & ~(0xffu << 8)) | (uint32_t)slot << 8;
+                setOperand(allocator, top, (Operand){OPERAND_REGISTER, slot});
+            } else if (value.type == OPERAND_CONSTANT) {
+                emitRegister(allocator, REG_LOAD_CONSTANT, slot, value.index, 0);
+            } else {
+                emitRegister(allocator, REG_MOVE, slot, operandAt(allocator, top).index, 0);
+            }
+            allocator->stack[slot].type = OPERAND_HOME;
+            break;
+        }
+        case OP_GET_GLOBAL: {
+            emitRegister(allocator, REG_GET_GLOBAL, top + 1, code[offset + 1], 0);
+            produced(allocator, top + 1);
+            allocator->depth++;
+            break;
+        }
+        case OP_DEFINE_GLOBAL: {
+            emitRegister(allocator, REG_DEFINE_GLOBAL, registerOf(allocator, top), code[offset + 1], 0);
+            allocator->depth--;
+            break;
+        }
+        case OP_SET_GLOBAL: {
+            emitRegister(allocator, REG_SET_GLOBAL, registerOf(allocator, top), code[offset + 1], 0);
+            break;
+        }
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_LESS:
+        case OP_LESS_NUM: {
+            int resume = fuseCompare(allocator, genericBinary(code[offset]), next);
+            if (resume != -1) {
+                return resume;
+            }
+            binaryRegister(allocator, genericBinary(code[offset]));
+            break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM: {
+            binaryRegister(allocator, genericBinary(code[offset]));
+            break;
+        }
+        case OP_NOT:
+        case OP_NEGATE: {
+            RegisterOp op = code[offset] == OP_NOT ? REG_NOT : REG_NEGATE;
+            emitRegister(allocator, op, top, registerOf(allocator, top), 0);
+            produced(allocator, top);
+            break;
+        }
+        case OP_PRINT: {
+            emitRegister(allocator, REG_PRINT, registerOf(allocator, top), 0, 0);
+            allocator->depth--;
+            break;
+        }
+        case OP_JUMP:
+        case OP_LOOP: {
+            flushBelow(allocator, allocator->depth);
+            emitRegisterJump(allocator, REG_JUMP, 0, 0, 0, jumpTarget(chunk, offset));
+            break;
+        }
+        case OP_JUMP_IF_FALSE: {
+            int condition;
+            if (conditionDiscarded(allocator, offset)) {
+                flushBelow(allocator, top);
+                condition = registerOf(allocator, top);
+            } else {
+                // and, orの左辺はジャンプ先でも値として残る
+                flushBelow(allocator, allocator->depth);
+                condition = top;
+            }
+            emitRegisterJump(allocator, REG_JUMP_IF_FALSE, condition, 0, 0, jumpTarget(chunk, offset));
+            break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP: {
+            int count = code[offset + 1];
+            RegisterOp op;
+            int base;
+            switch (code[offset]) {
+                case OP_CALL: op = REG_CALL; base = allocator->depth - count - 1; break;
+                case OP_TAIL_CALL: op = REG_TAIL_CALL; base = allocator->depth - count - 1; break;
+                case OP_BUILD_LIST: op = REG_BUILD_LIST; base = allocator->depth - count; break;
+                default: op = REG_BUILD_MAP; base = allocator->depth - count * 2; break;
+            }
+            // 関数と引数(要素)はフレームの上で連続していなければならない
+            for (int i = base; i < allocator->depth; i++) {
+                materialize(allocator, i);
+            }
+            emitRegister(allocator, op, base, count, 0);
+            allocator->stack[base].type = OPERAND_HOME;
+            allocator->depth = base + 1;
+            break;
+        }
+        case OP_INDEX_GET: {
+            int container = registerOf(allocator, top - 1);
+            int key = registerOf(allocator, top);
+            emitRegister(allocator, REG_INDEX_GET, top - 1, container, key);
+            produced(allocator, top - 1);
+            allocator->depth--;
+            break;
+        }
+        case OP_INDEX_SET: {
+            Operand value = allocator->stack[top];
+            int container = registerOf(allocator, top - 2);
+            int key = registerOf(allocator, top - 1);
+            emitRegister(allocator, REG_INDEX_SET, container, key, registerOf(allocator, top));
+            // 代入は式なので代入した値を残す
+            if (value.type == OPERAND_CONSTANT || (value.type == OPERAND_REGISTER && value.index <= top - 2)) {
+                setOperand(allocator, top - 2, value);
+            } else if (next < chunk->count && code[next] == OP_POP && !isTarget(allocator, next)) {
+                // すぐに捨てる値は移さない
+                allocator->stack[top - 2].type = OPERAND_HOME;
+            } else {
+                emitRegister(allocator, REG_MOVE, top - 2, top, 0);
+                allocator->stack[top - 2].type = OPERAND_HOME;
+            }
+            allocator->depth -= 2;
+            break;
+        }
+        case OP_RETURN: {
+            emitRegister(allocator, REG_RETURN, registerOf(allocator, top), 0, 0);
+            break;
+        }
+    }
+    return next;
+}
+
+bool allocateRegisters(Chunk* chunk, int offset, int initialDepth) {
+    // レジスタの番号は8bit
+    if (chunk->maxStack > UINT8_COUNT) {
+        return false;
+    }
+    int* depths = stackDepths(chunk, offset, initialDepth);
+    if (depths == NULL) {
+        return false;
+    }
+    int length = chunk->count - offset;
+
+    Allocator allocator;
+    allocator.chunk = chunk;
+    allocator.start = offset;
+    allocator.targets = ALLOCATE(bool, length);
+    allocator.labels = ALLOCATE(int, length);
+    allocator.patches = NULL;
+    allocator.patchCount = 0;
+    allocator.patchCapacity = 0;
+    allocator.producer = -1;
+    for (int i = 0; i < length; i++) {
+        allocator.targets[i] = false;
+        allocator.labels[i] = -1;
+    }
+    // 到達する命令のジャンプ先に印を付ける(命令の途中は-2、到達しない命令は-1)
+    for (int i = offset; i < chunk->count; i++) {
+        uint8_t instruction = chunk->code[i];
+        if (depths[i - offset] >= 0 && (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP)) {
+            allocator.targets[jumpTarget(chunk, i) - offset] = true;
+        }
+    }
+
+    freeRegisterCode(chunk);
+    bool live = false; // 直前の命令から流れ込むか
+    for (int i = offset; i < chunk->count;) {
+        int next = i + 1;
+        while (next < chunk->count && depths[next - offset] == -2) {
+            next++;
+        }
+        int depth = depths[i - offset];
+        if (depth < 0) {
+            i = next;
+            continue;
+        }
+        if (isTarget(&allocator, i) || !live) {
+            // ジャンプ先では、どの経路から来ても値はすべて自分のレジスタにある
+            if (live) {
+                flushBelow(&allocator, depth);
+            }
+            allocator.labels[i - offset] = chunk->registerCount;
+            for (int slot = 0; slot < depth; slot++) {
+                allocator.stack[slot].type = OPERAND_HOME;
+            }
+            allocator.producer = -1;
+        }
+        allocator.depth = depth;
+        allocator.line = chunk->lines[i];
+        uint8_t instruction = chunk->code[i];
+        i = translateInstruction(&allocator, i, next);
+        live = instruction != OP_JUMP && instruction != OP_LOOP && instruction != OP_RETURN;
+    }
+    for (int i = 0; i < allocator.patchCount; i++) {
+        uint32_t* target = &chunk->registerCode[allocator.patches[i]];
+        *target = (uint32_t)allocator.labels[*target - offset];
+    }
+    chunk->frameSize = chunk->maxStack;
+
+    FREE_ARRAY(int, depths, length);
+    FREE_ARRAY(bool, allocator.targets, length);
+    FREE_ARRAY(int, allocator.labels, length);
+    FREE_ARRAY(int, allocator.patches, allocator.patchCapacity);
+    return true;
+}
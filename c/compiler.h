@@ -3,7 +3,25 @@
 
 #include "object.h"
 #include "chunk.h"
+#include "vm.h"
 
-bool compile(const char* source, Chunk *chunk);
+/**
+ * sourceをchunkにコンパイルする
+ * 状態はすべて呼び出しごとに作るので、VMが別なら複数のスレッドから同時に呼べる
+ * @param vm 文字列定数をinternするVM
+ */
+bool compile(VM* vm, const char* source, Chunk* chunk);
+/**
+ * fdから少しずつ読みながらコンパイルする
+ * ソース全体をメモリに置かないので、巨大なスクリプトやパイプからの入力に使う
+ */
+bool compileStream(VM* vm, int fd, Chunk* chunk);
+/**
+ * 検査を通ったchunkのoffsetから末尾までを、レジスタ命令(--engine=register)に翻訳する
+ * 結果はchunk->registerCodeに置き換え、使うレジスタの数をchunk->frameSizeに記録する
+ * @param initialDepth offsetの命令を実行する直前のスタックの深さ(関数ならarity + 1)
+ * @return レジスタが256個を超えて翻訳できなければfalse
+ */
+bool allocateRegisters(Chunk* chunk, int offset, int initialDepth);
 
 #endif
\ No newline at end of file
@@ -9,6 +9,52 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     }
 }
 
+static const char* opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_BUILD_LIST] = "OP_BUILD_LIST",
+    [OP_BUILD_MAP] = "OP_BUILD_MAP",
+    [OP_INDEX_GET] = "OP_INDEX_GET",
+    [OP_INDEX_SET] = "OP_INDEX_SET",
+    [OP_RETURN] = "OP_RETURN",
+};
+
+const char* opcodeName(uint8_t instruction) {
+    if (instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[instruction] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcodeNames[instruction];
+}
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -22,6 +68,22 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int byteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 2;
+}
+
+/**
+ * @param sign 1なら前方へのジャンプ、-1なら後方へのジャンプ(OP_LOOP)
+ */
+static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    return offset + 3;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -39,6 +101,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_TRUE", offset);
         case OP_FALSE:
             return simpleInstruction("OP_FALSE", offset);
+        case OP_POP:
+            return simpleInstruction("OP_POP", offset);
+        case OP_GET_LOCAL:
+            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL:
+            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_GET_GLOBAL:
+            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL:
+            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL:
+            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -53,16 +127,158 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:
             return simpleInstruction("OP_DIVIDE", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
         case OP_NOT:
             return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
+        case OP_JUMP:
+            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LOOP:
+            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_CALL:
+            return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_BUILD_MAP:
+            return byteInstruction("OP_BUILD_MAP", chunk, offset);
+        case OP_INDEX_GET:
+            return simpleInstruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:
+            return simpleInstruction("OP_INDEX_SET", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
-}
\ No newline at end of file
+}
+static const char* registerOpNames[] = {
+    [REG_MOVE] = "REG_MOVE",
+    [REG_LOAD_CONSTANT] = "REG_LOAD_CONSTANT",
+    [REG_LOAD_NIL] = "REG_LOAD_NIL",
+    [REG_LOAD_TRUE] = "REG_LOAD_TRUE",
+    [REG_LOAD_FALSE] = "REG_LOAD_FALSE",
+    [REG_GET_GLOBAL] = "REG_GET_GLOBAL",
+    [REG_DEFINE_GLOBAL] = "REG_DEFINE_GLOBAL",
+    [REG_SET_GLOBAL] = "REG_SET_GLOBAL",
+    [REG_EQUAL] = "REG_EQUAL",
+    [REG_EQUAL_K] = "REG_EQUAL_K",
+    [REG_GREATER] = "REG_GREATER",
+    [REG_GREATER_K] = "REG_GREATER_K",
+    [REG_LESS] = "REG_LESS",
+    [REG_LESS_K] = "REG_LESS_K",
+    [REG_ADD] = "REG_ADD",
+    [REG_ADD_K] = "REG_ADD_K",
+    [REG_SUBTRACT] = "REG_SUBTRACT",
+    [REG_SUBTRACT_K] = "REG_SUBTRACT_K",
+    [REG_MULTIPLY] = "REG_MULTIPLY",
+    [REG_MULTIPLY_K] = "REG_MULTIPLY_K",
+    [REG_DIVIDE] = "REG_DIVIDE",
+    [REG_DIVIDE_K] = "REG_DIVIDE_K",
+    [REG_NOT] = "REG_NOT",
+    [REG_NEGATE] = "REG_NEGATE",
+    [REG_PRINT] = "REG_PRINT",
+    [REG_JUMP] = "REG_JUMP",
+    [REG_JUMP_IF_FALSE] = "REG_JUMP_IF_FALSE",
+    [REG_JUMP_IF_EQUAL] = "REG_JUMP_IF_EQUAL",
+    [REG_JUMP_IF_EQUAL_K] = "REG_JUMP_IF_EQUAL_K",
+    [REG_JUMP_IF_NOT_EQUAL] = "REG_JUMP_IF_NOT_EQUAL",
+    [REG_JUMP_IF_NOT_EQUAL_K] = "REG_JUMP_IF_NOT_EQUAL_K",
+    [REG_JUMP_IF_GREATER] = "REG_JUMP_IF_GREATER",
+    [REG_JUMP_IF_GREATER_K] = "REG_JUMP_IF_GREATER_K",
+    [REG_JUMP_IF_NOT_GREATER] = "REG_JUMP_IF_NOT_GREATER",
+    [REG_JUMP_IF_NOT_GREATER_K] = "REG_JUMP_IF_NOT_GREATER_K",
+    [REG_JUMP_IF_LESS] = "REG_JUMP_IF_LESS",
+    [REG_JUMP_IF_LESS_K] = "REG_JUMP_IF_LESS_K",
+    [REG_JUMP_IF_NOT_LESS] = "REG_JUMP_IF_NOT_LESS",
+    [REG_JUMP_IF_NOT_LESS_K] = "REG_JUMP_IF_NOT_LESS_K",
+    [REG_CALL] = "REG_CALL",
+    [REG_TAIL_CALL] = "REG_TAIL_CALL",
+    [REG_BUILD_LIST] = "REG_BUILD_LIST",
+    [REG_BUILD_MAP] = "REG_BUILD_MAP",
+    [REG_INDEX_GET] = "REG_INDEX_GET",
+    [REG_INDEX_SET] = "REG_INDEX_SET",
+    [REG_RETURN] = "REG_RETURN",
+};
+
+void disassembleRegisters(Chunk* chunk, const char* name) {
+    printf("== %s (%d registers) ==\n", name, chunk->frameSize);
+    for (int offset = 0; offset < chunk->registerCount;) {
+        offset = disassembleRegisterInstruction(chunk, offset);
+    }
+}
+
+/**
+ * A, B, Cをそのまま表示し、定数とジャンプ先を後ろに添える
+ */
+int disassembleRegisterInstruction(Chunk* chunk, int offset) {
+    printf("%04d ", offset);
+    if (offset > 0 && chunk->registerLines[offset] == chunk->registerLines[offset - 1]) {
+        printf("   | ");
+    } else {
+        printf("%4d ", chunk->registerLines[offset]);
+    }
+    uint32_t instruction = chunk->registerCode[offset];
+    uint32_t op = REG_OP(instruction);
+    if (op >= sizeof(registerOpNames) / sizeof(registerOpNames[0])) {
+        printf("Unknown register op %u\n", op);
+        return offset + 1;
+    }
+    printf("%-26s %4u %4u %4u", registerOpNames[op], REG_A(instruction), REG_B(instruction), REG_C(instruction));
+
+    int constant = -1;
+    switch (op) {
+        case REG_LOAD_CONSTANT:
+        case REG_GET_GLOBAL:
+        case REG_DEFINE_GLOBAL:
+        case REG_SET_GLOBAL:
+            constant = (int)REG_B(instruction);
+            break;
+        case REG_EQUAL_K:
+        case REG_GREATER_K:
+        case REG_LESS_K:
+        case REG_ADD_K:
+        case REG_SUBTRACT_K:
+        case REG_MULTIPLY_K:
+        case REG_DIVIDE_K:
+        case REG_JUMP_IF_EQUAL_K:
+        case REG_JUMP_IF_NOT_EQUAL_K:
+        case REG_JUMP_IF_GREATER_K:
+        case REG_JUMP_IF_NOT_GREATER_K:
+        case REG_JUMP_IF_LESS_K:
+        case REG_JUMP_IF_NOT_LESS_K:
+            constant = (int)REG_C(instruction);
+            break;
+        default:
+            break;
+    }
+    if (constant != -1) {
+        printf(" '");
+        printValue(chunk->constants.values[constant]);
+        printf("'");
+    }
+    if (op >= REG_JUMP && op <= REG_JUMP_IF_NOT_LESS_K) {
+        printf(" -> %u\n", chunk->registerCode[offset + 1]);
+        return offset + 2;
+    }
+    printf("\n");
+    return offset + 1;
+}
@@ -5,6 +5,12 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* opcodeName(uint8_t instruction);
+/**
+ * allocateRegistersが翻訳したレジスタ命令を表示する(--engine=register --dump)
+ */
+void disassembleRegisters(Chunk* chunk, const char* name);
+int disassembleRegisterInstruction(Chunk* chunk, int offset);
 
 
 #endif
\ No newline at end of file
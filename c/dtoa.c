@@ -0,0 +1,368 @@
+#include "dtoa.h"
+#include <string.h>
+
+/**
+ * Grisu2による浮動小数点数の10進変換
+ *
+ * Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with Integers" (2010)
+ * 64ビットの整数演算だけで、元のdoubleに戻せる桁列を作る
+ * ほとんどの値(99.9%以上)で最短の桁列になり、そうでない値も1桁長いだけで必ず元に戻せる
+ * snprintf("%.17g")とstrtodで最短を探すよりも1桁以上速い
+ */
+
+// 仮数部fと2の指数eで f * 2^e を表す(diy fp)
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DOUBLE_SIGNIFICAND_SIZE 52
+#define DOUBLE_EXPONENT_BIAS (0x3ff + DOUBLE_SIGNIFICAND_SIZE)
+#define DOUBLE_HIDDEN_BIT ((uint64_t)1 << DOUBLE_SIGNIFICAND_SIZE)
+#define DOUBLE_SIGNIFICAND_MASK (DOUBLE_HIDDEN_BIT - 1)
+
+// 10^kの正規化した近似値、kは-348から340まで8おき(Pythonの多倍長整数で生成した)
+static const DiyFp cachedPowers[] = {
+    {0xfa8fd5a0081c0288ull, -1220}, // 1e-348
+    {0xbaaee17fa23ebf76ull, -1193}, // 1e-340
+    {0x8b16fb203055ac76ull, -1166}, // 1e-332
+    {0xcf42894a5dce35eaull, -1140}, // 1e-324
+    {0x9a6bb0aa55653b2dull, -1113}, // 1e-316
+    {0xe61acf033d1a45dfull, -1087}, // 1e-308
+    {0xab70fe17c79ac6caull, -1060}, // 1e-300
+    {0xff77b1fcbebcdc4full, -1034}, // 1e-292
+    {0xbe5691ef416bd60cull, -1007}, // 1e-284
+    {0x8dd01fad907ffc3cull, -980}, // 1e-276
+    {0xd3515c2831559a83ull, -954}, // 1e-268
+    {0x9d71ac8fada6c9b5ull, -927}, // 1e-260
+    {0xea9c227723ee8bcbull, -901}, // 1e-252
+    {0xaecc49914078536dull, -874}, // 1e-244
+    {0x823c12795db6ce57ull, -847}, // 1e-236
+    {0xc21094364dfb5637ull, -821}, // 1e-228
+    {0x9096ea6f3848984full, -794}, // 1e-220
+    {0xd77485cb25823ac7ull, -768}, // 1e-212
+    {0xa086cfcd97bf97f4ull, -741}, // 1e-204
+    {0xef340a98172aace5ull, -715}, // 1e-196
+    {0xb23867fb2a35b28eull, -688}, // 1e-188
+    {0x84c8d4dfd2c63f3bull, -661}, // 1e-180
+    {0xc5dd44271ad3cdbaull, -635}, // 1e-172
+    {0x936b9fcebb25c996ull, -608}, // 1e-164
+    {0xdbac6c247d62a584ull, -582}, // 1e-156
+    {0xa3ab66580d5fdaf6ull, -555}, // 1e-148
+    {0xf3e2f893dec3f126ull, -529}, // 1e-140
+    {0xb5b5ada8aaff80b8ull, -502}, // 1e-132
+    {0x87625f056c7c4a8bull, -475}, // 1e-124
+    {0xc9bcff6034c13053ull, -449}, // 1e-116
+    {0x964e858c91ba2655ull, -422}, // 1e-108
+    {0xdff9772470297ebdull, -396}, // 1e-100
+    {0xa6dfbd9fb8e5b88full, -369}, // 1e-92
+    {0xf8a95fcf88747d94ull, -343}, // 1e-84
+    {0xb94470938fa89bcfull, -316}, // 1e-76
+    {0x8a08f0f8bf0f156bull, -289}, // 1e-68
+    {0xcdb02555653131b6ull, -263}, // 1e-60
+    {0x993fe2c6d07b7facull, -236}, // 1e-52
+    {0xe45c10c42a2b3b06ull, -210}, // 1e-44
+    {0xaa242499697392d3ull, -183}, // 1e-36
+    {0xfd87b5f28300ca0eull, -157}, // 1e-28
+    {0xbce5086492111aebull, -130}, // 1e-20
+    {0x8cbccc096f5088ccull, -103}, // 1e-12
+    {0xd1b71758e219652cull, -77}, // 1e-4
+    {0x9c40000000000000ull, -50}, // 1e4
+    {0xe8d4a51000000000ull, -24}, // 1e12
+    {0xad78ebc5ac620000ull, 3}, // 1e20
+    {0x813f3978f8940984ull, 30}, // 1e28
+    {0xc097ce7bc90715b3ull, 56}, // 1e36
+    {0x8f7e32ce7bea5c70ull, 83}, // 1e44
+    {0xd5d238a4abe98068ull, 109}, // 1e52
+    {0x9f4f2726179a2245ull, 136}, // 1e60
+    {0xed63a231d4c4fb27ull, 162}, // 1e68
+    {0xb0de65388cc8ada8ull, 189}, // 1e76
+    {0x83c7088e1aab65dbull, 216}, // 1e84
+    {0xc45d1df942711d9aull, 242}, // 1e92
+    {0x924d692ca61be758ull, 269}, // 1e100
+    {0xda01ee641a708deaull, 295}, // 1e108
+    {0xa26da3999aef774aull, 322}, // 1e116
+    {0xf209787bb47d6b85ull, 348}, // 1e124
+    {0xb454e4a179dd1877ull, 375}, // 1e132
+    {0x865b86925b9bc5c2ull, 402}, // 1e140
+    {0xc83553c5c8965d3dull, 428}, // 1e148
+    {0x952ab45cfa97a0b3ull, 455}, // 1e156
+    {0xde469fbd99a05fe3ull, 481}, // 1e164
+    {0xa59bc234db398c25ull, 508}, // 1e172
+    {0xf6c69a72a3989f5cull, 534}, // 1e180
+    {0xb7dcbf5354e9beceull, 561}, // 1e188
+    {0x88fcf317f22241e2ull, 588}, // 1e196
+    {0xcc20ce9bd35c78a5ull, 614}, // 1e204
+    {0x98165af37b2153dfull, 641}, // 1e212
+    {0xe2a0b5dc971f303aull, 667}, // 1e220
+    {0xa8d9d1535ce3b396ull, 694}, // 1e228
+    {0xfb9b7cd9a4a7443cull, 720}, // 1e236
+    {0xbb764c4ca7a44410ull, 747}, // 1e244
+    {0x8bab8eefb6409c1aull, 774}, // 1e252
+    {0xd01fef10a657842cull, 800}, // 1e260
+    {0x9b10a4e5e9913129ull, 827}, // 1e268
+    {0xe7109bfba19c0c9dull, 853}, // 1e276
+    {0xac2820d9623bf429ull, 880}, // 1e284
+    {0x80444b5e7aa7cf85ull, 907}, // 1e292
+    {0xbf21e44003acdd2dull, 933}, // 1e300
+    {0x8e679c2f5e44ff8full, 960}, // 1e308
+    {0xd433179d9c8cb841ull, 986}, // 1e316
+    {0x9e19db92b4e31ba9ull, 1013}, // 1e324
+    {0xeb96bf6ebadf77d9ull, 1039}, // 1e332
+    {0xaf87023b9bf0ee6bull, 1066}, // 1e340
+};
+
+static const uint64_t powersOf10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+    10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull,
+    1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+static DiyFp multiply(DiyFp x, DiyFp y) {
+    const uint64_t mask = 0xffffffffu;
+    uint64_t a = x.f >> 32;
+    uint64_t b = x.f & mask;
+    uint64_t c = y.f >> 32;
+    uint64_t d = y.f & mask;
+    uint64_t ac = a * c;
+    uint64_t bc = b * c;
+    uint64_t ad = a * d;
+    uint64_t bd = b * d;
+    uint64_t middle = (bd >> 32) + (ad & mask) + (bc & mask);
+    middle += (uint64_t)1 << 31; // 四捨五入
+    DiyFp result = {ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64};
+    return result;
+}
+
+static DiyFp normalize(DiyFp x) {
+    while ((x.f & ((uint64_t)1 << 63)) == 0) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/**
+ * valueと隣のdoubleとの中間点(丸めの境界)を求める
+ * この間にある10進数なら、どれを出力しても元のvalueに戻る
+ */
+static void boundaries(DiyFp value, DiyFp* minus, DiyFp* plus) {
+    DiyFp upper = {(value.f << 1) + 1, value.e - 1};
+    *plus = normalize(upper);
+    // 仮数部が2のべき乗なら、下の隣との間隔は上の半分になる
+    DiyFp lower = value.f == DOUBLE_HIDDEN_BIT
+        ? (DiyFp){(value.f << 2) - 1, value.e - 2}
+        : (DiyFp){(value.f << 1) - 1, value.e - 1};
+    lower.f <<= lower.e - plus->e;
+    lower.e = plus->e;
+    *minus = lower;
+}
+
+/**
+ * 掛けた結果の指数が[-60, -32]に入る10のべき乗を選ぶ
+ * @param decimalExponent 選んだべきの符号を反転した10の指数
+ */
+static DiyFp cachedPower(int e, int* decimalExponent) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (dk - k > 0.0) {
+        k++;
+    }
+    int index = (k >> 3) + 1;
+    *decimalExponent = -(-348 + index * 8);
+    return cachedPowers[index];
+}
+
+/**
+ * 最後の桁をwに近づける方向に調整する
+ */
+static void roundWeed(char* digits, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t distance) {
+    while (rest < distance && delta - rest >= tenKappa
+           && (rest + tenKappa < distance || distance - rest > rest + tenKappa - distance)) {
+        digits[length - 1]--;
+        rest += tenKappa;
+    }
+}
+
+static int countDigits(uint32_t n) {
+    int count = 1;
+    while (count < 10 && n >= powersOf10[count]) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * wの近く、[plus - delta, plus]に入る最短の桁列を作る
+ * @param exponent 桁列の後ろにつく10の指数(入力と出力)
+ * @return 桁数
+ */
+static int generateDigits(DiyFp w, DiyFp plus, uint64_t delta, char* digits, int* exponent) {
+    DiyFp one = {(uint64_t)1 << -plus.e, plus.e};
+    uint64_t distance = plus.f - w.f;
+    uint32_t integral = (uint32_t)(plus.f >> -one.e);
+    uint64_t fraction = plus.f & (one.f - 1);
+    int kappa = countDigits(integral);
+    int length = 0;
+
+    // 整数部分
+    while (kappa > 0) {
+        uint32_t power = (uint32_t)powersOf10[kappa - 1];
+        uint32_t digit = integral / power;
+        integral %= power;
+        if (digit != 0 || length != 0) {
+            digits[length++] = (char)('0' + digit);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest <= delta) {
+            *exponent += kappa;
+            roundWeed(digits, length, delta, rest, powersOf10[kappa] << -one.e, distance);
+            return length;
+        }
+    }
+
+    // 小数部分
+    for (;;) {
+        fraction *= 10;
+        delta *= 10;
+        char digit = (char)(fraction >> -one.e);
+        if (digit != 0 || length != 0) {
+            digits[length++] = (char)('0' + digit);
+        }
+        fraction &= one.f - 1;
+        kappa--;
+        if (fraction < delta) {
+            *exponent += kappa;
+            uint64_t scale = -kappa < 20 ? powersOf10[-kappa] : 0;
+            roundWeed(digits, length, delta, fraction, one.f, distance * scale);
+            return length;
+        }
+    }
+}
+
+/**
+ * 正の有限な値を 桁列 * 10^exponent に変換する
+ * @return 桁数
+ */
+static int grisu2(double number, char* digits, int* exponent) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    int biasedExponent = (int)((bits >> DOUBLE_SIGNIFICAND_SIZE) & 0x7ff);
+    uint64_t significand = bits & DOUBLE_SIGNIFICAND_MASK;
+    DiyFp value;
+    if (biasedExponent != 0) {
+        value.f = significand + DOUBLE_HIDDEN_BIT;
+        value.e = biasedExponent - DOUBLE_EXPONENT_BIAS;
+    } else {
+        // 非正規化数
+        value.f = significand;
+        value.e = 1 - DOUBLE_EXPONENT_BIAS;
+    }
+
+    DiyFp minus, plus;
+    boundaries(value, &minus, &plus);
+    DiyFp power = cachedPower(plus.e, exponent);
+    DiyFp w = multiply(normalize(value), power);
+    DiyFp upper = multiply(plus, power);
+    DiyFp lower = multiply(minus, power);
+    // 掛け算の誤差の分だけ範囲を内側に狭める
+    upper.f--;
+    lower.f++;
+    return generateDigits(w, upper, upper.f - lower.f, digits, exponent);
+}
+
+static int writeExponent(char* buffer, int exponent) {
+    int length = 0;
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0) {
+        exponent = -exponent;
+    }
+    // %gと同じく指数は2桁以上
+    if (exponent >= 100) {
+        buffer[length++] = (char)('0' + exponent / 100);
+    }
+    buffer[length++] = (char)('0' + exponent / 10 % 10);
+    buffer[length++] = (char)('0' + exponent % 10);
+    return length;
+}
+
+int formatNumber(double number, char* buffer) {
+    int length = 0;
+    if (number != number) {
+        memcpy(buffer, "nan", 4);
+        return 3;
+    }
+    if (signbit(number)) {
+        buffer[length++] = '-';
+        number = -number;
+    }
+    if (number == 0) {
+        buffer[length++] = '0';
+        buffer[length] = '\0';
+        return length;
+    }
+    if (number > 1.7976931348623157e308) {
+        memcpy(buffer + length, "inf", 4);
+        return length + 3;
+    }
+
+    // よく出力される整数は桁を並べるだけにする
+    if (number < 1e15 && number == (double)(uint64_t)number) {
+        uint64_t integer = (uint64_t)number;
+        char reversed[20];
+        int count = 0;
+        do {
+            reversed[count++] = (char)('0' + integer % 10);
+            integer /= 10;
+        } while (integer > 0);
+        while (count > 0) {
+            buffer[length++] = reversed[--count];
+        }
+        buffer[length] = '\0';
+        return length;
+    }
+
+    char digits[20];
+    int exponent;
+    int count = grisu2(number, digits, &exponent);
+    // 先頭の桁の10の指数、%gと同じく-4以上15未満なら指数表記にしない
+    int point = count + exponent;
+    int leading = point - 1;
+    if (leading < -4 || leading >= 15) {
+        buffer[length++] = digits[0];
+        if (count > 1) {
+            buffer[length++] = '.';
+            memcpy(buffer + length, digits + 1, count - 1);
+            length += count - 1;
+        }
+        length += writeExponent(buffer + length, leading);
+    } else if (point <= 0) {
+        // 0.000123
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        for (int i = 0; i < -point; i++) {
+            buffer[length++] = '0';
+        }
+        memcpy(buffer + length, digits, count);
+        length += count;
+    } else if (point >= count) {
+        // 1e15未満の整数はここに来ないが、念のため0を補う
+        memcpy(buffer + length, digits, count);
+        length += count;
+        for (int i = count; i < point; i++) {
+            buffer[length++] = '0';
+        }
+    } else {
+        // 123.456
+        memcpy(buffer + length, digits, point);
+        length += point;
+        buffer[length++] = '.';
+        memcpy(buffer + length, digits + point, count - point);
+        length += count - point;
+    }
+    buffer[length] = '\0';
+    return length;
+}
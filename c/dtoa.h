@@ -0,0 +1,19 @@
+#ifndef DTOA_H
+#define DTOA_H
+
+#include "common.h"
+#include <math.h>
+
+// formatNumberの出力に必要なバッファの大きさ
+#define NUMBER_BUFFER_SIZE 32
+
+/**
+ * numberを元の値に戻せる最短の10進表記でbufferに書く
+ * 0.1は"0.1"、整数は"42"のように小数点なしになる
+ * 先頭の桁の指数が-4未満か15以上なら"1.5e+20"のような指数表記にする
+ * @param buffer NUMBER_BUFFER_SIZE以上の大きさ
+ * @return 書いた文字数('\0'は含まない)
+ */
+int formatNumber(double number, char* buffer);
+
+#endif
@@ -0,0 +1,729 @@
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "verifier.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC "CLOXIMG"
+#define IMAGE_VERSION 4
+// 書き出したマシンと読むマシンのバイト順が違えば、この値が変わって見える
+#define IMAGE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t stringCount;
+    uint32_t globalCount;
+    uint32_t objectCount;
+    uint32_t reserved; // 0
+    uint64_t stringsOffset; // 文字列の並びの先頭
+    uint64_t globalsOffset; // グローバル変数の並びの先頭
+    uint64_t objectsOffset; // list、map、関数の並びの先頭
+    uint64_t size; // ファイル全体の大きさ
+} ImageHeader;
+
+/**
+ * 文字列1つ分
+ * 後ろにlength文字と'\0'が続き、次の文字列は4バイト境界から始まる
+ */
+typedef struct {
+    uint32_t length;
+    uint32_t hash;
+} ImageString;
+
+typedef enum {
+    IMAGE_NIL,
+    IMAGE_BOOL,
+    IMAGE_NUMBER,
+    IMAGE_STRING,
+    IMAGE_NATIVE,
+    IMAGE_LIST,
+    IMAGE_MAP,
+    IMAGE_FUNCTION,
+} ImageValueType;
+
+// payloadはnumberのビット列、boolの0か1、文字列の番号、組み込み関数の名前の番号、
+// またはlist、map、関数の番号
+typedef struct {
+    uint32_t name; // 名前の文字列の番号
+    uint32_t type; // ImageValueType
+    uint64_t payload;
+} ImageGlobal;
+
+/**
+ * list、map、関数1つ分
+ * 後ろにlistならcount個、mapならキーと値の組がcount個のImageValueが続く
+ * 関数ならImageFunctionと命令の並びの後に、count個の定数のImageValueが続く
+ * 要素が別のlistやmapを指すときは番号で指すので、共有や循環もそのまま戻る
+ */
+typedef struct {
+    uint32_t type; // IMAGE_LIST、IMAGE_MAP、IMAGE_FUNCTION
+    uint32_t count;
+} ImageObject;
+
+/**
+ * 関数の本体
+ * 後ろにcodeCount個の行番号(uint32_t)とcodeCountバイトの命令が続き、定数は4バイト境界から始まる
+ * 読み込んだ関数はverifyFunctionで検査し、求めたスタックの深さがmaxStackと合わなければ読まない
+ */
+typedef struct {
+    uint32_t name; // 名前の文字列の番号
+    uint32_t arity;
+    uint32_t maxStack;
+    uint32_t codeCount;
+} ImageFunction;
+
+typedef struct {
+    uint32_t type; // ImageValueType
+    uint32_t reserved; // 0
+    uint64_t payload; // ImageGlobalと同じ
+} ImageValue;
+
+static size_t stringRecordSize(uint32_t length) {
+    return (sizeof(ImageString) + length + 1 + 3) & ~(size_t)3;
+}
+
+/**
+ * @return recordの後ろに続くImageValueの数
+ */
+static size_t objectValueCount(ImageObject record) {
+    return record.type == IMAGE_MAP ? (size_t)record.count * 2 : record.count;
+}
+
+/**
+ * @return ImageFunctionの後ろに続く行番号と命令の大きさ
+ */
+static size_t functionCodeSize(uint32_t codeCount) {
+    return ((size_t)codeCount * (sizeof(uint32_t) + 1) + 3) & ~(size_t)3;
+}
+
+/**
+ * 保存する文字列とlist、map、関数に番号を振る
+ * 番号はindexesにnumberとして記録し、strings[番号]やobjects[番号]で元に戻せるようにする
+ */
+typedef struct {
+    Table stringIndexes;
+    ObjString** strings;
+    int stringCount;
+    int stringCapacity;
+    Table objectIndexes; // キーはlist、map、関数そのもの(同一性で区別する)
+    Obj** objects;
+    int objectCount;
+    int objectCapacity;
+} ImageIndex;
+
+static uint32_t indexString(ImageIndex* index, ObjString* string) {
+    Value number;
+    if (tableGet(&index->stringIndexes, string, &number)) {
+        return (uint32_t)AS_NUMBER(number);
+    }
+    if (index->stringCount == index->stringCapacity) {
+        int oldCapacity = index->stringCapacity;
+        index->stringCapacity = GROW_CAPACITY(oldCapacity);
+        index->strings = GROW_ARRAY(ObjString*, index->strings, oldCapacity, index->stringCapacity);
+    }
+    index->strings[index->stringCount] = string;
+    tableSet(&index->stringIndexes, string, NUMBER_VAL(index->stringCount));
+    return (uint32_t)index->stringCount++;
+}
+
+/**
+ * 中身はwriteImageがobjectsを順に辿って書くので、ここでは番号を振るだけ
+ */
+static uint32_t indexObject(ImageIndex* index, Obj* object) {
+    Value number;
+    if (tableGetValue(&index->objectIndexes, OBJ_VAL(object), &number)) {
+        return (uint32_t)AS_NUMBER(number);
+    }
+    if (index->objectCount == index->objectCapacity) {
+        int oldCapacity = index->objectCapacity;
+        index->objectCapacity = GROW_CAPACITY(oldCapacity);
+        index->objects = GROW_ARRAY(Obj*, index->objects, oldCapacity, index->objectCapacity);
+    }
+    index->objects[index->objectCount] = object;
+    tableSetValue(&index->objectIndexes, OBJ_VAL(object), NUMBER_VAL(index->objectCount));
+    return (uint32_t)index->objectCount++;
+}
+
+/**
+ * @return 保存できない値ならfalse
+ */
+static bool encodeValue(ImageIndex* index, Value value, uint32_t* type, uint64_t* payload) {
+    switch (value.type) {
+        case VAL_NIL: {
+            *type = IMAGE_NIL;
+            *payload = 0;
+            return true;
+        }
+        case VAL_BOOL: {
+            *type = IMAGE_BOOL;
+            *payload = AS_BOOL(value);
+            return true;
+        }
+        case VAL_NUMBER: {
+            double number = AS_NUMBER(value);
+            *type = IMAGE_NUMBER;
+            memcpy(payload, &number, sizeof(number));
+            return true;
+        }
+        case VAL_OBJ: {
+            if (IS_STRING(value)) {
+                *type = IMAGE_STRING;
+                *payload = indexString(index, AS_STRING(value));
+                return true;
+            }
+            // 関数のアドレスはプロセスごとに変わるので、登録した名前で保存する
+            if (IS_NATIVE(value)) {
+                *type = IMAGE_NATIVE;
+                *payload = indexString(index, AS_NATIVE(value)->name);
+                return true;
+            }
+            if (IS_LIST(value) || IS_MAP(value) || IS_FUNCTION(value)) {
+                *type = IS_LIST(value) ? IMAGE_LIST : IS_MAP(value) ? IMAGE_MAP : IMAGE_FUNCTION;
+                *payload = indexObject(index, AS_OBJ(value));
+                return true;
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * list、map、関数の並びを書き出す前にためておく
+ */
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} ImageBuffer;
+
+static void appendBuffer(ImageBuffer* buffer, const void* bytes, size_t size) {
+    if (buffer->capacity - buffer->count < size) {
+        size_t oldCapacity = buffer->capacity;
+        while (buffer->capacity - buffer->count < size) {
+            buffer->capacity = GROW_CAPACITY(buffer->capacity);
+        }
+        buffer->bytes = GROW_ARRAY(uint8_t, buffer->bytes, oldCapacity, buffer->capacity);
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, size);
+    buffer->count += size;
+}
+
+static bool appendValue(ImageIndex* index, ImageBuffer* buffer, Value value) {
+    ImageValue record;
+    memset(&record, 0, sizeof(record));
+    if (!encodeValue(index, value, &record.type, &record.payload)) {
+        return false;
+    }
+    appendBuffer(buffer, &record, sizeof(record));
+    return true;
+}
+
+/**
+ * 関数の名前、引数の数、命令と行番号、定数をbufferに書く
+ */
+static bool appendFunction(ImageIndex* index, ImageBuffer* buffer, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    ImageObject record = {IMAGE_FUNCTION, (uint32_t)chunk->constants.count};
+    appendBuffer(buffer, &record, sizeof(record));
+    ImageFunction body = {indexString(index, function->name), (uint32_t)function->arity,
+                          (uint32_t)chunk->maxStack, (uint32_t)chunk->count};
+    appendBuffer(buffer, &body, sizeof(body));
+    for (int i = 0; i < chunk->count; i++) {
+        uint32_t line = (uint32_t)chunk->lines[i];
+        appendBuffer(buffer, &line, sizeof(line));
+    }
+    appendBuffer(buffer, chunk->code, chunk->count);
+    static const char padding[4] = {0};
+    appendBuffer(buffer, padding, functionCodeSize(body.codeCount) - (sizeof(uint32_t) + 1) * chunk->count);
+
+    bool ok = true;
+    for (int i = 0; i < chunk->constants.count && ok; i++) {
+        ok = appendValue(index, buffer, chunk->constants.values[i]);
+    }
+    return ok;
+}
+
+/**
+ * index->objects[i]の中身をbufferに書く
+ * 中身に初めて出てきたlistやmap、関数はobjectsの後ろに追加されるので、呼び出し側はobjectCountまで続ける
+ */
+static bool appendObject(ImageIndex* index, ImageBuffer* buffer, int i) {
+    Obj* object = index->objects[i];
+    ImageObject record;
+    bool ok = true;
+    if (object->type == OBJ_FUNCTION) {
+        ok = appendFunction(index, buffer, (ObjFunction*)object);
+    } else if (object->type == OBJ_LIST) {
+        ObjList* list = (ObjList*)object;
+        record.type = IMAGE_LIST;
+        record.count = (uint32_t)list->items.count;
+        appendBuffer(buffer, &record, sizeof(record));
+        for (int j = 0; j < list->items.count && ok; j++) {
+            ok = appendValue(index, buffer, list->items.values[j]);
+        }
+    } else {
+        ObjMap* map = (ObjMap*)object;
+        record.type = IMAGE_MAP;
+        record.count = (uint32_t)map->count;
+        appendBuffer(buffer, &record, sizeof(record));
+        for (int j = 0; j < map->table.capacity && ok; j++) {
+            Entry* entry = &map->table.entries[j];
+            if (!IS_NIL(entry->key)) {
+                ok = appendValue(index, buffer, entry->key) && appendValue(index, buffer, entry->value);
+            }
+        }
+    }
+    return ok;
+}
+
+static bool writeImage(FILE* file, VM* vm) {
+    ImageIndex index;
+    initTable(&index.stringIndexes);
+    index.strings = NULL;
+    index.stringCount = 0;
+    index.stringCapacity = 0;
+    initTable(&index.objectIndexes);
+    index.objects = NULL;
+    index.objectCount = 0;
+    index.objectCapacity = 0;
+
+    // intern表の文字列を先に並べ、共有intern表にしかない文字列はグローバル変数から拾う
+    for (int i = 0; i < vm->strings.capacity; i++) {
+        if (!IS_NIL(vm->strings.entries[i].key)) {
+            indexString(&index, AS_STRING(vm->strings.entries[i].key));
+        }
+    }
+    int globalCount = 0;
+    ImageGlobal* globals = ALLOCATE(ImageGlobal, vm->globals.count);
+    bool ok = true;
+    for (int i = 0; i < vm->globals.capacity && ok; i++) {
+        Entry* entry = &vm->globals.entries[i];
+        // 登録したときの名前のままの組み込み関数はinitVMが登録し直すので保存しない
+        // var s = sqrt; のような別名は保存する
+        if (IS_NIL(entry->key)
+            || (IS_NATIVE(entry->value) && AS_NATIVE(entry->value)->name == AS_STRING(entry->key))) {
+            continue;
+        }
+        ImageGlobal* global = &globals[globalCount++];
+        ObjString* name = AS_STRING(entry->key);
+        global->name = indexString(&index, name);
+        if (!encodeValue(&index, entry->value, &global->type, &global->payload)) {
+            fprintf(vm->err, "Cannot save global '%s' in a heap image.\n", name->chars);
+            ok = false;
+        }
+    }
+    ImageBuffer objects = {NULL, 0, 0};
+    for (int i = 0; i < index.objectCount && ok; i++) {
+        if (!appendObject(&index, &objects, i)) {
+            fprintf(vm->err, "Cannot save an element of a %s in a heap image.\n",
+                index.objects[i]->type == OBJ_LIST ? "list" : index.objects[i]->type == OBJ_MAP ? "map" : "function");
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        ImageHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+        header.version = IMAGE_VERSION;
+        header.byteOrder = IMAGE_BYTE_ORDER;
+        header.stringCount = (uint32_t)index.stringCount;
+        header.globalCount = (uint32_t)globalCount;
+        header.objectCount = (uint32_t)index.objectCount;
+        header.stringsOffset = sizeof(ImageHeader);
+        header.globalsOffset = header.stringsOffset;
+        for (int i = 0; i < index.stringCount; i++) {
+            header.globalsOffset += stringRecordSize(index.strings[i]->length);
+        }
+        header.objectsOffset = header.globalsOffset + sizeof(ImageGlobal) * globalCount;
+        header.size = header.objectsOffset + objects.count;
+        ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+        static const char padding[4] = {0};
+        for (int i = 0; i < index.stringCount && ok; i++) {
+            ObjString* string = index.strings[i];
+            ImageString record = {(uint32_t)string->length, string->hash};
+            size_t written = sizeof(record) + string->length + 1;
+            ok = fwrite(&record, sizeof(record), 1, file) == 1
+                && fwrite(string->chars, 1, string->length + 1, file) == (size_t)string->length + 1
+                && fwrite(padding, 1, stringRecordSize(string->length) - written, file) == stringRecordSize(string->length) - written;
+        }
+        ok = ok && fwrite(globals, sizeof(ImageGlobal), globalCount, file) == (size_t)globalCount
+            && fwrite(objects.bytes, 1, objects.count, file) == objects.count;
+    }
+
+    FREE_ARRAY(uint8_t, objects.bytes, objects.capacity);
+    FREE_ARRAY(ImageGlobal, globals, vm->globals.count);
+    FREE_ARRAY(Obj*, index.objects, index.objectCapacity);
+    freeTable(&index.objectIndexes);
+    FREE_ARRAY(ObjString*, index.strings, index.stringCapacity);
+    freeTable(&index.stringIndexes);
+    return ok;
+}
+
+bool saveImage(VM* vm, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(vm->err, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+    bool ok = writeImage(file, vm);
+    if (fclose(file) != 0 || !ok) {
+        fprintf(vm->err, "Could not write heap image \"%s\".\n", path);
+        remove(path);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 復元中のimageの文字列とlist、map、関数
+ */
+typedef struct {
+    VM* vm;
+    ObjString** strings;
+    uint32_t stringCount;
+    Obj** objects;
+    uint32_t objectCount;
+} ImageReader;
+
+/**
+ * 組み込み関数は名前でvm->globalsから引くので、グローバル変数を上書きする前に呼ぶ
+ * @return 壊れていればfalse
+ */
+static bool decodeValue(ImageReader* reader, uint32_t type, uint64_t payload, Value* value) {
+    switch (type) {
+        case IMAGE_NIL: {
+            *value = NIL_VAL;
+            return true;
+        }
+        case IMAGE_BOOL: {
+            *value = BOOL_VAL(payload != 0);
+            return true;
+        }
+        case IMAGE_NUMBER: {
+            double number;
+            memcpy(&number, &payload, sizeof(number));
+            *value = NUMBER_VAL(number);
+            return true;
+        }
+        case IMAGE_STRING: {
+            if (payload >= reader->stringCount) {
+                return false;
+            }
+            *value = OBJ_VAL((Obj*)reader->strings[payload]);
+            return true;
+        }
+        case IMAGE_NATIVE: {
+            // このビルドにない組み込み関数なら読めない
+            return payload < reader->stringCount
+                && tableGet(&reader->vm->globals, reader->strings[payload], value) && IS_NATIVE(*value);
+        }
+        case IMAGE_LIST:
+        case IMAGE_MAP:
+        case IMAGE_FUNCTION: {
+            ObjType objectType = type == IMAGE_LIST ? OBJ_LIST : type == IMAGE_MAP ? OBJ_MAP : OBJ_FUNCTION;
+            if (payload >= reader->objectCount || reader->objects[payload]->type != objectType) {
+                return false;
+            }
+            *value = OBJ_VAL(reader->objects[payload]);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * recordの後ろに続く中身がimageに収まっているかを確かめる
+ * @param offset 中身の先頭(recordの直後)
+ * @param bodySize 中身の大きさを書き込む
+ * @return 種類が不明か、imageの末尾を越えればfalse
+ */
+static bool objectBodySize(const uint8_t* image, size_t size, size_t offset, ImageObject record, size_t* bodySize) {
+    if (record.count > INT32_MAX) {
+        return false;
+    }
+    if (record.type == IMAGE_LIST || record.type == IMAGE_MAP) {
+        if ((size - offset) / sizeof(ImageValue) < objectValueCount(record)) {
+            return false;
+        }
+        *bodySize = sizeof(ImageValue) * objectValueCount(record);
+        return true;
+    }
+    if (record.type != IMAGE_FUNCTION || size - offset < sizeof(ImageFunction)) {
+        return false;
+    }
+    ImageFunction function;
+    memcpy(&function, image + offset, sizeof(function));
+    size_t rest = size - offset - sizeof(function);
+    if (function.codeCount > INT32_MAX || rest < functionCodeSize(function.codeCount)
+        || (rest - functionCodeSize(function.codeCount)) / sizeof(ImageValue) < record.count) {
+        return false;
+    }
+    *bodySize = sizeof(function) + functionCodeSize(function.codeCount) + sizeof(ImageValue) * record.count;
+    return true;
+}
+
+/**
+ * recordの後ろに続く値でlistかmapを埋める
+ * valuesはobjectValueCount(record)個あることを確かめてあること
+ */
+static bool fillObject(ImageReader* reader, Obj* object, ImageObject record, const uint8_t* values) {
+    size_t count = objectValueCount(record);
+    Value key = NIL_VAL;
+    for (size_t i = 0; i < count; i++) {
+        ImageValue encoded;
+        memcpy(&encoded, values + sizeof(ImageValue) * i, sizeof(encoded));
+        Value value;
+        if (!decodeValue(reader, encoded.type, encoded.payload, &value)) {
+            return false;
+        }
+        if (record.type == IMAGE_LIST) {
+            appendToList((ObjList*)object, value);
+        } else if (i % 2 == 0) {
+            if (!isMapKey(value)) {
+                return false;
+            }
+            key = value;
+        } else {
+            setMapEntry((ObjMap*)object, key, value);
+        }
+    }
+    return true;
+}
+
+/**
+ * recordの後ろに続く本体で関数を埋める
+ * 命令はまだ検査しない(maxStackは0のまま)、restoreImageがすべて埋めてからverifyFunctionにかける
+ * bodyの大きさはobjectBodySizeで確かめてあること
+ */
+static bool fillFunction(ImageReader* reader, ObjFunction* function, ImageObject record, const uint8_t* body) {
+    ImageFunction header;
+    memcpy(&header, body, sizeof(header));
+    if (header.name >= reader->stringCount || header.arity > UINT8_MAX) {
+        return false;
+    }
+    function->name = reader->strings[header.name];
+    function->arity = (int)header.arity;
+
+    Chunk* chunk = &function->chunk;
+    chunk->code = ALLOCATE(uint8_t, header.codeCount);
+    chunk->lines = ALLOCATE(int, header.codeCount);
+    chunk->count = (int)header.codeCount;
+    chunk->capacity = (int)header.codeCount;
+    const uint8_t* lines = body + sizeof(header);
+    for (uint32_t i = 0; i < header.codeCount; i++) {
+        uint32_t line;
+        memcpy(&line, lines + sizeof(line) * i, sizeof(line));
+        chunk->lines[i] = (int)line;
+    }
+    memcpy(chunk->code, lines + sizeof(uint32_t) * header.codeCount, header.codeCount);
+
+    // コンパイラが定数プールに入れるのは数値、文字列、関数だけ
+    const uint8_t* constants = body + sizeof(header) + functionCodeSize(header.codeCount);
+    for (uint32_t i = 0; i < record.count; i++) {
+        ImageValue encoded;
+        memcpy(&encoded, constants + sizeof(ImageValue) * i, sizeof(encoded));
+        Value value;
+        if ((encoded.type != IMAGE_NUMBER && encoded.type != IMAGE_STRING && encoded.type != IMAGE_FUNCTION)
+            || !decodeValue(reader, encoded.type, encoded.payload, &value)) {
+            return false;
+        }
+        writeValueArray(&chunk->constants, value);
+    }
+    return true;
+}
+
+/**
+ * 関数の定数をたどって、自分自身に戻ってこないことを確かめる
+ * コンパイラが作る関数の入れ子は木になるので、循環があれば壊れたimage
+ * (検査せずにverifyFunctionにかけると、定数の関数を検査する再帰が終わらない)
+ * @param marks 関数の番号ごとに、0なら未訪問、1なら辿っている途中、2なら確かめ終わった
+ */
+static bool isAcyclic(ImageReader* reader, const uint8_t** bodies, uint8_t* marks, uint32_t i) {
+    if (marks[i] != 0) {
+        return marks[i] == 2;
+    }
+    marks[i] = 1;
+    ImageObject record;
+    memcpy(&record, bodies[i] - sizeof(record), sizeof(record));
+    ImageFunction header;
+    memcpy(&header, bodies[i], sizeof(header));
+    const uint8_t* constants = bodies[i] + sizeof(header) + functionCodeSize(header.codeCount);
+    for (uint32_t j = 0; j < record.count; j++) {
+        ImageValue encoded;
+        memcpy(&encoded, constants + sizeof(ImageValue) * j, sizeof(encoded));
+        // 番号と型はfillFunctionが確かめてある
+        if (encoded.type == IMAGE_FUNCTION && !isAcyclic(reader, bodies, marks, (uint32_t)encoded.payload)) {
+            return false;
+        }
+    }
+    marks[i] = 2;
+    return true;
+}
+
+/**
+ * 埋め終わった関数をすべて検査する
+ * 検査で求めたスタックの深さが保存したmaxStackと違えば、命令か深さが壊れている
+ */
+static bool verifyFunctions(ImageReader* reader, const uint8_t** bodies) {
+    uint8_t* marks = ALLOCATE(uint8_t, reader->objectCount);
+    memset(marks, 0, reader->objectCount);
+    bool ok = true;
+    for (uint32_t i = 0; i < reader->objectCount && ok; i++) {
+        if (reader->objects[i]->type == OBJ_FUNCTION) {
+            ok = isAcyclic(reader, bodies, marks, i);
+        }
+    }
+    for (uint32_t i = 0; i < reader->objectCount && ok; i++) {
+        if (reader->objects[i]->type != OBJ_FUNCTION) {
+            continue;
+        }
+        ObjFunction* function = (ObjFunction*)reader->objects[i];
+        ImageFunction header;
+        memcpy(&header, bodies[i], sizeof(header));
+        ok = verifyFunction(function, reader->vm->err) && function->chunk.maxStack == (int)header.maxStack;
+    }
+    FREE_ARRAY(uint8_t, marks, reader->objectCount);
+    return ok;
+}
+
+/**
+ * mmapしたimageを検証しながらvmに復元する
+ * offsetと番号はすべてファイルの大きさと照らし合わせてから使う
+ */
+static bool restoreImage(VM* vm, const uint8_t* image, size_t size) {
+    ImageHeader header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 || header.version != IMAGE_VERSION
+        || header.byteOrder != IMAGE_BYTE_ORDER || header.size != size
+        || header.stringsOffset < sizeof(header) || header.stringsOffset > header.globalsOffset
+        || header.globalsOffset > header.objectsOffset || header.objectsOffset > size
+        || (header.globalsOffset - header.stringsOffset) / sizeof(ImageString) < header.stringCount
+        || (header.objectsOffset - header.globalsOffset) / sizeof(ImageGlobal) < header.globalCount
+        || (size - header.objectsOffset) / sizeof(ImageObject) < header.objectCount) {
+        return false;
+    }
+
+    ImageReader reader = {vm, NULL, header.stringCount, NULL, header.objectCount};
+    reader.strings = ALLOCATE(ObjString*, header.stringCount);
+    size_t offset = header.stringsOffset;
+    bool ok = true;
+    for (uint32_t i = 0; i < header.stringCount; i++) {
+        ImageString record;
+        if (header.globalsOffset - offset < sizeof(record)) {
+            ok = false;
+            break;
+        }
+        memcpy(&record, image + offset, sizeof(record));
+        const char* chars = (const char*)image + offset + sizeof(record);
+        if (record.length > INT32_MAX || header.globalsOffset - offset < stringRecordSize(record.length)
+            || chars[record.length] != '\0') {
+            ok = false;
+            break;
+        }
+        // 保存したhashは検査にだけ使う
+        // 信じて使うと、壊れたimageの文字列が違うbucketに入って同じ文字列どうしが等しくならない
+        reader.strings[i] = copyString(vm, chars, (int)record.length);
+        if (reader.strings[i]->hash != record.hash) {
+            ok = false;
+            break;
+        }
+        offset += stringRecordSize(record.length);
+    }
+
+    // 要素や定数が後ろのlist、map、関数を指すこともあるので、先に空のものを全部作ってから埋める
+    reader.objects = ALLOCATE(Obj*, header.objectCount);
+    const uint8_t** bodies = ALLOCATE(const uint8_t*, header.objectCount);
+    offset = header.objectsOffset;
+    for (uint32_t i = 0; i < header.objectCount && ok; i++) {
+        ImageObject record;
+        size_t bodySize;
+        if (size - offset < sizeof(record)) {
+            ok = false;
+            break;
+        }
+        memcpy(&record, image + offset, sizeof(record));
+        offset += sizeof(record);
+        if (!objectBodySize(image, size, offset, record, &bodySize)) {
+            ok = false;
+            break;
+        }
+        if (record.type == IMAGE_FUNCTION) {
+            reader.objects[i] = (Obj*)newFunction(vm);
+        } else {
+            reader.objects[i] = record.type == IMAGE_LIST
+                ? (Obj*)newList(vm, (int)record.count) : (Obj*)newMap(vm);
+        }
+        bodies[i] = image + offset;
+        offset += bodySize;
+    }
+
+    // 組み込み関数は名前でvm->globalsから引くので、グローバル変数を上書きする前にすべて読む
+    const uint8_t* globals = image + header.globalsOffset;
+    ObjString** names = ALLOCATE(ObjString*, header.globalCount);
+    Value* values = ALLOCATE(Value, header.globalCount);
+    for (uint32_t i = 0; i < header.globalCount && ok; i++) {
+        ImageGlobal global;
+        memcpy(&global, globals + sizeof(ImageGlobal) * i, sizeof(global));
+        ok = global.name < header.stringCount && decodeValue(&reader, global.type, global.payload, &values[i]);
+        names[i] = ok ? reader.strings[global.name] : NULL;
+    }
+    for (uint32_t i = 0; i < header.objectCount && ok; i++) {
+        ImageObject record;
+        memcpy(&record, bodies[i] - sizeof(record), sizeof(record));
+        if (record.type == IMAGE_FUNCTION) {
+            ok = fillFunction(&reader, (ObjFunction*)reader.objects[i], record, bodies[i]);
+        } else {
+            ok = fillObject(&reader, reader.objects[i], record, bodies[i]);
+        }
+    }
+    ok = ok && verifyFunctions(&reader, bodies);
+    for (uint32_t i = 0; i < header.globalCount && ok; i++) {
+        tableSet(&vm->globals, names[i], values[i]);
+    }
+
+    FREE_ARRAY(ObjString*, names, header.globalCount);
+    FREE_ARRAY(Value, values, header.globalCount);
+    FREE_ARRAY(const uint8_t*, bodies, header.objectCount);
+    FREE_ARRAY(Obj*, reader.objects, header.objectCount);
+    FREE_ARRAY(ObjString*, reader.strings, header.stringCount);
+    return ok;
+}
+
+bool loadImage(VM* vm, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(vm->err, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+    struct stat status;
+    void* image = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && status.st_size > 0) {
+        image = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    bool ok = image != MAP_FAILED && restoreImage(vm, (const uint8_t*)image, (size_t)status.st_size);
+    if (image != MAP_FAILED) {
+        munmap(image, status.st_size);
+    }
+    if (!ok) {
+        fprintf(vm->err, "Invalid heap image \"%s\".\n", path);
+    }
+    return ok;
+}
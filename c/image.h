@@ -0,0 +1,32 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "vm.h"
+
+/**
+ * heap image
+ *
+ * 初期化を終えたVMのintern表とグローバル変数をファイルに書き出し、次回の起動で復元する
+ * 時間のかかる初期化スクリプトを毎回実行せずに、その結果の状態から別のスクリプトを始められる
+ *
+ * imageの中ではポインタの代わりにファイル先頭からのoffsetと文字列の番号を使うので、
+ * どのアドレスにmmapしても読める。文字列はhashも一緒に保存し、復元時に計算し直したhashと
+ * 一致しなければ壊れたimageとして読まない
+ * 組み込み関数は名前で保存し、復元時にinitVMが登録したものを引き直す
+ * Loxの関数は名前、引数の数、命令、行番号、定数を保存し、復元時にverifyFunctionで検査する
+ * (--entry nameで復元した関数をスクリプトなしで呼べる)
+ */
+
+/**
+ * vmのstringsとglobalsをpathに書き出す
+ * @return 書き出せなければvm->errにエラーを表示してfalse
+ */
+bool saveImage(VM* vm, const char* path);
+/**
+ * pathのimageをmmapしてvmのstringsとglobalsに復元する
+ * 作ったばかりのVMに対して、スクリプトを実行する前に呼ぶ
+ * @return 読めない、または壊れていればvm->errにエラーを表示してfalse
+ */
+bool loadImage(VM* vm, const char* path);
+
+#endif
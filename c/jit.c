@@ -0,0 +1,688 @@
+#include "jit.h"
+
+#ifdef TEMPLATE_JIT
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+/**
+ * JITしたchunkの機械語
+ * 先頭はCから呼ぶ入口(EntryFunction)で、バイトコードの位置ごとの入口へジャンプする
+ */
+struct JitCode {
+    uint8_t* code; // mmapした実行可能なメモリ
+    size_t size;
+    uint8_t** entries; // バイトコードの位置ごとの入口(命令の先頭でなければNULL)
+    int count;
+};
+
+/**
+ * JITしたコードをCから呼ぶときの型
+ * @param target 実行を始める命令の入口(entries)
+ * @return run()で実行を続ける命令の位置
+ */
+typedef int (*EntryFunction)(VM* vm, Value* slots, Value* stackTop, uint8_t* target);
+
+// 汎用レジスタの番号(ModRMとREXにそのまま入れる)
+typedef enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+} Register;
+
+// xmmレジスタは0だけ使う
+#define XMM0 0
+
+// JITしたコードの中で値を持ち続けるレジスタ
+// callee-savedなので、Cの関数(tableGetなど)を呼んでも壊れない
+#define JIT_VM RBX
+#define JIT_SLOTS R12
+#define JIT_TOP R13 // vm->stackTopと同じく、次に積む位置
+
+// スタックの上からn番目(1が一番上、0は次に積む位置)の値の型と中身の、JIT_TOPからの距離
+#define TYPE_OF(n) (-(n) * (int)sizeof(Value) + (int)offsetof(Value, type))
+#define PAYLOAD_OF(n) (-(n) * (int)sizeof(Value) + (int)offsetof(Value, as))
+
+// 条件ジャンプ(0F 8x)の条件
+#define CC_EQUAL 0x84
+#define CC_NOT_EQUAL 0x85
+
+/**
+ * 書き込んだrel32をあとで埋める位置
+ */
+typedef struct {
+    int at; // rel32の位置
+    int target; // 飛び先のバイトコードの位置
+} Patch;
+
+typedef struct {
+    Chunk* chunk;
+    uint8_t* code;
+    int count;
+    int capacity;
+    int* labels; // バイトコードの位置ごとの機械語の位置(命令の先頭でなければ-1)
+    Patch* jumps; // バイトコードのジャンプ
+    int jumpCount;
+    int jumpCapacity;
+    Patch* bails; // run()に戻る条件ジャンプ
+    int bailCount;
+    int bailCapacity;
+    int epilogue;
+} Assembler;
+
+// ------------------------------------------------------------
+// JITしたコードから呼ぶ関数
+// 失敗したときはfalseを返すだけで何も変えず、run()がその命令を実行し直してエラーにする
+// ------------------------------------------------------------
+
+static bool getGlobal(VM* vm, Value* top, ObjString* name) {
+    return tableGet(&vm->globals, name, top);
+}
+
+static void defineGlobal(VM* vm, Value* top, ObjString* name) {
+    tableSet(&vm->globals, name, top[-1]);
+}
+
+static bool setGlobal(VM* vm, Value* top, ObjString* name) {
+    if (tableSet(&vm->globals, name, top[-1])) {
+        tableDelete(&vm->globals, name);
+        return false;
+    }
+    return true;
+}
+
+static void equal(VM* vm, Value* top) {
+    top[-2] = BOOL_VAL(valuesEqual(top[-2], top[-1]));
+}
+
+// 数値どうしの足し算は機械語で済ませるので、ここに来るのはそれ以外
+static bool add(VM* vm, Value* top) {
+    if (!IS_STRING(top[-1]) || !IS_STRING(top[-2])) {
+        return false;
+    }
+    top[-2] = OBJ_VAL((Obj*)concatenateStrings(vm, AS_STRING(top[-2]), AS_STRING(top[-1])));
+    return true;
+}
+
+static void print(VM* vm, Value* top) {
+    printToBuffer(vm, top[-1]);
+}
+
+static void buildList(VM* vm, Value* top, int itemCount) {
+    ObjList* list = newList(vm, itemCount);
+    Value* items = top - itemCount;
+    for (int i = 0; i < itemCount; i++) {
+        appendToList(list, items[i]);
+    }
+    items[0] = OBJ_VAL((Obj*)list);
+}
+
+static bool buildMap(VM* vm, Value* top, int entryCount) {
+    Value* entries = top - entryCount * 2;
+    // 作り始める前にkeyを確かめる
+    for (int i = 0; i < entryCount; i++) {
+        if (!isMapKey(entries[i * 2])) {
+            return false;
+        }
+    }
+    ObjMap* map = newMap(vm);
+    for (int i = 0; i < entryCount; i++) {
+        setMapEntry(map, entries[i * 2], entries[i * 2 + 1]);
+    }
+    entries[0] = OBJ_VAL((Obj*)map);
+    return true;
+}
+
+// checkListIndexと同じ条件(エラーは表示しない)
+static bool listIndex(Value list, Value index, int* slot) {
+    if (!IS_LIST(list) || !IS_NUMBER(index)) {
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < AS_LIST(list)->items.count) || number != (int)number) {
+        return false;
+    }
+    *slot = (int)number;
+    return true;
+}
+
+static bool indexGet(VM* vm, Value* top) {
+    if (IS_MAP(top[-2])) {
+        if (!tableGetValue(&AS_MAP(top[-2])->table, top[-1], &top[-2])) {
+            top[-2] = NIL_VAL;
+        }
+        return true;
+    }
+    int index;
+    if (!listIndex(top[-2], top[-1], &index)) {
+        return false;
+    }
+    top[-2] = AS_LIST(top[-2])->items.values[index];
+    return true;
+}
+
+static bool indexSet(VM* vm, Value* top) {
+    if (IS_MAP(top[-3])) {
+        if (!isMapKey(top[-2])) {
+            return false;
+        }
+        setMapEntry(AS_MAP(top[-3]), top[-2], top[-1]);
+        top[-3] = top[-1];
+        return true;
+    }
+    int index;
+    if (!listIndex(top[-3], top[-2], &index)) {
+        return false;
+    }
+    setListItem(AS_LIST(top[-3]), index, top[-1]);
+    top[-3] = top[-1];
+    return true;
+}
+
+// ------------------------------------------------------------
+// x86-64のエンコード
+// ------------------------------------------------------------
+
+static void emit(Assembler* as, const uint8_t* bytes, int length) {
+    if (as->capacity < as->count + length) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        while (as->capacity < as->count + length) {
+            as->capacity *= 2;
+        }
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    memcpy(as->code + as->count, bytes, length);
+    as->count += length;
+}
+
+#define EMIT(as, ...) \
+    emit(as, (const uint8_t[]){__VA_ARGS__}, (int)sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler* as, int32_t value) {
+    uint8_t bytes[4];
+    memcpy(bytes, &value, 4);
+    emit(as, bytes, 4);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    uint8_t bytes[8];
+    memcpy(bytes, &value, 8);
+    emit(as, bytes, 8);
+}
+
+static void patch32(Assembler* as, int at, int32_t value) {
+    memcpy(as->code + at, &value, 4);
+}
+
+/**
+ * [base + disp]をオペランドにする命令
+ * @param prefix 0でなければREXの前に置く(SSEの66, F2)
+ * @param wide 64bitのオペランド(REX.W)
+ * @param opcode 0xffより大きければ2バイト(0F xx)
+ * @param reg ModRMのregに入れるレジスタか、opcodeの拡張(/digit)
+ */
+static void emitMemory(Assembler* as, uint8_t prefix, bool wide, uint16_t opcode, int reg, Register base, int32_t disp) {
+    if (prefix != 0) {
+        EMIT(as, prefix);
+    }
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg & 8 ? 0x04 : 0) | (base & 8 ? 0x01 : 0);
+    if (rex != 0x40) {
+        EMIT(as, rex);
+    }
+    if (opcode > 0xff) {
+        EMIT(as, (uint8_t)(opcode >> 8));
+    }
+    // mod=10(disp32)、rsp/r12をbaseにするにはSIBが要る
+    EMIT(as, (uint8_t)opcode, (uint8_t)(0x80 | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == RSP) {
+        EMIT(as, 0x24);
+    }
+    emit32(as, disp);
+}
+
+// mov dst, src
+static void emitMove(Assembler* as, Register dst, Register src) {
+    EMIT(as, (uint8_t)(0x48 | (src & 8 ? 0x04 : 0) | (dst & 8 ? 0x01 : 0)), 0x89,
+        (uint8_t)(0xc0 | (src & 7) << 3 | (dst & 7)));
+}
+
+// mov reg, imm64
+static void emitLoadImmediate(Assembler* as, Register reg, uint64_t value) {
+    EMIT(as, (uint8_t)(0x48 | (reg & 8 ? 0x01 : 0)), (uint8_t)(0xb8 + (reg & 7)));
+    emit64(as, value);
+}
+
+// add r13, count * sizeof(Value)
+static void emitAdjustTop(Assembler* as, int count) {
+    if (count != 0) {
+        EMIT(as, 0x49, 0x81, 0xc5);
+        emit32(as, count * (int)sizeof(Value));
+    }
+}
+
+// movups xmm0, [base + disp]; movups [r13], xmm0; add r13, 16
+static void emitPush(Assembler* as, Register base, int32_t disp) {
+    emitMemory(as, 0, false, 0x0f10, XMM0, base, disp);
+    emitMemory(as, 0, false, 0x0f11, XMM0, JIT_TOP, TYPE_OF(0));
+    emitAdjustTop(as, 1);
+}
+
+// スタックの上からn番目を型と中身の即値で書き換える
+static void emitStoreValue(Assembler* as, int n, ValueType type, int32_t payload) {
+    emitMemory(as, 0, false, 0xc7, 0, JIT_TOP, TYPE_OF(n));
+    emit32(as, type);
+    emitMemory(as, 0, true, 0xc7, 0, JIT_TOP, PAYLOAD_OF(n));
+    emit32(as, payload);
+}
+
+/**
+ * 条件ジャンプ(conditionが0ならjmp)を書き、rel32の位置を返す
+ */
+static int emitJump(Assembler* as, uint8_t condition) {
+    if (condition == 0) {
+        EMIT(as, 0xe9);
+    } else {
+        EMIT(as, 0x0f, condition);
+    }
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+// emitJumpで書いたジャンプを今の位置に飛ばす
+static void patchHere(Assembler* as, int at) {
+    patch32(as, at, as->count - (at + 4));
+}
+
+static void addPatch(Patch** patches, int* count, int* capacity, int at, int target) {
+    if (*capacity < *count + 1) {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *patches = GROW_ARRAY(Patch, *patches, oldCapacity, *capacity);
+    }
+    (*patches)[(*count)++] = (Patch){at, target};
+}
+
+// バイトコードのtargetの命令へジャンプする
+static void emitJumpTo(Assembler* as, uint8_t condition, int target) {
+    int at = emitJump(as, condition);
+    addPatch(&as->jumps, &as->jumpCount, &as->jumpCapacity, at, target);
+}
+
+// 条件が成り立てば、offsetの命令をrun()で実行するために戻る
+static void emitBail(Assembler* as, uint8_t condition, int offset) {
+    int at = emitJump(as, condition);
+    addPatch(&as->bails, &as->bailCount, &as->bailCapacity, at, offset);
+}
+
+// スタックの上からn番目が数値でなければ戻る
+static void emitGuardNumber(Assembler* as, int n, int offset) {
+    emitMemory(as, 0, false, 0x83, 7, JIT_TOP, TYPE_OF(n)); // cmp dword [r13 + disp], imm8
+    EMIT(as, VAL_NUMBER);
+    emitBail(as, CC_NOT_EQUAL, offset);
+}
+
+// function(vm, stackTop, argument)を呼ぶ
+static void emitCall(Assembler* as, const void* function, uint64_t argument) {
+    emitMove(as, RDI, JIT_VM);
+    emitMove(as, RSI, JIT_TOP);
+    emitLoadImmediate(as, RDX, argument);
+    emitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+    EMIT(as, 0xff, 0xd0); // call rax
+}
+
+// 関数がfalseを返したら戻る
+static void emitCallOrBail(Assembler* as, const void* function, uint64_t argument, int offset) {
+    emitCall(as, function, argument);
+    EMIT(as, 0x84, 0xc0); // test al, al
+    emitBail(as, CC_EQUAL, offset);
+}
+
+// ------------------------------------------------------------
+// 命令ごとのテンプレート
+// ------------------------------------------------------------
+
+/**
+ * 数値どうしの演算(addsd, subsd, mulsd, divsd)
+ * 上から2番目の値の中身を書き換えるので、型は数値のまま
+ */
+static void emitArithmetic(Assembler* as, uint16_t opcode) {
+    emitMemory(as, 0xf2, false, 0x0f10, XMM0, JIT_TOP, PAYLOAD_OF(2)); // movsd xmm0, a
+    emitMemory(as, 0xf2, false, opcode, XMM0, JIT_TOP, PAYLOAD_OF(1)); // op xmm0, b
+    emitMemory(as, 0xf2, false, 0x0f11, XMM0, JIT_TOP, PAYLOAD_OF(2)); // movsd a, xmm0
+}
+
+/**
+ * a > b、a < bの比較
+ * ucomisdはNaNとの比較でCFとZFを立てるので、seta(CF=0かつZF=0)ならNaNはfalseになる
+ * a < bはb > aとして比べる
+ */
+static void emitCompare(Assembler* as, bool greater, int offset) {
+    emitGuardNumber(as, 1, offset);
+    emitGuardNumber(as, 2, offset);
+    emitMemory(as, 0xf2, false, 0x0f10, XMM0, JIT_TOP, PAYLOAD_OF(greater ? 2 : 1));
+    emitMemory(as, 0x66, false, 0x0f2e, XMM0, JIT_TOP, PAYLOAD_OF(greater ? 1 : 2));
+    EMIT(as, 0x0f, 0x97, 0xc0); // seta al
+    EMIT(as, 0x0f, 0xb6, 0xc0); // movzx eax, al
+    emitMemory(as, 0, false, 0xc7, 0, JIT_TOP, TYPE_OF(2));
+    emit32(as, VAL_BOOL);
+    emitMemory(as, 0, true, 0x89, RAX, JIT_TOP, PAYLOAD_OF(2));
+    emitAdjustTop(as, -1);
+}
+
+/**
+ * 一番上の値がfalsey(nilかfalse)ならtargetの命令へ、そうでなければ次へ進む
+ */
+static void emitJumpIfFalsey(Assembler* as, int target) {
+    emitMemory(as, 0, false, 0x8b, RAX, JIT_TOP, TYPE_OF(1)); // mov eax, type
+    EMIT(as, 0x83, 0xf8, VAL_NIL); // cmp eax, VAL_NIL
+    emitJumpTo(as, CC_EQUAL, target);
+    EMIT(as, 0x83, 0xf8, VAL_BOOL); // cmp eax, VAL_BOOL
+    int truthy = emitJump(as, CC_NOT_EQUAL);
+    emitMemory(as, 0, false, 0x80, 7, JIT_TOP, PAYLOAD_OF(1)); // cmp byte [r13 + disp], 0
+    EMIT(as, 0);
+    emitJumpTo(as, CC_EQUAL, target);
+    patchHere(as, truthy);
+}
+
+/**
+ * offsetの命令を機械語にする
+ * @return 命令の長さ
+ */
+static int compileInstruction(Assembler* as, int offset) {
+    Chunk* chunk = as->chunk;
+    uint8_t* code = chunk->code + offset;
+    switch (code[0]) {
+        case OP_CONSTANT: {
+            emitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)&chunk->constants.values[code[1]]);
+            emitPush(as, RAX, 0);
+            return 2;
+        }
+        case OP_NIL: {
+            emitStoreValue(as, 0, VAL_NIL, 0);
+            emitAdjustTop(as, 1);
+            return 1;
+        }
+        case OP_TRUE:
+        case OP_FALSE: {
+            emitStoreValue(as, 0, VAL_BOOL, code[0] == OP_TRUE);
+            emitAdjustTop(as, 1);
+            return 1;
+        }
+        case OP_POP: {
+            emitAdjustTop(as, -1);
+            return 1;
+        }
+        case OP_GET_LOCAL: {
+            emitPush(as, JIT_SLOTS, code[1] * (int)sizeof(Value));
+            return 2;
+        }
+        case OP_SET_LOCAL: {
+            emitMemory(as, 0, false, 0x0f10, XMM0, JIT_TOP, TYPE_OF(1));
+            emitMemory(as, 0, false, 0x0f11, XMM0, JIT_SLOTS, code[1] * (int)sizeof(Value));
+            return 2;
+        }
+        case OP_GET_GLOBAL: {
+            emitCallOrBail(as, (const void*)getGlobal, (uint64_t)(uintptr_t)AS_STRING(chunk->constants.values[code[1]]), offset);
+            emitAdjustTop(as, 1);
+            return 2;
+        }
+        case OP_DEFINE_GLOBAL: {
+            emitCall(as, (const void*)defineGlobal, (uint64_t)(uintptr_t)AS_STRING(chunk->constants.values[code[1]]));
+            emitAdjustTop(as, -1);
+            return 2;
+        }
+        case OP_SET_GLOBAL: {
+            emitCallOrBail(as, (const void*)setGlobal, (uint64_t)(uintptr_t)AS_STRING(chunk->constants.values[code[1]]), offset);
+            return 2;
+        }
+        case OP_EQUAL: {
+            emitCall(as, (const void*)equal, 0);
+            emitAdjustTop(as, -1);
+            return 1;
+        }
+        case OP_GREATER:
+        case OP_GREATER_NUM: {
+            emitCompare(as, true, offset);
+            return 1;
+        }
+        case OP_LESS:
+        case OP_LESS_NUM: {
+            emitCompare(as, false, offset);
+            return 1;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM: {
+            // 数値でなければ文字列の連結を呼ぶ
+            emitMemory(as, 0, false, 0x83, 7, JIT_TOP, TYPE_OF(1));
+            EMIT(as, VAL_NUMBER);
+            int notNumber = emitJump(as, CC_NOT_EQUAL);
+            emitMemory(as, 0, false, 0x83, 7, JIT_TOP, TYPE_OF(2));
+            EMIT(as, VAL_NUMBER);
+            int notNumbers = emitJump(as, CC_NOT_EQUAL);
+            emitArithmetic(as, 0x0f58);
+            int done = emitJump(as, 0);
+            patchHere(as, notNumber);
+            patchHere(as, notNumbers);
+            emitCallOrBail(as, (const void*)add, 0, offset);
+            patchHere(as, done);
+            emitAdjustTop(as, -1);
+            return 1;
+        }
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM: {
+            uint16_t opcode = code[0] == OP_SUBTRACT || code[0] == OP_SUBTRACT_NUM ? 0x0f5c
+                : code[0] == OP_MULTIPLY || code[0] == OP_MULTIPLY_NUM ? 0x0f59
+                : 0x0f5e;
+            emitGuardNumber(as, 1, offset);
+            emitGuardNumber(as, 2, offset);
+            emitArithmetic(as, opcode);
+            emitAdjustTop(as, -1);
+            return 1;
+        }
+        case OP_NOT: {
+            EMIT(as, 0x31, 0xc9); // xor ecx, ecx
+            emitMemory(as, 0, false, 0x8b, RAX, JIT_TOP, TYPE_OF(1)); // mov eax, type
+            EMIT(as, 0x83, 0xf8, VAL_NIL); // cmp eax, VAL_NIL
+            EMIT(as, 0x0f, 0x94, 0xc1); // sete cl
+            EMIT(as, 0x83, 0xf8, VAL_BOOL); // cmp eax, VAL_BOOL
+            int notBool = emitJump(as, CC_NOT_EQUAL);
+            emitMemory(as, 0, false, 0x80, 7, JIT_TOP, PAYLOAD_OF(1)); // cmp byte [r13 + disp], 0
+            EMIT(as, 0);
+            EMIT(as, 0x0f, 0x94, 0xc1); // sete cl
+            patchHere(as, notBool);
+            emitMemory(as, 0, false, 0xc7, 0, JIT_TOP, TYPE_OF(1));
+            emit32(as, VAL_BOOL);
+            emitMemory(as, 0, true, 0x89, RCX, JIT_TOP, PAYLOAD_OF(1));
+            return 1;
+        }
+        case OP_NEGATE: {
+            emitGuardNumber(as, 1, offset);
+            emitMemory(as, 0, true, 0x8b, RAX, JIT_TOP, PAYLOAD_OF(1));
+            EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 63); // btc rax, 63(符号ビットを反転する)
+            emitMemory(as, 0, true, 0x89, RAX, JIT_TOP, PAYLOAD_OF(1));
+            return 1;
+        }
+        case OP_PRINT: {
+            emitCall(as, (const void*)print, 0);
+            emitAdjustTop(as, -1);
+            return 1;
+        }
+        case OP_JUMP: {
+            emitJumpTo(as, 0, offset + 3 + (uint16_t)((code[1] << 8) | code[2]));
+            return 3;
+        }
+        case OP_JUMP_IF_FALSE: {
+            emitJumpIfFalsey(as, offset + 3 + (uint16_t)((code[1] << 8) | code[2]));
+            return 3;
+        }
+        case OP_LOOP: {
+            emitJumpTo(as, 0, offset + 3 - (uint16_t)((code[1] << 8) | code[2]));
+            return 3;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            // framesとスタックの確保はrun()に任せる
+            emitBail(as, 0, offset);
+            return 2;
+        }
+        case OP_BUILD_LIST: {
+            emitCall(as, (const void*)buildList, code[1]);
+            emitAdjustTop(as, 1 - code[1]);
+            return 2;
+        }
+        case OP_BUILD_MAP: {
+            emitCallOrBail(as, (const void*)buildMap, code[1], offset);
+            emitAdjustTop(as, 1 - code[1] * 2);
+            return 2;
+        }
+        case OP_INDEX_GET: {
+            emitCallOrBail(as, (const void*)indexGet, 0, offset);
+            emitAdjustTop(as, -1);
+            return 1;
+        }
+        case OP_INDEX_SET: {
+            emitCallOrBail(as, (const void*)indexSet, 0, offset);
+            emitAdjustTop(as, -2);
+            return 1;
+        }
+        case OP_RETURN: {
+            emitBail(as, 0, offset);
+            return 1;
+        }
+    }
+    return 1; // 検査済みのchunkには来ない
+}
+
+/**
+ * 入口と出口
+ * 入口はrbx, r12, r13を保存してvm, slots, stackTopを入れ、targetへジャンプする
+ * 出口はr13をvm->stackTopに書き戻し、eax(run()で続ける命令の位置)を返す
+ */
+static void emitEntryAndExit(Assembler* as) {
+    // 呼ばれた直後のrspは16バイト境界から8ずれているので、3つ積むとCの関数を呼べる境界に揃う
+    EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55); // push rbx; push r12; push r13
+    emitMove(as, JIT_VM, RDI);
+    emitMove(as, JIT_SLOTS, RSI);
+    emitMove(as, JIT_TOP, RDX);
+    EMIT(as, 0xff, 0xe1); // jmp rcx
+
+    as->epilogue = as->count;
+    emitMemory(as, 0, true, 0x89, JIT_TOP, JIT_VM, (int32_t)offsetof(VM, stackTop));
+    EMIT(as, 0x41, 0x5d, 0x41, 0x5c, 0x5b); // pop r13; pop r12; pop rbx
+    EMIT(as, 0xc3); // ret
+}
+
+/**
+ * ジャンプの飛び先を埋め、run()に戻る条件ジャンプの行き先(命令の位置をeaxに入れて出口へ)を末尾に置く
+ */
+static void resolvePatches(Assembler* as) {
+    for (int i = 0; i < as->jumpCount; i++) {
+        Patch* jump = &as->jumps[i];
+        patch32(as, jump->at, as->labels[jump->target] - (jump->at + 4));
+    }
+    // 同じ命令から戻る条件ジャンプは1つの行き先を共有する
+    int* stubs = ALLOCATE(int, as->chunk->count);
+    for (int i = 0; i < as->chunk->count; i++) {
+        stubs[i] = -1;
+    }
+    for (int i = 0; i < as->bailCount; i++) {
+        Patch* bail = &as->bails[i];
+        if (stubs[bail->target] == -1) {
+            stubs[bail->target] = as->count;
+            EMIT(as, 0xb8); // mov eax, imm32
+            emit32(as, bail->target);
+            int at = emitJump(as, 0);
+            patch32(as, at, as->epilogue - (at + 4));
+        }
+        patch32(as, bail->at, stubs[bail->target] - (bail->at + 4));
+    }
+    FREE_ARRAY(int, stubs, as->chunk->count);
+}
+
+bool compileJit(Chunk* chunk) {
+    Assembler as;
+    as.chunk = chunk;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.labels = ALLOCATE(int, chunk->count);
+    as.jumps = NULL;
+    as.jumpCount = 0;
+    as.jumpCapacity = 0;
+    as.bails = NULL;
+    as.bailCount = 0;
+    as.bailCapacity = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        as.labels[i] = -1;
+    }
+
+    emitEntryAndExit(&as);
+    for (int offset = 0; offset < chunk->count;) {
+        as.labels[offset] = as.count;
+        offset += compileInstruction(&as, offset);
+    }
+    resolvePatches(&as);
+
+    // 書き込んでから実行可能にする(書き込みと実行を同時に許さない)
+    uint8_t* memory = mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool ok = memory != MAP_FAILED;
+    if (ok) {
+        memcpy(memory, as.code, as.count);
+        if (mprotect(memory, as.count, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, as.count);
+            ok = false;
+        }
+    }
+    if (ok) {
+        JitCode* jit = ALLOCATE(JitCode, 1);
+        jit->code = memory;
+        jit->size = as.count;
+        jit->count = chunk->count;
+        jit->entries = ALLOCATE(uint8_t*, chunk->count);
+        for (int i = 0; i < chunk->count; i++) {
+            jit->entries[i] = as.labels[i] == -1 ? NULL : memory + as.labels[i];
+        }
+        chunk->jit = jit;
+    }
+
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    FREE_ARRAY(int, as.labels, chunk->count);
+    FREE_ARRAY(Patch, as.jumps, as.jumpCapacity);
+    FREE_ARRAY(Patch, as.bails, as.bailCapacity);
+    return ok;
+}
+
+void runJit(VM* vm) {
+    JitCode* jit = vm->chunk->jit;
+    uint8_t* target = jit->entries[vm->ip - vm->chunk->code];
+    EntryFunction enter = (EntryFunction)(uintptr_t)jit->code;
+    int offset = enter(vm, vm->slots, vm->stackTop, target);
+    vm->ip = vm->chunk->code + offset;
+}
+
+void freeJit(Chunk* chunk) {
+    JitCode* jit = chunk->jit;
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->code, jit->size);
+    FREE_ARRAY(uint8_t*, jit->entries, jit->count);
+    FREE(JitCode, jit);
+    chunk->jit = NULL;
+    chunk->hotness = 0;
+}
+
+#endif
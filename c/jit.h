@@ -0,0 +1,42 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "vm.h"
+
+/**
+ * --jit: x86-64のテンプレートJIT
+ *
+ * 何度も実行されるchunk(関数とトップレベル)のスタック命令を、命令ごとに決まった機械語の並び(テンプレート)に置き換える
+ * 値スタックはVMのものをそのまま使い、stackTopとslotsをレジスタに持つ
+ * ディスパッチの分岐がなくなり、数値の演算と比較、ローカル変数、ジャンプは型の確認だけの機械語になる
+ *
+ * 機械語にしない命令(呼び出しとOP_RETURN)と、型の確認に失敗した命令ではrun()に戻る(bail out)
+ * run()はその命令から実行し直すので、実行時エラーのメッセージと行はインタプリタのものと変わらない
+ * run()は呼び出しと戻りとOP_LOOPのたびにJITしたコードに入り直す
+ *
+ * x86-64のLinuxでのみ使える(TEMPLATE_JIT)。JITしたコードで実行した命令は--statsのinstructionsに数えない
+ */
+
+// --jitで閾値を省略したとき: chunkに入った回数とループした回数の合計がこれに達したらJITする
+#define JIT_THRESHOLD 1000
+
+#ifdef TEMPLATE_JIT
+
+typedef struct JitCode JitCode;
+
+/**
+ * chunkを機械語にしてchunk->jitに置く
+ * chunkは検査済み(verifyChunk/verifyFunction)であること
+ * @return 実行可能なメモリを確保できなければfalse
+ */
+bool compileJit(Chunk* chunk);
+/**
+ * vm->chunkのJITしたコードをvm->ipの命令から実行する
+ * 戻ったときにはvm->ipとvm->stackTopが、run()で実行を続ける命令とスタックを指している
+ */
+void runJit(VM* vm);
+void freeJit(Chunk* chunk);
+
+#endif
+
+#endif
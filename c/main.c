@@ -1,22 +1,132 @@
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "memory.h"
+#include "object.h"
+#include "pool.h"
 #include "debug.h"
+#include "image.h"
+#include "jit.h"
+#include "profiler.h"
+#include "scanner.h"
 #include "vm.h"
 #include <stdio.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-static void repl() {
-    char line[1024];
+/**
+ * 入力が途中で終わっているかを調べる
+ * 括弧が閉じていない、または文字列が閉じていなければ続きの行を読む
+ */
+static bool isComplete(const char* source) {
+    Scanner scanner;
+    initScanner(&scanner, source);
+    int depth = 0;
     for (;;) {
-        printf("> ");
-        if (!fgets(line, sizeof(line), stdin)) {
+        Token token = scanToken(&scanner);
+        switch (token.type) {
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_LEFT_BRACKET:
+                depth++;
+                break;
+            case TOKEN_RIGHT_PAREN:
+            case TOKEN_RIGHT_BRACE:
+            case TOKEN_RIGHT_BRACKET:
+                depth--;
+                break;
+            case TOKEN_ERROR:
+                if (strncmp(token.start, "Unterminated string.", token.length) == 0) {
+                    return false;
+                }
+                break;
+            case TOKEN_EOF:
+                return depth <= 0;
+            default:
+                break;
+        }
+    }
+}
+
+static double elapsedMillis(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * 1回分の入力をREPLのchunkの末尾にコンパイルして、追記した位置から実行する
+ * グローバル変数や定数プール(重複排除される)は前の入力のものがそのまま使われる
+ * コンパイルエラーや実行時エラーになった入力のコードと定数は捨てる
+ * (実行時エラーまでに定義されたグローバル変数は残る、値のオブジェクトはvm.objectsが持っている)
+ */
+static void replEntry(VM* vm, Chunk* chunk, const char* source) {
+    int codeStart = chunk->count;
+    int constantStart = chunk->constants.count;
+
+    struct timespec start, compiled, finished;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!compile(vm, source, chunk)) {
+        chunk->count = codeStart;
+        chunk->constants.count = constantStart;
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &compiled);
+    InterpretResult result = interpretChunk(vm, chunk, codeStart);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    if (result == INTERPRET_RUNTIME_ERROR) {
+        chunk->count = codeStart;
+        chunk->constants.count = constantStart;
+    }
+
+    // パイプやファイルから読んでいるときは出力を汚さない
+    if (isatty(STDIN_FILENO)) {
+        fprintf(stderr, "(compile %.3f ms, run %.3f ms)\n",
+                elapsedMillis(&start, &compiled), elapsedMillis(&compiled, &finished));
+    }
+}
+
+static void repl(VM* vm) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    // getlineで読むので1行の長さに制限はない
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    // 複数行にまたがる入力を溜めておくバッファ
+    char* input = NULL;
+    size_t inputLength = 0;
+    for (;;) {
+        printf(inputLength == 0 ? "> " : "... ");
+        fflush(stdout);
+        ssize_t length = getline(&line, &lineCapacity, stdin);
+        if (length < 0) {
             printf("\n");
+            // 途中までの入力もコンパイルしてエラーを表示する
+            if (inputLength > 0) {
+                replEntry(vm, &chunk, input);
+            }
             break;
         }
 
-        interpret(line);
+        input = (char*)realloc(input, inputLength + length + 1);
+        if (input == NULL) {
+            fprintf(stderr, "Not enough memory to read input.\n");
+            exit(74);
+        }
+        memcpy(input + inputLength, line, length + 1);
+        inputLength += length;
+
+        if (isComplete(input)) {
+            replEntry(vm, &chunk, input);
+            inputLength = 0;
+        }
     }
+
+    free(line);
+    free(input);
+    freeChunk(&chunk);
 }
 
 static char* readFile(const char* path) {
@@ -43,29 +153,275 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
+/**
+ * @return プロセスの終了コード
+ */
+static int exitCode(InterpretResult result) {
     if (result == INTERPRET_COMPILE_ERROR) {
-        exit(65);
+        return 65;
     }
     if (result == INTERPRET_RUNTIME_ERROR) {
-        exit(70);
+        return 70;
+    }
+    return 0;
+}
+
+static int runFile(VM* vm, const char* path) {
+    char* source = readFile(path);
+    InterpretResult result = interpret(vm, source);
+    free(source);
+    return exitCode(result);
+}
+
+/**
+ * ファイル全体を読み込まずに、少しずつ読みながらコンパイルする
+ * @param path "-"なら標準入力
+ */
+static int streamFile(VM* vm, const char* path) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    InterpretResult result = interpretStream(vm, fd);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return exitCode(result);
+}
+
+/**
+ * --scan: コンパイルせずにtokenを読むだけにして、scannerの速度を測る
+ * @return プロセスの終了コード
+ */
+static int scanFile(const char* path) {
+    char* source = readFile(path);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Scanner scanner;
+    initScanner(&scanner, source);
+    long tokens = 0;
+    int errors = 0;
+    for (;;) {
+        Token token = scanToken(&scanner);
+        tokens++;
+        if (token.type == TOKEN_ERROR) {
+            errors++;
+        }
+        if (token.type == TOKEN_EOF) {
+            break;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%ld tokens in %.6fs (%.0f tokens/sec)\n", tokens, seconds, seconds > 0 ? tokens / seconds : 0);
+    free(source);
+    return errors == 0 ? 0 : 65;
+}
+
+/**
+ * --symbols: 1行に1つずつ書かれた文字列を共有intern表に登録する
+ * すべてのVM(--poolのワーカーも含む)で同じObjStringが使われる
+ */
+static void loadSymbols(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &lineCapacity, file)) >= 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            length--;
+        }
+        if (length > 0) {
+            addSharedString(line, (int)length);
+        }
     }
+    free(line);
+    fclose(file);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [--dump] [--trace] [--profile[=path]] [--stats] [--scan] [--stream] [--pool N] [--symbols path]\n       [--save-image path] [--load-image path] [--entry name] [--engine=stack|register] [--jit[=N]] [path | -]\n", name);
+    exit(64);
+}
+
+#ifdef PROFILE_EXECUTION
+static const char* profilePath = "clox.folded";
+
+// 実行時エラーでexitしたときにも書き出すためatexitで呼ぶ
+static void reportProfile() {
+    writeProfile(profilePath);
+    freeProfiler();
 }
+#endif
 
 int main(int argc, const char* argv[]) {
-    initVM();
+    const char* path = NULL;
+    bool printCode = false;
+    bool traceExecution = false;
+    bool profileExecution = false;
+    bool showStats = false;
+    bool scanOnly = false;
+    bool stream = false;
+    int poolThreads = 0;
+    const char* saveImagePath = NULL;
+    const char* loadImagePath = NULL;
+    const char* entryName = NULL;
+    bool registerEngine = false;
+    int jitThreshold = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dump") == 0) {
+            printCode = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            showStats = true;
+        } else if (strcmp(argv[i], "--scan") == 0) {
+            scanOnly = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--symbols") == 0) {
+            // initVMが組み込み関数の名前をinternする前、スレッドを起動する前に読み込む
+            if (i + 1 == argc) {
+                usage(argv[0]);
+            }
+            loadSymbols(argv[++i]);
+        } else if (strcmp(argv[i], "--save-image") == 0 || strcmp(argv[i], "--load-image") == 0) {
+            if (i + 1 == argc) {
+                usage(argv[0]);
+            }
+            if (argv[i][2] == 's') {
+                saveImagePath = argv[++i];
+            } else {
+                loadImagePath = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--entry") == 0) {
+            // スクリプト(あれば)の後にグローバル変数の関数を呼ぶ、pathがなければREPLは起動しない
+            if (i + 1 == argc) {
+                usage(argv[0]);
+            }
+            entryName = argv[++i];
+        } else if (strcmp(argv[i], "--engine=stack") == 0 || strcmp(argv[i], "--engine=register") == 0) {
+            // registerはスタック命令をレジスタ命令に翻訳して実行する(bench/engines.shで比べる)
+            registerEngine = argv[i][9] == 'r';
+        } else if (strncmp(argv[i], "--jit", 5) == 0 && (argv[i][5] == '\0' || argv[i][5] == '=')) {
+            // Nはchunkに入った回数とループした回数の合計の閾値、0なら最初からJITする
+#ifdef TEMPLATE_JIT
+            jitThreshold = JIT_THRESHOLD;
+            if (argv[i][5] == '=' && (argv[i][6] < '0' || argv[i][6] > '9' || (jitThreshold = atoi(argv[i] + 6)) < 0)) {
+                usage(argv[0]);
+            }
+#else
+            fprintf(stderr, "--jit requires x86-64 Linux.\n");
+            exit(64);
+#endif
+        } else if (strcmp(argv[i], "--pool") == 0) {
+            // pathはスクリプトではなく、スクリプトのパスの一覧
+            if (i + 1 == argc || (poolThreads = atoi(argv[++i])) < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--trace") == 0) {
+#ifdef DEBUG_TRACE_EXECUTION
+            traceExecution = true;
+#else
+            fprintf(stderr, "--trace requires a debug build (make clox-debug).\n");
+            exit(64);
+#endif
+        } else if (strncmp(argv[i], "--profile", 9) == 0 && (argv[i][9] == '\0' || argv[i][9] == '=')) {
+#ifdef PROFILE_EXECUTION
+            profileExecution = true;
+            if (argv[i][9] == '=') {
+                profilePath = argv[i] + 10;
+            }
+#else
+            fprintf(stderr, "--profile requires a profile build (make clox-profile).\n");
+            exit(64);
+#endif
+        } else if ((argv[i][0] == '-' && argv[i][1] != '\0') || path != NULL) {
+            usage(argv[0]);
+        } else {
+            path = argv[i];
+        }
+    }
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    if (entryName != NULL && (poolThreads > 0 || scanOnly)) {
+        usage(argv[0]);
+    }
+
+    // トレースとプロファイラはスタック命令を1つずつ見る
+    if (registerEngine && (traceExecution || profileExecution)) {
+        fprintf(stderr, "--trace and --profile require --engine=stack.\n");
+        exit(64);
+    }
+    // JITしたコードはスタック命令を1つずつ実行しない
+    if (jitThreshold >= 0 && (registerEngine || traceExecution || profileExecution)) {
+        fprintf(stderr, "--jit cannot be combined with --engine=register, --trace or --profile.\n");
+        exit(64);
+    }
+
+    // プロファイラはスレッドごとに分かれていないので、複数のVMを同時に計測できない
+    if (poolThreads > 0 && profileExecution) {
+        fprintf(stderr, "--profile cannot be combined with --pool.\n");
+        exit(64);
+    }
+
+    // 共有intern表ができてからVMを作る
+    // 先に作ると組み込み関数の名前がVM自身のintern表に入り、
+    // コンパイラが共有intern表から引いた同じ名前と別のObjStringになってしまう
+    VM vm;
+    initVM(&vm);
+    vm.printCode = printCode;
+    vm.traceExecution = traceExecution;
+    vm.profileExecution = profileExecution;
+    vm.registerEngine = registerEngine;
+    vm.jitThreshold = jitThreshold;
+
+#ifdef PROFILE_EXECUTION
+    if (vm.profileExecution) {
+        initProfiler();
+        atexit(reportProfile);
+    }
+#endif
+
+    // 初期化済みの状態を復元してから、スクリプトをその続きとして実行する
+    if (loadImagePath != NULL && !loadImage(&vm, loadImagePath)) {
+        exit(74);
+    }
+
+    int status = 0;
+    if (poolThreads > 0) {
+        status = runPool(poolThreads, path, loadImagePath, registerEngine, jitThreshold);
+    } else if (scanOnly) {
+        if (path == NULL) {
+            usage(argv[0]);
+        }
+        status = scanFile(path);
+    } else if (path == NULL) {
+        if (entryName == NULL) {
+            repl(&vm);
+        }
+    } else if (stream || strcmp(path, "-") == 0) {
+        status = streamFile(&vm, path);
     } else {
-        fprintf(stderr, "Usage: %s [path]\n", argv[0]);
-        return 64;
+        status = runFile(&vm, path);
+    }
+    if (entryName != NULL && status == 0) {
+        status = exitCode(interpretEntry(&vm, entryName));
     }
 
-    freeVM();
-    return 0;
+    if (saveImagePath != NULL && status == 0 && poolThreads == 0 && !scanOnly && !saveImage(&vm, saveImagePath)) {
+        status = 74;
+    }
+
+    // 解放する前のヒープの状態を表示する
+    if (showStats) {
+        printHeapStats();
+    }
+    freeVM(&vm);
+    freeSharedStrings();
+    return status;
 }
\ No newline at end of file
@@ -2,9 +2,29 @@
 #include "object.h"
 #include "vm.h"
 
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+_Thread_local HeapStats heapStats;
+
+// 終了したワーカースレッドの統計の合計
+static HeapStats workerStats;
+static pthread_mutex_t workerStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    // 差分だけを記録する(GROW_ARRAYは新旧両方のサイズを渡してくる)
+    if (newSize > oldSize) {
+        heapStats.bytesAllocated += newSize - oldSize;
+        heapStats.liveBytes += newSize - oldSize;
+        if (heapStats.liveBytes > heapStats.peakBytes) {
+            heapStats.peakBytes = heapStats.liveBytes;
+        }
+    } else {
+        heapStats.bytesFreed += oldSize - newSize;
+        heapStats.liveBytes -= oldSize - newSize;
+    }
+
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -18,6 +38,7 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 }
 
 static void freeObject(Obj* object) {
+    heapStats.objectsFreed[object->type]++;
     switch (object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
@@ -25,14 +46,118 @@ static void freeObject(Obj* object) {
             FREE(ObjString, object);
             break;
         }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            freeChunk(&function->chunk);
+            FREE(ObjFunction, object);
+            break;
+        }
+        case OBJ_NATIVE: {
+            FREE(ObjNative, object);
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            freeValueArray(&list->items);
+            FREE(ObjList, object);
+            break;
+        }
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*)object;
+            freeTable(&map->table);
+            FREE(ObjMap, object);
+            break;
+        }
     }
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+void freeObjects(VM* vm) {
+    Obj* object = vm->objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+}
+
+static const char* objTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",
+    [OBJ_LIST] = "list",
+    [OBJ_MAP] = "map",
+};
+
+static void addHeapStats(HeapStats* to, HeapStats* from) {
+    to->bytesAllocated += from->bytesAllocated;
+    to->bytesFreed += from->bytesFreed;
+    to->liveBytes += from->liveBytes;
+    // スレッドごとの最大値が同時に起きたとは限らないので、足さずに大きい方を取る
+    if (from->peakBytes > to->peakBytes) {
+        to->peakBytes = from->peakBytes;
+    }
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        to->objectsAllocated[i] += from->objectsAllocated[i];
+        to->objectsFreed[i] += from->objectsFreed[i];
+    }
+    to->internHits += from->internHits;
+    to->internMisses += from->internMisses;
+    to->sharedInternHits += from->sharedInternHits;
+    for (int i = 0; i < PROBE_HISTOGRAM_SIZE; i++) {
+        to->tableProbes[i] += from->tableProbes[i];
+    }
+    to->instructions += from->instructions;
+}
+
+/**
+ * 呼び出したスレッドの統計をワーカーの合計に足す
+ * --poolのワーカーが終了する前に呼ぶ
+ */
+void mergeHeapStats() {
+    pthread_mutex_lock(&workerStatsLock);
+    addHeapStats(&workerStats, &heapStats);
+    pthread_mutex_unlock(&workerStatsLock);
+}
+
+/**
+ * メインスレッドの統計と、終了したワーカーの統計の合計を表示する
+ * peak bytesはスレッドごとの最大値のうち一番大きいもの
+ */
+void printHeapStats() {
+    HeapStats stats = heapStats;
+    pthread_mutex_lock(&workerStatsLock);
+    addHeapStats(&stats, &workerStats);
+    pthread_mutex_unlock(&workerStatsLock);
+
+    fprintf(stderr, "bytes allocated   %zu\n", stats.bytesAllocated);
+    fprintf(stderr, "bytes freed       %zu\n", stats.bytesFreed);
+    fprintf(stderr, "live bytes        %zu\n", stats.liveBytes);
+    fprintf(stderr, "peak bytes        %zu\n", stats.peakBytes);
+
+    fprintf(stderr, "\n%-16s %12s %12s\n", "object", "allocated", "freed");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        fprintf(stderr, "%-16s %12zu %12zu\n", objTypeNames[i], stats.objectsAllocated[i], stats.objectsFreed[i]);
+    }
+
+    size_t lookups = stats.internHits + stats.internMisses;
+    double hitRate = lookups == 0 ? 0 : 100.0 * stats.internHits / lookups;
+    double sharedRate = lookups == 0 ? 0 : 100.0 * stats.sharedInternHits / lookups;
+    fprintf(stderr, "\nintern lookups    %zu (%.2f%% hit, %.2f%% shared)\n", lookups, hitRate, sharedRate);
+
+#ifdef TABLE_PROBE_STATS
+    fprintf(stderr, "\n%-16s %12s\n", "table probes", "lookups");
+    for (int i = 1; i < PROBE_HISTOGRAM_SIZE; i++) {
+        if (stats.tableProbes[i] == 0) {
+            continue;
+        }
+        fprintf(stderr, "%2d%-14s %12zu\n", i, i == PROBE_HISTOGRAM_SIZE - 1 ? "+" : "", stats.tableProbes[i]);
+    }
+#else
+    fprintf(stderr, "\ntable probes      not counted in release builds (make clox-debug or clox-profile)\n");
+#endif
+#ifdef INSTRUCTION_STATS
+    fprintf(stderr, "\ninstructions      %zu\n", stats.instructions);
+#else
+    fprintf(stderr, "\ninstructions      not counted in release builds (make clox-debug or clox-profile)\n");
+#endif
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define MEMORY_H
 
 #include "common.h"
+#include "object.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -16,6 +17,58 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// 探索長のヒストグラムの区間数、最後の区間はそれ以上の長さをまとめる
+#define PROBE_HISTOGRAM_SIZE 16
+
+/**
+ * ヒープの統計
+ * 
+ * すべての確保と解放はreallocateを通るので、そこでまとめて集計する
+ * --statsで終了時に表示し、Cからは heapStats を直接読める
+ * 複数のVMを別々のスレッドで動かすときに競合しないように、統計はスレッドごとに持つ
+ * --poolのワーカーは終了時にmergeHeapStatsで自分の統計を足し込む
+ */
+typedef struct {
+    size_t bytesAllocated; // 累計で確保したバイト数
+    size_t bytesFreed; // 累計で解放したバイト数
+    size_t liveBytes; // 現在確保されているバイト数
+    size_t peakBytes; // liveBytesの最大値
+    size_t objectsAllocated[OBJ_TYPE_COUNT];
+    size_t objectsFreed[OBJ_TYPE_COUNT];
+    size_t internHits; // 文字列がすでにvm.stringsにinternされていた回数
+    size_t internMisses; // 新しい文字列をinternした回数
+    size_t sharedInternHits; // internHitsのうち共有intern表で見つかった回数
+    size_t tableProbes[PROBE_HISTOGRAM_SIZE]; // tableのlookupごとの探索したentryの数
+    size_t instructions; // 実行した命令の数(スタック命令とレジスタ命令を区別しない)
+} HeapStats;
+
+extern _Thread_local HeapStats heapStats;
+
+/**
+ * tableのlookup1回分の探索長を記録する
+ * @param probes 見つかるまでに調べたentryの数(1以上)
+ */
+static inline void recordTableProbe(int probes) {
+#ifdef TABLE_PROBE_STATS
+    if (probes >= PROBE_HISTOGRAM_SIZE) {
+        probes = PROBE_HISTOGRAM_SIZE - 1;
+    }
+    heapStats.tableProbes[probes]++;
+#endif
+}
+
+/**
+ * 実行した命令を数える
+ * @param count 数えた数、quickeningで同じ命令を実行し直すときは-1で取り消す
+ */
+static inline void recordInstructions(int count) {
+#ifdef INSTRUCTION_STATS
+    heapStats.instructions += count;
+#else
+    (void)count;
+#endif
+}
+
 /**
  * Reallocates memory.
  * @param pointer the pointer to the memory to reallocate
@@ -24,6 +77,8 @@
  * @return the pointer to the reallocated memory
  */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+void freeObjects(VM* vm);
+void mergeHeapStats();
+void printHeapStats();
 
 #endif
\ No newline at end of file
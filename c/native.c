@@ -0,0 +1,324 @@
+#include "native.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * エラーメッセージをargs[-1]に置いてfalseを返す
+ * 文字列を確保するのはエラーのときだけ
+ */
+static bool nativeError(VM* vm, Value* args, const char* message) {
+    args[-1] = OBJ_VAL((Obj*)copyString(vm, message, (int)strlen(message)));
+    return false;
+}
+
+static bool clockNative(VM* vm, int argCount, Value* args) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    args[-1] = NUMBER_VAL((double)now.tv_sec + (double)now.tv_nsec / 1e9);
+    return true;
+}
+
+static bool lenNative(VM* vm, int argCount, Value* args) {
+    if (IS_STRING(args[0])) {
+        args[-1] = NUMBER_VAL(AS_STRING(args[0])->length);
+    } else if (IS_LIST(args[0])) {
+        args[-1] = NUMBER_VAL(AS_LIST(args[0])->items.count);
+    } else if (IS_MAP(args[0])) {
+        args[-1] = NUMBER_VAL(AS_MAP(args[0])->count);
+    } else {
+        return nativeError(vm, args, "Argument must be a string, a list or a map.");
+    }
+    return true;
+}
+
+static bool substringNative(VM* vm, int argCount, Value* args) {
+    if (!IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
+        return nativeError(vm, args, "Arguments must be a string and two numbers.");
+    }
+    ObjString* string = AS_STRING(args[0]);
+    double start = AS_NUMBER(args[1]);
+    double end = AS_NUMBER(args[2]);
+    if (start != floor(start) || end != floor(end) || start < 0 || start > end || end > string->length) {
+        return nativeError(vm, args, "Substring range out of bounds.");
+    }
+    args[-1] = OBJ_VAL((Obj*)copyString(vm, string->chars + (int)start, (int)(end - start)));
+    return true;
+}
+
+/**
+ * 数値を1つ受け取る数学関数
+ */
+#define MATH_NATIVE(name, function) \
+    static bool name(VM* vm, int argCount, Value* args) { \
+        if (!IS_NUMBER(args[0])) { \
+            return nativeError(vm, args, "Argument must be a number."); \
+        } \
+        args[-1] = NUMBER_VAL(function(AS_NUMBER(args[0]))); \
+        return true; \
+    }
+
+/**
+ * 数値を2つ受け取る数学関数
+ */
+#define MATH_NATIVE2(name, function) \
+    static bool name(VM* vm, int argCount, Value* args) { \
+        if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) { \
+            return nativeError(vm, args, "Arguments must be numbers."); \
+        } \
+        args[-1] = NUMBER_VAL(function(AS_NUMBER(args[0]), AS_NUMBER(args[1]))); \
+        return true; \
+    }
+
+MATH_NATIVE(absNative, fabs)
+MATH_NATIVE(floorNative, floor)
+MATH_NATIVE(sqrtNative, sqrt)
+MATH_NATIVE2(powNative, pow)
+MATH_NATIVE2(minNative, fmin)
+MATH_NATIVE2(maxNative, fmax)
+
+#undef MATH_NATIVE
+#undef MATH_NATIVE2
+
+static bool appendNative(VM* vm, int argCount, Value* args) {
+    if (!IS_LIST(args[0])) {
+        return nativeError(vm, args, "First argument must be a list.");
+    }
+    appendToList(AS_LIST(args[0]), args[1]);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool sliceNative(VM* vm, int argCount, Value* args) {
+    if (!IS_LIST(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
+        return nativeError(vm, args, "Arguments must be a list and two numbers.");
+    }
+    ObjList* list = AS_LIST(args[0]);
+    double start = AS_NUMBER(args[1]);
+    double end = AS_NUMBER(args[2]);
+    if (start != floor(start) || end != floor(end) || start < 0 || start > end || end > list->items.count) {
+        return nativeError(vm, args, "Slice range out of bounds.");
+    }
+    ObjList* slice = newList(vm, (int)(end - start));
+    for (int i = (int)start; i < (int)end; i++) {
+        appendToList(slice, list->items.values[i]);
+    }
+    args[-1] = OBJ_VAL((Obj*)slice);
+    return true;
+}
+
+/**
+ * 数値だけの配列の和
+ *
+ * 4つの独立した和に分けて足し、加算の依存の連鎖を切る(ループ1周で4つの加算が並行に進む)
+ * Valueは型タグ付きの16バイトでdoubleが連続していないので、SIMDでまとめてloadすることはできない
+ * 足す順番が変わるので、先頭から順に足した場合と最後の桁の丸めが異なることがある
+ */
+static double sumNumbers(const Value* values, int count) {
+    double sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum0 += AS_NUMBER(values[i]);
+        sum1 += AS_NUMBER(values[i + 1]);
+        sum2 += AS_NUMBER(values[i + 2]);
+        sum3 += AS_NUMBER(values[i + 3]);
+    }
+    for (; i < count; i++) {
+        sum0 += AS_NUMBER(values[i]);
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+static bool sumNative(VM* vm, int argCount, Value* args) {
+    if (!IS_LIST(args[0])) {
+        return nativeError(vm, args, "Argument must be a list.");
+    }
+    ObjList* list = AS_LIST(args[0]);
+    // 数値でない要素の数を数えてあるので、要素ごとに型を確かめずに済む
+    if (list->nonNumbers > 0) {
+        return nativeError(vm, args, "List must contain only numbers.");
+    }
+    args[-1] = NUMBER_VAL(sumNumbers(list->items.values, list->items.count));
+    return true;
+}
+
+typedef double (*NumberFn)(double);
+
+/**
+ * 数値を1つ受け取る数学の組み込み関数なら、中で呼んでいるCの関数を返す
+ * @return それ以外の組み込み関数ならNULL
+ */
+static NumberFn numberFunctionOf(ObjNative* native) {
+    if (native->function == absNative) {
+        return fabs;
+    }
+    if (native->function == floorNative) {
+        return floor;
+    }
+    if (native->function == sqrtNative) {
+        return sqrt;
+    }
+    return NULL;
+}
+
+/**
+ * 各要素に1引数の関数(組み込み関数またはLoxの関数)を適用した新しいlistを返す
+ *
+ * 数値だけのlistに数学の組み込み関数を適用するときは、型を確かめずにCの関数を直接呼ぶ
+ * 他の組み込み関数は値スタックを通さず、Cの配列を呼び出しの枠にして直接呼ぶ
+ * Loxの関数はcallFromNativeでVMに入り直して呼ぶ
+ */
+static bool mapNative(VM* vm, int argCount, Value* args) {
+    if (!IS_LIST(args[0]) || (!IS_NATIVE(args[1]) && !IS_FUNCTION(args[1]))) {
+        return nativeError(vm, args, "Arguments must be a list and a function.");
+    }
+    int arity = IS_NATIVE(args[1]) ? AS_NATIVE(args[1])->arity : AS_FUNCTION(args[1])->arity;
+    if (arity != 1) {
+        return nativeError(vm, args, "Function passed to map must take one argument.");
+    }
+    ObjList* list = AS_LIST(args[0]);
+    ObjList* result = newList(vm, list->items.count);
+
+    if (IS_FUNCTION(args[1])) {
+        ObjFunction* function = AS_FUNCTION(args[1]);
+        // 呼んだ関数の中でスタックが確保し直されるとargsが指す先が変わるので、位置で覚えておく
+        ptrdiff_t base = args - vm->stack;
+        // 関数がlistに要素を追加することもあるので、毎回countとvaluesを読み直す
+        for (int i = 0; i < list->items.count; i++) {
+            Value item = list->items.values[i];
+            Value value;
+            if (!callFromNative(vm, function, 1, &item, &value)) {
+                // エラーは表示済みなので、callNativeにはnilで知らせる
+                vm->stack[base - 1] = NIL_VAL;
+                return false;
+            }
+            appendToList(result, value);
+        }
+        vm->stack[base - 1] = OBJ_VAL((Obj*)result);
+        return true;
+    }
+
+    ObjNative* native = AS_NATIVE(args[1]);
+    NumberFn numberFunction = numberFunctionOf(native);
+    if (numberFunction != NULL && list->nonNumbers == 0) {
+        Value* items = list->items.values;
+        Value* values = result->items.values;
+        for (int i = 0; i < list->items.count; i++) {
+            values[i] = NUMBER_VAL(numberFunction(AS_NUMBER(items[i])));
+        }
+        result->items.count = list->items.count;
+        args[-1] = OBJ_VAL((Obj*)result);
+        return true;
+    }
+
+    // frame[0]が戻り値のスロット、frame[1]が引数
+    Value frame[2];
+    for (int i = 0; i < list->items.count; i++) {
+        frame[1] = list->items.values[i];
+        if (!native->function(vm, 1, &frame[1])) {
+            args[-1] = frame[0];
+            return false;
+        }
+        appendToList(result, frame[0]);
+    }
+    args[-1] = OBJ_VAL((Obj*)result);
+    return true;
+}
+
+static bool hasNative(VM* vm, int argCount, Value* args) {
+    if (!IS_MAP(args[0])) {
+        return nativeError(vm, args, "First argument must be a map.");
+    }
+    Value value;
+    args[-1] = BOOL_VAL(tableGetValue(&AS_MAP(args[0])->table, args[1], &value));
+    return true;
+}
+
+static bool removeNative(VM* vm, int argCount, Value* args) {
+    if (!IS_MAP(args[0])) {
+        return nativeError(vm, args, "First argument must be a map.");
+    }
+    args[-1] = BOOL_VAL(isMapKey(args[1]) && deleteMapEntry(AS_MAP(args[0]), args[1]));
+    return true;
+}
+
+/**
+ * mapのkeyまたはvalueを、table上の並び順でlistにする
+ * Loxにはfor-inがないので、mapの走査はこのlistを添字で回す
+ */
+static bool mapEntries(VM* vm, Value* args, bool keys) {
+    if (!IS_MAP(args[0])) {
+        return nativeError(vm, args, "Argument must be a map.");
+    }
+    ObjMap* map = AS_MAP(args[0]);
+    ObjList* list = newList(vm, map->count);
+    for (int i = 0; i < map->table.capacity; i++) {
+        Entry* entry = &map->table.entries[i];
+        if (!IS_NIL(entry->key)) {
+            appendToList(list, keys ? entry->key : entry->value);
+        }
+    }
+    args[-1] = OBJ_VAL((Obj*)list);
+    return true;
+}
+
+static bool keysNative(VM* vm, int argCount, Value* args) {
+    return mapEntries(vm, args, true);
+}
+
+static bool valuesNative(VM* vm, int argCount, Value* args) {
+    return mapEntries(vm, args, false);
+}
+
+static bool readFileNative(VM* vm, int argCount, Value* args) {
+    if (!IS_STRING(args[0])) {
+        return nativeError(vm, args, "Argument must be a string.");
+    }
+    FILE* file = fopen(AS_CSTRING(args[0]), "rb");
+    if (file == NULL) {
+        return nativeError(vm, args, "Could not open file.");
+    }
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size < 0) {
+        fclose(file);
+        return nativeError(vm, args, "Could not read file.");
+    }
+
+    char* chars = ALLOCATE(char, size + 1);
+    size_t bytesRead = fread(chars, sizeof(char), size, file);
+    fclose(file);
+    if (bytesRead < (size_t)size) {
+        FREE_ARRAY(char, chars, size + 1);
+        return nativeError(vm, args, "Could not read file.");
+    }
+    chars[size] = '\0';
+    args[-1] = OBJ_VAL((Obj*)takeString(vm, chars, (int)size));
+    return true;
+}
+
+void defineStandardNatives(VM* vm) {
+    defineNative(vm, "clock", 0, clockNative);
+    defineNative(vm, "len", 1, lenNative);
+    defineNative(vm, "substring", 3, substringNative);
+    defineNative(vm, "abs", 1, absNative);
+    defineNative(vm, "floor", 1, floorNative);
+    defineNative(vm, "sqrt", 1, sqrtNative);
+    defineNative(vm, "pow", 2, powNative);
+    defineNative(vm, "min", 2, minNative);
+    defineNative(vm, "max", 2, maxNative);
+    defineNative(vm, "readFile", 1, readFileNative);
+    defineNative(vm, "append", 2, appendNative);
+    defineNative(vm, "slice", 3, sliceNative);
+    defineNative(vm, "sum", 1, sumNative);
+    defineNative(vm, "map", 2, mapNative);
+    defineNative(vm, "has", 2, hasNative);
+    defineNative(vm, "remove", 2, removeNative);
+    defineNative(vm, "keys", 1, keysNative);
+    defineNative(vm, "values", 1, valuesNative);
+}
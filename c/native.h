@@ -0,0 +1,24 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "vm.h"
+
+/**
+ * 標準の組み込み関数をvmのグローバル変数として登録する(initVMから呼ぶ)
+ *
+ * clock()                        経過時間を測るための秒数(単調増加)
+ * len(string | list | map)       文字列の長さ、listの要素の数、mapのentryの数
+ * substring(string, start, end)  [start, end)の部分文字列
+ * abs(x) floor(x) sqrt(x) pow(x, y) min(x, y) max(x, y)
+ * readFile(path)                 ファイルの中身を文字列で返す
+ * append(list, value)            listの末尾にvalueを追加する
+ * slice(list, start, end)        [start, end)の要素の新しいlist
+ * sum(list)                      数値だけのlistの和
+ * map(list, function)            各要素に1引数の関数(組み込み関数かLoxの関数)を適用した新しいlist
+ * has(map, key)                  keyがあるか
+ * remove(map, key)               keyを削除する、あればtrue
+ * keys(map) values(map)          keyまたはvalueのlist
+ */
+void defineStandardNatives(VM* vm);
+
+#endif
@@ -4,24 +4,81 @@
 #include <stdio.h>
 #include <string.h>
 
-#define ALLOCATE_OBJ(type, objType) \
-    (type*)allocateObject(sizeof(type), objType)
+// すべてのVMで共有する読み取り専用のintern表(addSharedStringの後は変更しない)
+static Table sharedStrings;
 
-static Obj* allocateObject(size_t size, ObjType type) {
+#define ALLOCATE_OBJ(vm, type, objType) \
+    (type*)allocateObject(vm, sizeof(type), objType)
+
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
+    heapStats.objectsAllocated[type]++;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
     return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjFunction* newFunction(VM* vm) {
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
+    function->arity = 0;
+    function->name = NULL;
+    initChunk(&function->chunk);
+    return function;
+}
+
+ObjNative* newNative(VM* vm, ObjString* name, NativeFn function, int arity) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+    native->arity = arity;
+    native->function = function;
+    native->name = name;
+    return native;
+}
+
+ObjList* newList(VM* vm, int capacity) {
+    ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    list->nonNumbers = 0;
+    if (capacity > 0) {
+        list->items.values = ALLOCATE(Value, capacity);
+        list->items.capacity = capacity;
+    }
+    return list;
+}
+
+void appendToList(ObjList* list, Value value) {
+    list->nonNumbers += !IS_NUMBER(value);
+    writeValueArray(&list->items, value);
+}
+
+ObjMap* newMap(VM* vm) {
+    ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+    initTable(&map->table);
+    map->count = 0;
+    return map;
+}
+
+void setMapEntry(ObjMap* map, Value key, Value value) {
+    if (tableSetValue(&map->table, key, value)) {
+        map->count++;
+    }
+}
+
+bool deleteMapEntry(ObjMap* map, Value key) {
+    if (!tableDeleteValue(&map->table, key)) {
+        return false;
+    }
+    map->count--;
+    return true;
+}
+
+static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash) {
+    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(&vm->strings, string, NIL_VAL);
     return string;
 }
 
@@ -40,32 +97,161 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
-ObjString* takeString(char* chars, int length) {
+/**
+ * 共有intern表、VMのintern表の順に探す
+ * 共有intern表にある文字列はVMの表には入らないので、同じ文字列が2つできることはない
+ */
+static ObjString* findInterned(VM* vm, const char* chars, int length, uint32_t hash) {
+    ObjString* interned = tableFindString(&sharedStrings, chars, length, hash);
+    if (interned != NULL) {
+        heapStats.sharedInternHits++;
+        return interned;
+    }
+    return tableFindString(&vm->strings, chars, length, hash);
+}
+
+ObjString* takeString(VM* vm, char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(vm, chars, length, hash);
     if (interned != NULL) {
+        heapStats.internHits++;
         FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
-    return allocateString(chars, length, hash);
+    heapStats.internMisses++;
+    return allocateString(vm, chars, length, hash);
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(vm, chars, length, hash);
     if (interned != NULL) {
+        heapStats.internHits++;
         return interned;
     }
+    heapStats.internMisses++;
     char* heapChars = ALLOCATE(char, length + 1);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(vm, heapChars, length, hash);
+}
+
+void addSharedString(const char* chars, int length) {
+    uint32_t hash = hashString(chars, length);
+    if (tableFindString(&sharedStrings, chars, length, hash) != NULL) {
+        return;
+    }
+
+    // どのVMのobjectsにもつながないので、freeVMでは解放されない
+    ObjString* string = ALLOCATE(ObjString, 1);
+    string->obj.type = OBJ_STRING;
+    string->obj.next = NULL;
+    heapStats.objectsAllocated[OBJ_STRING]++;
+    string->length = length;
+    string->chars = ALLOCATE(char, length + 1);
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    string->hash = hash;
+    tableSet(&sharedStrings, string, NIL_VAL);
+}
+
+void freeSharedStrings() {
+    for (int i = 0; i < sharedStrings.capacity; i++) {
+        if (!IS_NIL(sharedStrings.entries[i].key)) {
+            ObjString* string = AS_STRING(sharedStrings.entries[i].key);
+            heapStats.objectsFreed[OBJ_STRING]++;
+            FREE_ARRAY(char, string->chars, string->length + 1);
+            FREE(ObjString, string);
+        }
+    }
+    freeTable(&sharedStrings);
 }
 
-void printObject(Value value) {
+// これより深く入れ子になったlistとmapは中身を表示しない(Cのスタックを使い切らないため)
+#define PRINT_DEPTH_MAX 64
+
+/**
+ * 表示中のlistとmapの連なり
+ * Cのスタック上に置き、内側の要素を表示するときに1つずつつなぐ
+ */
+typedef struct Printing {
+    Obj* object;
+    struct Printing* outer;
+    int depth;
+} Printing;
+
+static void printNested(FILE* file, Value value, Printing* outer);
+
+/**
+ * listやmapの要素を表示する
+ * 自分を含むlist (var a = []; append(a, a);) のように表示中のobjectに戻ってきたら、
+ * または入れ子が深すぎたら、中身の代わりに[...]か{...}を表示する
+ */
+static void printElement(FILE* file, Value value, Printing* outer) {
+    if (!IS_LIST(value) && !IS_MAP(value)) {
+        fprintValue(file, value);
+        return;
+    }
+    bool repeated = outer->depth >= PRINT_DEPTH_MAX;
+    for (Printing* printing = outer; printing != NULL && !repeated; printing = printing->outer) {
+        repeated = printing->object == AS_OBJ(value);
+    }
+    if (repeated) {
+        fputs(IS_LIST(value) ? "[...]" : "{...}", file);
+        return;
+    }
+    printNested(file, value, outer);
+}
+
+void printObject(FILE* file, Value value) {
+    printNested(file, value, NULL);
+}
+
+static void printNested(FILE* file, Value value, Printing* outer) {
+    Printing printing = {AS_OBJ(value), outer, outer == NULL ? 0 : outer->depth + 1};
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING: {
-            printf("%s", AS_CSTRING(value));
+            fputs(AS_CSTRING(value), file);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            fprintf(file, "<fn %s>", AS_FUNCTION(value)->name->chars);
+            break;
+        }
+        case OBJ_NATIVE: {
+            fputs("<native fn>", file);
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            fputc('[', file);
+            for (int i = 0; i < list->items.count; i++) {
+                if (i > 0) {
+                    fputs(", ", file);
+                }
+                printElement(file, list->items.values[i], &printing);
+            }
+            fputc(']', file);
+            break;
+        }
+        case OBJ_MAP: {
+            Table* table = &AS_MAP(value)->table;
+            bool first = true;
+            fputc('{', file);
+            for (int i = 0; i < table->capacity; i++) {
+                Entry* entry = &table->entries[i];
+                if (IS_NIL(entry->key)) {
+                    continue;
+                }
+                if (!first) {
+                    fputs(", ", file);
+                }
+                first = false;
+                printElement(file, entry->key, &printing);
+                fputs(": ", file);
+                printElement(file, entry->value, &printing);
+            }
+            fputc('}', file);
             break;
         }
     }
@@ -1,20 +1,37 @@
 #ifndef OBJECT_H
 #define OBJECT_H
 
+#include "chunk.h"
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
 
 typedef enum {
     OBJ_STRING,
+    OBJ_FUNCTION,
+    OBJ_NATIVE,
+    OBJ_LIST,
+    OBJ_MAP,
 } ObjType;
 
+// ObjTypeの種類の数(型ごとの統計の配列の大きさ)
+#define OBJ_TYPE_COUNT (OBJ_MAP + 1)
+
 struct Obj {
     ObjType type;
     struct Obj* next;
@@ -34,9 +51,92 @@ struct ObjString {
     uint32_t hash; // hash of the string to use in the hash table
 };
 
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-void printObject(Value value);
+// VMの前方宣言(vm.hはobject.hをincludeするので)
+typedef struct VM VM;
+
+/**
+ * Loxの関数
+ * 本体は自分のchunkにコンパイルされ、関数自体は宣言した側のchunkの定数になる
+ * 外側の関数のローカル変数は捕捉できない(クロージャは未実装)
+ */
+typedef struct {
+    Obj obj;
+    int arity; // 引数の数
+    Chunk chunk;
+    ObjString* name;
+} ObjFunction;
+
+/**
+ * Cで書かれた組み込み関数
+ *
+ * argsは値スタック上の引数をそのまま指す(コピーもboxingもしない)
+ * 戻り値はargs[-1](呼び出された関数が置かれていたスロット)に書き込む
+ * エラーのときはargs[-1]にメッセージの文字列を書き込んでfalseを返す
+ * 引数の数はVMが呼び出す前に確かめるので、関数の中で確かめる必要はない
+ * @param argCount 引数の数(arityと同じ)
+ * @return 成功したらtrue
+ */
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
+
+typedef struct {
+    Obj obj;
+    int arity; // 引数の数
+    NativeFn function;
+    ObjString* name; // 登録した名前(heap imageには関数の代わりにこの名前を保存する)
+} ObjNative;
+
+/**
+ * 要素を連続した配列に持つlist
+ * 数値でない要素の数を数えておき、0なら数値だけのlistとして
+ * sumなどの一括処理で要素ごとの型の確認を省く
+ */
+typedef struct {
+    Obj obj;
+    ValueArray items;
+    int nonNumbers; // 数値でない要素の数
+} ObjList;
+
+/**
+ * 任意の値(nilとNaNを除く)をキーにできるhash map
+ * 文字列は内容、数値は値、真偽値は値、それ以外のオブジェクトは同一性で区別する
+ */
+typedef struct {
+    Obj obj;
+    Table table;
+    int count; // entryの数(table.countと違ってtombstoneを含まない)
+} ObjMap;
+
+ObjFunction* newFunction(VM* vm);
+ObjNative* newNative(VM* vm, ObjString* name, NativeFn function, int arity);
+/**
+ * @param capacity 最初に確保しておく要素の数
+ */
+ObjList* newList(VM* vm, int capacity);
+void appendToList(ObjList* list, Value value);
+ObjMap* newMap(VM* vm);
+/**
+ * keyはisMapKeyであること
+ */
+void setMapEntry(ObjMap* map, Value key, Value value);
+/**
+ * @return keyがあって削除したらtrue
+ */
+bool deleteMapEntry(ObjMap* map, Value key);
+ObjString* takeString(VM* vm, char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
+/**
+ * プロセス全体で共有する読み取り専用のintern表に文字列を登録する
+ *
+ * 登録した文字列はどのVMのcopyString/takeStringでも、VMごとのstringsより先にこの表から見つかる
+ * 同じ名前やリテラルをVMごとにinternし直さずに済み、メモリも1つ分で済む
+ * 読む側はロックを取らないので、VMを作る(スレッドを起動する)前に1つのスレッドからだけ呼ぶこと
+ */
+void addSharedString(const char* chars, int length);
+/**
+ * 共有intern表とその文字列を解放する。すべてのVMを解放した後に呼ぶ
+ */
+void freeSharedStrings();
+void printObject(FILE* file, Value value);
 
 /**
  * 関数にする理由は、引数のvalueを二度使うから
@@ -46,4 +146,19 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/**
+ * nilは空きのentryを表し、NaNは自身と等しくないので、mapのキーにできない
+ */
+static inline bool isMapKey(Value key) {
+    return !IS_NIL(key) && !(IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key));
+}
+
+/**
+ * 要素を書き換える。indexは範囲内であること
+ */
+static inline void setListItem(ObjList* list, int index, Value value) {
+    list->nonNumbers += !IS_NUMBER(value) - !IS_NUMBER(list->items.values[index]);
+    list->items.values[index] = value;
+}
+
 #endif
\ No newline at end of file
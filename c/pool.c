@@ -0,0 +1,419 @@
+#include "pool.h"
+#include "image.h"
+#include "memory.h"
+#include "vm.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * 1つのスクリプトの実行
+ * done以外のフィールドはワーカーが書き、doneを立てた後に結果を表示するスレッドが読む
+ */
+typedef struct {
+    char* path;
+    char* output; // stdoutへの出力
+    size_t outputLength;
+    char* errors; // stderrへの出力
+    size_t errorsLength;
+    int status; // プロセスの終了コードと同じ意味
+    double seconds; // 読み込みからVMの解放までの時間
+    bool done;
+} PoolJob;
+
+/**
+ * ワーカーごとのキュー
+ * 持ち主は先頭から取り出し(入力順に近いほど早く表示できる)、他のワーカーは末尾から盗む
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    PoolJob** jobs;
+    int capacity;
+    int head; // 次に取り出す位置
+    int tail; // 次に追加する位置
+} WorkQueue;
+
+typedef struct Pool Pool;
+
+typedef struct {
+    Pool* pool;
+    int id;
+    pthread_t thread;
+} Worker;
+
+struct Pool {
+    int threadCount;
+    Worker* workers;
+    WorkQueue* queues;
+    FILE* list;
+    const char* imagePath;
+    bool registerEngine;
+    int jitThreshold;
+
+    // 以下はlockで守る(両方持つときはこのlockを先に取り、キューのlockを後に取る)
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable; // キューにjobが追加された、または入力が終わった
+    pthread_cond_t jobDone; // jobが終わった、jobが追加された、または入力が終わった
+    PoolJob** jobs; // 入力順のすべてのjob
+    int jobCount;
+    int jobCapacity;
+    int queued; // キューに入っていてまだ誰も取り出していないjobの数
+    bool closed; // 入力をすべて読み終えた
+    size_t steals;
+};
+
+static double elapsedSeconds(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void* growArray(void* pointer, int* capacity, size_t size) {
+    *capacity = *capacity < 8 ? 8 : *capacity * 2;
+    void* result = realloc(pointer, size * *capacity);
+    if (result == NULL) {
+        fprintf(stderr, "Not enough memory for the script pool.\n");
+        exit(74);
+    }
+    return result;
+}
+
+static void initQueue(WorkQueue* queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->jobs = NULL;
+    queue->capacity = 0;
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+static void freeQueue(WorkQueue* queue) {
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->jobs);
+}
+
+static void pushJob(WorkQueue* queue, PoolJob* job) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head == queue->tail) {
+        queue->head = 0;
+        queue->tail = 0;
+    }
+    if (queue->tail == queue->capacity) {
+        queue->jobs = growArray(queue->jobs, &queue->capacity, sizeof(PoolJob*));
+    }
+    queue->jobs[queue->tail++] = job;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @param steal trueなら末尾から、falseなら先頭から取り出す
+ * @return 空ならNULL
+ */
+static PoolJob* popJob(WorkQueue* queue, bool steal) {
+    pthread_mutex_lock(&queue->lock);
+    PoolJob* job = NULL;
+    if (queue->head < queue->tail) {
+        job = steal ? queue->jobs[--queue->tail] : queue->jobs[queue->head++];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+/**
+ * 自分のキューから、空なら隣のワーカーから順に盗んでjobを取り出す
+ * @return どのキューも空ならNULL
+ */
+static PoolJob* takeJob(Worker* worker) {
+    Pool* pool = worker->pool;
+    PoolJob* job = popJob(&pool->queues[worker->id], false);
+    bool stolen = false;
+    for (int i = 1; job == NULL && i < pool->threadCount; i++) {
+        job = popJob(&pool->queues[(worker->id + i) % pool->threadCount], true);
+        stolen = job != NULL;
+    }
+    if (job != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        if (stolen) {
+            pool->steals++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return job;
+}
+
+/**
+ * readFileと違い、読めなくてもプロセスを終了しない
+ * @return 読めなければNULL
+ */
+static char* readScript(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = fileSize < 0 ? NULL : (char*)malloc(fileSize + 1);
+    if (buffer == NULL || fread(buffer, sizeof(char), fileSize, file) < (size_t)fileSize) {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    buffer[fileSize] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+static int statusOf(InterpretResult result) {
+    switch (result) {
+        case INTERPRET_COMPILE_ERROR:
+            return 65;
+        case INTERPRET_RUNTIME_ERROR:
+            return 70;
+        default:
+            return 0;
+    }
+}
+
+static void runJob(Pool* pool, PoolJob* job) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FILE* out = open_memstream(&job->output, &job->outputLength);
+    FILE* err = open_memstream(&job->errors, &job->errorsLength);
+    char* source = readScript(job->path);
+    if (source == NULL) {
+        fprintf(err, "Could not open file \"%s\".\n", job->path);
+        job->status = 74;
+    } else {
+        VM vm;
+        initVM(&vm);
+        vm.out = out;
+        vm.err = err;
+        vm.registerEngine = pool->registerEngine;
+        vm.jitThreshold = pool->jitThreshold;
+        if (pool->imagePath != NULL && !loadImage(&vm, pool->imagePath)) {
+            job->status = 74;
+        } else {
+            job->status = statusOf(interpret(&vm, source));
+        }
+        freeVM(&vm);
+        free(source);
+    }
+    fclose(out);
+    fclose(err);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->seconds = elapsedSeconds(&start, &end);
+}
+
+static void* workerMain(void* argument) {
+    Worker* worker = (Worker*)argument;
+    Pool* pool = worker->pool;
+    for (;;) {
+        PoolJob* job = takeJob(worker);
+        if (job == NULL) {
+            pthread_mutex_lock(&pool->lock);
+            while (pool->queued == 0 && !pool->closed) {
+                pthread_cond_wait(&pool->workAvailable, &pool->lock);
+            }
+            bool finished = pool->queued == 0 && pool->closed;
+            pthread_mutex_unlock(&pool->lock);
+            if (finished) {
+                // --statsで表示できるように、このスレッドの統計をメインスレッドに渡す
+                mergeHeapStats();
+                return NULL;
+            }
+            continue;
+        }
+
+        runJob(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = true;
+        pthread_cond_signal(&pool->jobDone);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * パスの一覧を読みながら、ワーカーのキューに順番に配る
+ */
+static void* feederMain(void* argument) {
+    Pool* pool = (Pool*)argument;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &lineCapacity, pool->list)) >= 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+
+        PoolJob* job = (PoolJob*)calloc(1, sizeof(PoolJob));
+        if (job == NULL || (job->path = strdup(line)) == NULL) {
+            fprintf(stderr, "Not enough memory for the script pool.\n");
+            exit(74);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->jobCount == pool->jobCapacity) {
+            pool->jobs = growArray(pool->jobs, &pool->jobCapacity, sizeof(PoolJob*));
+        }
+        int index = pool->jobCount++;
+        pool->jobs[index] = job;
+        // ワーカーはキューから取り出してからqueuedを減らすので、キューに入れる前に増やす
+        // pool->lockを持ったまま入れれば、取り出したワーカーは減らす前にここを待つ
+        pool->queued++;
+        pushJob(&pool->queues[index % pool->threadCount], job);
+        pthread_cond_signal(&pool->workAvailable);
+        pthread_cond_signal(&pool->jobDone);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(line);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = true;
+    pthread_cond_broadcast(&pool->workAvailable);
+    pthread_cond_broadcast(&pool->jobDone);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @param sorted 昇順に並んだ値
+ * @param percent 0から100
+ */
+static double percentile(double* sorted, int count, double percent) {
+    int rank = (int)(percent / 100.0 * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank - 1];
+}
+
+static void reportPool(Pool* pool, double* latencies, double seconds) {
+    int count = pool->jobCount;
+    fprintf(stderr, "pool: %d scripts on %d threads in %.3fs (%.1f scripts/sec, %zu stolen)\n",
+            count, pool->threadCount, seconds, seconds > 0 ? count / seconds : 0, pool->steals);
+    if (count == 0) {
+        return;
+    }
+    qsort(latencies, count, sizeof(double), compareDoubles);
+    fprintf(stderr, "latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+            percentile(latencies, count, 50) * 1e3, percentile(latencies, count, 90) * 1e3,
+            percentile(latencies, count, 99) * 1e3, latencies[count - 1] * 1e3);
+}
+
+int runPool(int threadCount, const char* listPath, const char* imagePath, bool registerEngine, int jitThreshold) {
+    Pool pool;
+    pool.threadCount = threadCount;
+    pool.list = stdin;
+    pool.imagePath = imagePath;
+    pool.registerEngine = registerEngine;
+    pool.jitThreshold = jitThreshold;
+    if (listPath != NULL && strcmp(listPath, "-") != 0) {
+        pool.list = fopen(listPath, "r");
+        if (pool.list == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", listPath);
+            return 74;
+        }
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.workAvailable, NULL);
+    pthread_cond_init(&pool.jobDone, NULL);
+    pool.jobs = NULL;
+    pool.jobCount = 0;
+    pool.jobCapacity = 0;
+    pool.queued = 0;
+    pool.closed = false;
+    pool.steals = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pool.queues = (WorkQueue*)malloc(sizeof(WorkQueue) * threadCount);
+    pool.workers = (Worker*)malloc(sizeof(Worker) * threadCount);
+    if (pool.queues == NULL || pool.workers == NULL) {
+        fprintf(stderr, "Not enough memory for the script pool.\n");
+        exit(74);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        initQueue(&pool.queues[i]);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].id = i;
+        pthread_create(&pool.workers[i].thread, NULL, workerMain, &pool.workers[i]);
+    }
+    pthread_t feeder;
+    pthread_create(&feeder, NULL, feederMain, &pool);
+
+    // 終わったjobを入力の順番どおりに表示する
+    double* latencies = NULL;
+    int latencyCapacity = 0;
+    int status = 0;
+    for (int next = 0;; next++) {
+        pthread_mutex_lock(&pool.lock);
+        while ((next == pool.jobCount && !pool.closed) || (next < pool.jobCount && !pool.jobs[next]->done)) {
+            pthread_cond_wait(&pool.jobDone, &pool.lock);
+        }
+        PoolJob* job = next < pool.jobCount ? pool.jobs[next] : NULL;
+        pthread_mutex_unlock(&pool.lock);
+        if (job == NULL) {
+            break;
+        }
+
+        fwrite(job->output, 1, job->outputLength, stdout);
+        fwrite(job->errors, 1, job->errorsLength, stderr);
+        if (job->status > status) {
+            status = job->status;
+        }
+        if (next == latencyCapacity) {
+            latencies = growArray(latencies, &latencyCapacity, sizeof(double));
+        }
+        latencies[next] = job->seconds;
+
+        free(job->output);
+        free(job->errors);
+        free(job->path);
+        free(job);
+        // feederがpool.jobsをpool.lockの中で確保し直すので、書き込むときも同じlockを持つ
+        pthread_mutex_lock(&pool.lock);
+        pool.jobs[next] = NULL;
+        pthread_mutex_unlock(&pool.lock);
+    }
+    fflush(stdout);
+
+    pthread_join(feeder, NULL);
+    // 他のワーカーがまだ盗みに来るかもしれないので、全員が終わってからキューを解放する
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        freeQueue(&pool.queues[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    reportPool(&pool, latencies, elapsedSeconds(&start, &end));
+
+    free(latencies);
+    free(pool.jobs);
+    free(pool.queues);
+    free(pool.workers);
+    pthread_cond_destroy(&pool.workAvailable);
+    pthread_cond_destroy(&pool.jobDone);
+    pthread_mutex_destroy(&pool.lock);
+    if (pool.list != stdin) {
+        fclose(pool.list);
+    }
+    return status;
+}
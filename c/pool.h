@@ -0,0 +1,23 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "common.h"
+
+/**
+ * --pool N: 多数の小さなスクリプトをN個のスレッドで実行する
+ *
+ * スクリプトのパスを1行に1つずつlistPathから読み、読んだ順に各スレッドのキューへ配る
+ * 自分のキューが空になったスレッドは他のスレッドのキューの末尾から盗む(work stealing)
+ * スクリプトごとに新しいVMを作るので、グローバル変数などは互いに見えない
+ * 各スクリプトの出力はバッファに溜め、入力の順番どおりにstdout/stderrへ書き出す
+ * 最後にスループットとスクリプトごとのレイテンシのパーセンタイルをstderrに表示する
+ * @param threadCount ワーカースレッドの数
+ * @param listPath スクリプトのパスの一覧、NULLか"-"なら標準入力
+ * @param imagePath NULLでなければ、各スクリプトのVMをこのheap imageから復元してから実行する
+ * @param registerEngine 各スクリプトを--engine=registerで実行する
+ * @param jitThreshold 各スクリプトのVMの--jitの閾値(-1ならJITしない)
+ * @return プロセスの終了コード(失敗したスクリプトのうち最も重いもの)
+ */
+int runPool(int threadCount, const char* listPath, const char* imagePath, bool registerEngine, int jitThreshold);
+
+#endif
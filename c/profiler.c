@@ -0,0 +1,276 @@
+#include "profiler.h"
+#include "debug.h"
+#include "memory.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+typedef struct {
+    uint64_t hits;
+    uint64_t ticks;
+} LineProfile;
+
+/**
+ * 呼び出しの経路(scriptからその関数までの関数の並び)ごとの集計
+ * 同じ経路は同じnodeにまとめる。末尾呼び出しは呼び出し元のnodeを置き換える
+ */
+typedef struct {
+    ObjFunction* function; // NULLならスクリプトのトップレベル
+    char* name; // folded stackに書く名前(関数はVMと一緒に解放されるのでコピーしておく)
+    int parent; // 呼び出し元のnode、トップレベルなら-1
+    int firstChild;
+    int nextSibling;
+    int depth; // VMのframeCount
+    LineProfile* lines; // この経路で実行した行、行番号で引く
+    int lineCapacity;
+} ProfileNode;
+
+typedef struct {
+    uint64_t counts[UINT8_COUNT]; // opcodeごとの実行回数
+    uint64_t ticks[UINT8_COUNT]; // opcodeごとの経過時間
+    LineProfile* lines; // 行番号で引く
+    int lineCapacity;
+    ProfileNode* nodes;
+    int nodeCount;
+    int nodeCapacity;
+    int roots; // トップレベルのnodeの並びの先頭
+    bool running; // last*が有効か
+    uint8_t* lastIp;
+    uint8_t lastOpcode;
+    int lastLine;
+    int lastNode;
+    uint64_t lastTick;
+} Profiler;
+
+static Profiler profiler;
+
+/**
+ * x86ではrdtscでCPUのサイクル数を読む
+ * それ以外ではclock_gettimeのナノ秒で代用する
+ */
+static inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void initProfiler() {
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        profiler.counts[i] = 0;
+        profiler.ticks[i] = 0;
+    }
+    profiler.lines = NULL;
+    profiler.lineCapacity = 0;
+    profiler.nodes = NULL;
+    profiler.nodeCount = 0;
+    profiler.nodeCapacity = 0;
+    profiler.roots = -1;
+    profiler.running = false;
+}
+
+void freeProfiler() {
+    FREE_ARRAY(LineProfile, profiler.lines, profiler.lineCapacity);
+    for (int i = 0; i < profiler.nodeCount; i++) {
+        ProfileNode* node = &profiler.nodes[i];
+        FREE_ARRAY(char, node->name, strlen(node->name) + 1);
+        FREE_ARRAY(LineProfile, node->lines, node->lineCapacity);
+    }
+    FREE_ARRAY(ProfileNode, profiler.nodes, profiler.nodeCapacity);
+    initProfiler();
+}
+
+/**
+ * linesをlineが入る大きさまで広げる
+ */
+static LineProfile* lineProfile(LineProfile** lines, int* lineCapacity, int line) {
+    if (line >= *lineCapacity) {
+        int oldCapacity = *lineCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity <= line) {
+            capacity = GROW_CAPACITY(capacity);
+        }
+        *lines = GROW_ARRAY(LineProfile, *lines, oldCapacity, capacity);
+        for (int i = oldCapacity; i < capacity; i++) {
+            (*lines)[i].hits = 0;
+            (*lines)[i].ticks = 0;
+        }
+        *lineCapacity = capacity;
+    }
+    return &(*lines)[line];
+}
+
+/**
+ * parentから呼んだfunctionのnodeを返す。なければ作る
+ * @param parent 呼び出し元のnode、トップレベルなら-1
+ */
+static int childNode(int parent, ObjFunction* function) {
+    int first = parent < 0 ? profiler.roots : profiler.nodes[parent].firstChild;
+    for (int child = first; child >= 0; child = profiler.nodes[child].nextSibling) {
+        if (profiler.nodes[child].function == function) {
+            return child;
+        }
+    }
+
+    if (profiler.nodeCount == profiler.nodeCapacity) {
+        int oldCapacity = profiler.nodeCapacity;
+        profiler.nodeCapacity = GROW_CAPACITY(oldCapacity);
+        profiler.nodes = GROW_ARRAY(ProfileNode, profiler.nodes, oldCapacity, profiler.nodeCapacity);
+    }
+    int index = profiler.nodeCount++;
+    ProfileNode* node = &profiler.nodes[index];
+    const char* name = function == NULL ? "script" : function->name->chars;
+    size_t length = strlen(name);
+    node->function = function;
+    node->name = ALLOCATE(char, length + 1);
+    memcpy(node->name, name, length + 1);
+    node->parent = parent;
+    node->firstChild = -1;
+    node->nextSibling = first;
+    node->depth = parent < 0 ? 0 : profiler.nodes[parent].depth + 1;
+    node->lines = NULL;
+    node->lineCapacity = 0;
+    if (parent < 0) {
+        profiler.roots = index;
+    } else {
+        profiler.nodes[parent].firstChild = index;
+    }
+    return index;
+}
+
+/**
+ * vmが実行中の呼び出しの経路のnodeを返す
+ * 命令は続けて実行されるので、前回の命令のnodeとframeCountの差から求める
+ */
+static int currentNode(VM* vm) {
+    if (profiler.running) {
+        int last = profiler.lastNode;
+        ProfileNode* node = &profiler.nodes[last];
+        if (node->depth == vm->frameCount) {
+            // 同じ関数の続き、または末尾呼び出しで入れ替わった関数
+            return node->function == vm->function ? last : childNode(node->parent, vm->function);
+        }
+        if (node->depth + 1 == vm->frameCount) {
+            return childNode(last, vm->function);
+        }
+        if (node->depth == vm->frameCount + 1 && node->parent >= 0) {
+            return node->parent;
+        }
+    }
+    // run()の最初の命令はframesを根から辿る
+    int node = -1;
+    for (int i = 0; i < vm->frameCount; i++) {
+        node = childNode(node, vm->frames[i].function);
+    }
+    return childNode(node, vm->function);
+}
+
+static void chargeLast(uint64_t elapsed) {
+    profiler.ticks[profiler.lastOpcode] += elapsed;
+    profiler.lines[profiler.lastLine].ticks += elapsed;
+    profiler.nodes[profiler.lastNode].lines[profiler.lastLine].ticks += elapsed;
+}
+
+void profileInstruction(VM* vm) {
+    uint64_t now = readTicks();
+    uint8_t* ip = vm->ip;
+    uint8_t opcode = *ip;
+
+    // quickeningした命令が汎用の命令に書き戻して同じ位置から実行し直すときは、新しい命令として数えない
+    // 回数と経過時間は書き戻した汎用の命令に付け替える(ディスパッチの方式によらず1命令は1回)
+    if (profiler.running && ip == profiler.lastIp && opcode != profiler.lastOpcode) {
+        profiler.counts[profiler.lastOpcode]--;
+        profiler.counts[opcode]++;
+        profiler.lastOpcode = opcode;
+        return;
+    }
+
+    if (profiler.running) {
+        chargeLast(now - profiler.lastTick);
+    }
+
+    int node = currentNode(vm);
+    int line = vm->chunk->lines[ip - vm->chunk->code];
+    profiler.counts[opcode]++;
+    lineProfile(&profiler.lines, &profiler.lineCapacity, line)->hits++;
+    lineProfile(&profiler.nodes[node].lines, &profiler.nodes[node].lineCapacity, line)->hits++;
+
+    profiler.running = true;
+    profiler.lastIp = ip;
+    profiler.lastOpcode = opcode;
+    profiler.lastLine = line;
+    profiler.lastNode = node;
+    // 集計自体にかかった時間を含めないように最後に読み直す
+    profiler.lastTick = readTicks();
+}
+
+void profileFlush() {
+    if (!profiler.running) {
+        return;
+    }
+    chargeLast(readTicks() - profiler.lastTick);
+    profiler.running = false;
+}
+
+/**
+ * nodeまでの経路を"script;f;g"の形で書く
+ */
+static void writeStack(FILE* file, int node) {
+    if (profiler.nodes[node].parent >= 0) {
+        writeStack(file, profiler.nodes[node].parent);
+        fputc(';', file);
+    }
+    fputs(profiler.nodes[node].name, file);
+}
+
+void writeProfile(const char* path) {
+    uint64_t totalTicks = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        totalTicks += profiler.ticks[i];
+    }
+
+    fprintf(stderr, "%-20s %14s %16s %7s\n", "opcode", "count", "ticks", "%");
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        if (profiler.counts[i] == 0) {
+            continue;
+        }
+        double percent = totalTicks == 0 ? 0 : 100.0 * profiler.ticks[i] / totalTicks;
+        fprintf(stderr, "%-20s %14llu %16llu %6.2f%%\n", opcodeName((uint8_t)i),
+                (unsigned long long)profiler.counts[i], (unsigned long long)profiler.ticks[i], percent);
+    }
+
+    fprintf(stderr, "\n%-20s %14s %16s\n", "line", "hits", "ticks");
+    for (int line = 0; line < profiler.lineCapacity; line++) {
+        LineProfile* entry = &profiler.lines[line];
+        if (entry->hits == 0) {
+            continue;
+        }
+        fprintf(stderr, "%-20d %14llu %16llu\n", line,
+                (unsigned long long)entry->hits, (unsigned long long)entry->ticks);
+    }
+
+    // folded stack形式: "フレーム;フレーム 値" を1行ずつ
+    // 呼び出しの経路の関数を並べ、最後のフレームにその関数の中で実行した行を置く
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return;
+    }
+    for (int node = 0; node < profiler.nodeCount; node++) {
+        ProfileNode* entry = &profiler.nodes[node];
+        for (int line = 0; line < entry->lineCapacity; line++) {
+            if (entry->lines[line].ticks == 0) {
+                continue;
+            }
+            writeStack(file, node);
+            fprintf(file, ";line %d %llu\n", line, (unsigned long long)entry->lines[line].ticks);
+        }
+    }
+    fclose(file);
+}
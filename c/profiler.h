@@ -0,0 +1,33 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "vm.h"
+
+/**
+ * 命令単位のプロファイラ
+ * 
+ * PROFILE_EXECUTIONはprofileビルド(make clox-profile)でのみ定義される
+ * それ以外のビルドのrun()にはプロファイルのためのコードが一切入らない
+ */
+void initProfiler();
+void freeProfiler();
+/**
+ * 命令をディスパッチする直前に呼ぶ
+ * 前回の呼び出しからの経過時間を前回の命令とその行、呼び出しの経路に加算する
+ * quickeningした命令が汎用の命令に戻って同じipで呼ばれたときは、同じ命令として1回だけ数える
+ * @param vm vm->ipが次に実行する命令
+ */
+void profileInstruction(VM* vm);
+/**
+ * 最後に実行した命令の経過時間を確定させる
+ * run()から戻ったときに呼ぶ
+ */
+void profileFlush();
+/**
+ * 命令ごとの集計をstderrに表示し、flame graph用のfolded stack形式でファイルに書き出す
+ * folded stackの各行は"script;関数;...;line N ticks"
+ * @param path folded stackの出力先
+ */
+void writeProfile(const char* path);
+
+#endif
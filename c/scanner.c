@@ -1,47 +1,255 @@
 #include "scanner.h"
-#include <ctype.h>
+#include "memory.h"
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
-typedef struct {
-    const char* start;
-    const char* current; // the next character to be scanned
-    int line;
-} Scanner;
+/*
+ * scanUntilとskipBlanksは16バイト境界に揃えたブロック単位で読むので、終端の'\0'より先の
+ * 同じブロックの中まで読むことがある。揃えたブロックはページをまたがないので実際には落ちないが、
+ * AddressSanitizerは確保した領域の外の読み込みとして止めるので、そのときは1バイトずつ読む
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define SCANNER_SANITIZE_ADDRESS
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SCANNER_SANITIZE_ADDRESS
+#endif
+#endif
+
+#if defined(__SSE2__) && !defined(SCANNER_SANITIZE_ADDRESS)
+#define SCANNER_SIMD
+#include <emmintrin.h>
+#endif
+
+// streaming modeで1回のreadで読み込む最大のバイト数
+#ifndef SCANNER_WINDOW
+#define SCANNER_WINDOW (64 * 1024)
+#endif
+
+void initScanner(Scanner* scanner, const char* source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
+    scanner->fd = -1;
+    scanner->eof = true;
+    scanner->window = NULL;
+    scanner->windowCapacity = 0;
+    scanner->retired = NULL;
+    scanner->retiredCapacity = 0;
+    scanner->lastToken = NULL;
+}
+
+void initScannerStream(Scanner* scanner, int fd) {
+    initScanner(scanner, "");
+    scanner->fd = fd;
+    scanner->eof = false;
+}
+
+void freeScanner(Scanner* scanner) {
+    FREE_ARRAY(char, scanner->window, scanner->windowCapacity);
+    FREE_ARRAY(char, scanner->retired, scanner->retiredCapacity);
+    initScanner(scanner, "");
+}
+
+static bool contains(const char* buffer, size_t capacity, const char* pointer) {
+    return buffer != NULL && pointer >= buffer && pointer < buffer + capacity;
+}
+
+/**
+ * 次のwindowを読み込む
+ * 
+ * 読みかけのtoken(scanner.startから)を新しいwindowの先頭にコピーし、その後ろに続きを読む
+ * そのため1つのtokenがwindowより長くても正しく読める
+ * @return 新しい入力を読めたらtrue、入力の終わりならfalse
+ */
+static bool refill(Scanner* scanner) {
+    if (scanner->eof) {
+        return false;
+    }
 
-Scanner scanner;
+    const char* end = scanner->current + strlen(scanner->current);
+    size_t carry = (size_t)(end - scanner->start);
+    size_t capacity = carry + SCANNER_WINDOW + 1;
+    char* window = ALLOCATE(char, capacity);
+    memcpy(window, scanner->start, carry);
+
+    ssize_t bytesRead;
+    do {
+        bytesRead = read(scanner->fd, window + carry, SCANNER_WINDOW);
+    } while (bytesRead < 0 && errno == EINTR);
+    if (bytesRead <= 0) {
+        scanner->eof = true;
+        FREE_ARRAY(char, window, capacity);
+        return false;
+    }
+    window[carry + bytesRead] = '\0';
+
+    // 直前のtokenを含まないバッファはもう誰も参照していない
+    if (!contains(scanner->retired, scanner->retiredCapacity, scanner->lastToken)) {
+        FREE_ARRAY(char, scanner->retired, scanner->retiredCapacity);
+        scanner->retired = NULL;
+        scanner->retiredCapacity = 0;
+    }
+    if (contains(scanner->window, scanner->windowCapacity, scanner->lastToken) && scanner->retired == NULL) {
+        scanner->retired = scanner->window;
+        scanner->retiredCapacity = scanner->windowCapacity;
+    } else {
+        FREE_ARRAY(char, scanner->window, scanner->windowCapacity);
+    }
 
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->current = window + (scanner->current - scanner->start);
+    scanner->start = window;
+    scanner->window = window;
+    scanner->windowCapacity = capacity;
+    return true;
 }
 
+// 文字の分類(1文字を1回の表引きで分類する)
+#define CHAR_ALPHA 0x1 // 英字と_
+#define CHAR_DIGIT 0x2 // 数字
+#define CHAR_BLANK 0x4 // 改行以外の空白
+
+#define A CHAR_ALPHA
+#define D CHAR_DIGIT
+#define S CHAR_BLANK
+static const uint8_t charClass[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, 0, 0, S, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, A,
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+#undef A
+#undef D
+#undef S
+
 static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    return charClass[(uint8_t)c] & CHAR_ALPHA;
+}
+
+static bool isDigit(char c) {
+    return charClass[(uint8_t)c] & CHAR_DIGIT;
+}
+
+static bool isAlphaNumeric(char c) {
+    return charClass[(uint8_t)c] & (CHAR_ALPHA | CHAR_DIGIT);
+}
+
+static bool isBlank(char c) {
+    return charClass[(uint8_t)c] & CHAR_BLANK;
+}
+
+#ifdef SCANNER_SIMD
+/**
+ * 16バイトのうちtarget、'\n'、'\0'のいずれかに一致するバイトのbitmask
+ */
+static inline unsigned stopMask(const __m128i* block, char target) {
+    __m128i bytes = _mm_load_si128(block);
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(target)), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))),
+        _mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+    return (unsigned)_mm_movemask_epi8(hits);
+}
+
+/**
+ * 16バイトのうち空白(' ', '\t', '\r')ではないバイトのbitmask
+ */
+static inline unsigned nonBlankMask(const __m128i* block) {
+    __m128i bytes = _mm_load_si128(block);
+    __m128i blanks = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'))),
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')));
+    return ~(unsigned)_mm_movemask_epi8(blanks) & 0xffff;
+}
+#endif
+
+/**
+ * target、'\n'、'\0'のいずれかが最初に現れる位置を返す
+ * 
+ * SSE2では16バイトずつ比較する
+ * 16バイト境界に揃えて読むので、終端の'\0'より先を読んでもそのブロックは'\0'と同じページにあり、落ちない
+ * (ページの大きさは16の倍数なので、揃えたブロックがページをまたぐことはない)
+ */
+static const char* scanUntil(const char* p, char target) {
+#ifdef SCANNER_SIMD
+    uintptr_t misalign = (uintptr_t)p & 15;
+    const __m128i* block = (const __m128i*)(p - misalign);
+    unsigned mask = stopMask(block, target) & (0xffffu << misalign);
+    while (mask == 0) {
+        block++;
+        mask = stopMask(block, target);
+    }
+    return (const char*)block + __builtin_ctz(mask);
+#else
+    while (*p != target && *p != '\n' && *p != '\0') {
+        p++;
+    }
+    return p;
+#endif
 }
 
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+/**
+ * 空白(' ', '\t', '\r')ではない最初の位置を返す
+ * インデントのような長い空白の連続をまとめて読み飛ばす
+ */
+static const char* skipBlanks(const char* p) {
+#ifdef SCANNER_SIMD
+    uintptr_t misalign = (uintptr_t)p & 15;
+    const __m128i* block = (const __m128i*)(p - misalign);
+    unsigned mask = nonBlankMask(block) & (0xffffu << misalign);
+    while (mask == 0) {
+        block++;
+        mask = nonBlankMask(block);
+    }
+    return (const char*)block + __builtin_ctz(mask);
+#else
+    while (isBlank(*p)) {
+        p++;
+    }
+    return p;
+#endif
+}
+
+static bool isAtEnd(Scanner* scanner) {
+    return *scanner->current == '\0' && !refill(scanner);
 }
 
 /**
  * Advances the current character and returns the next character to be scanned.
  * @return the next character to be scanned.
  */
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner* scanner) {
+    if (*scanner->current == '\0') {
+        refill(scanner);
+    }
+    return *scanner->current;
 }
 
-static char peekNext() {
-    if (isAtEnd()) {
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) {
         return '\0';
     }
-    return scanner.current[1];
+    if (scanner->current[1] == '\0') {
+        refill(scanner);
+    }
+    return scanner->current[1];
 }
 
 /**
@@ -51,48 +259,57 @@ static char peekNext() {
  * @param expected the expected character.
  * @return true if the next character to be scanned matches the expected character, false otherwise.
  */
-static bool match(char expected) {
-    if (isAtEnd()) {
+static bool match(Scanner* scanner, char expected) {
+    if (isAtEnd(scanner)) {
         return false;
     }
-    if (*scanner.current != expected) {
+    if (*scanner->current != expected) {
         return false;
     }
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static Token makeToken(TokenType type) {
-    Token token = {type, scanner.start, (int)(scanner.current - scanner.start), scanner.line};
+static Token makeToken(Scanner* scanner, TokenType type) {
+    scanner->lastToken = scanner->start;
+    Token token = {type, scanner->start, (int)(scanner->current - scanner->start), scanner->line};
     return token;
 }
 
-static Token errorToken(const char* message) {
-    Token token = {TOKEN_ERROR, message, (int)strlen(message), scanner.line};
+static Token errorToken(Scanner* scanner, const char* message) {
+    Token token = {TOKEN_ERROR, message, (int)strlen(message), scanner->line};
     return token;
 }
 
-static void skipWhitespace() {
+static void skipWhitespace(Scanner* scanner) {
     for (;;) {
-        char c = peek();
+        // 空白はtokenではないので、refillで次のwindowにコピーしなくてよい
+        scanner->start = scanner->current;
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                // 1文字だけの空白(トークンの間)はSIMDを使わない
+                if (isBlank(scanner->current[1])) {
+                    scanner->current = skipBlanks(scanner->current);
+                } else {
+                    advance(scanner);
+                }
                 break;
             case '\n': {
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
                 break;
             }
             case '/': {
-                if (peekNext() != '/') {
+                if (peekNext(scanner) != '/') {
                     return;
                 }
-                while (peek() != '\n' && !isAtEnd()) {
-                    advance();
-                }
+                do {
+                    scanner->current = scanUntil(scanner->current, '\n');
+                    scanner->start = scanner->current;
+                } while (*scanner->current == '\0' && refill(scanner));
                 break;
             }
             default: {
@@ -102,184 +319,168 @@ static void skipWhitespace() {
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-    }
-    return TOKEN_IDENTIFIER;
-}
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
 
-static TokenType identifierType() {
-    switch (scanner.start[0]) {
-        case 'a': {
-            return checkKeyword(1, 2, "nd", TOKEN_AND);
-        }
-        case 'c': {
-            return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        }
-        case 'e': {
-            return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        }
-        case 'f': {
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': {
-                        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    }
-                    case 'o': {
-                        return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    }
-                    case 'u': {
-                        return checkKeyword(2, 1, "n", TOKEN_FUN);
-                    }
-                }
-            }
-            break;
-        }
-        case 'i': {
-            return checkKeyword(1, 1, "f", TOKEN_IF);
-        }
-        case 'n': {
-            return checkKeyword(1, 2, "il", TOKEN_NIL);
-        }
-        case 'o': {
-            return checkKeyword(1, 2, "r", TOKEN_OR);
-        }
-        case 'p': {
-            return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        }
-        case 'r': {
-            return checkKeyword(1, 4, "eturn", TOKEN_RETURN);
-        }
-        case 's': {
-            return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        }
-        case 't': {
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': {
-                        return checkKeyword(2, 2, "is", TOKEN_TRUE);
-                    }
-                    case 'r': {
-                        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                    }
-                }
-            }
-            break;
-        }
-        case 'v': {
-            return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        }
-        case 'w': {
-            return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-        }
+/**
+ * キーワードの完全ハッシュ表
+ * 
+ * (長さ + 先頭の文字 + 7 * 末尾の文字) & 31 がすべてのキーワードで異なるので
+ * 1回の表引きと1回の比較でキーワードかどうかが決まる
+ * キーワードを追加したらハッシュが衝突しないことを確かめること
+ */
+static const Keyword keywords[32] = {
+    [0]  = {"and", 3, TOKEN_AND},
+    [1]  = {"print", 5, TOKEN_PRINT},
+    [5]  = {"nil", 3, TOKEN_NIL},
+    [7]  = {"for", 3, TOKEN_FOR},
+    [11] = {"fun", 3, TOKEN_FUN},
+    [12] = {"else", 4, TOKEN_ELSE},
+    [13] = {"class", 5, TOKEN_CLASS},
+    [14] = {"false", 5, TOKEN_FALSE},
+    [15] = {"or", 2, TOKEN_OR},
+    [20] = {"break", 5, TOKEN_BREAK},
+    [21] = {"if", 2, TOKEN_IF},
+    [22] = {"super", 5, TOKEN_SUPER},
+    [23] = {"var", 3, TOKEN_VAR},
+    [26] = {"return", 6, TOKEN_RETURN},
+    [27] = {"true", 4, TOKEN_TRUE},
+    [29] = {"this", 4, TOKEN_THIS},
+    [31] = {"while", 5, TOKEN_WHILE},
+};
+
+static TokenType identifierType(Scanner* scanner) {
+    int length = (int)(scanner->current - scanner->start);
+    uint8_t first = (uint8_t)scanner->start[0];
+    uint8_t last = (uint8_t)scanner->start[length - 1];
+    const Keyword* keyword = &keywords[(length + first + 7 * last) & 31];
+    if (keyword->length == length && memcmp(scanner->start, keyword->name, length) == 0) {
+        return keyword->type;
     }
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-    while (isAlpha(peek()) || isdigit((int)peek())) {
-        advance();
+static Token identifier(Scanner* scanner) {
+    while (isAlphaNumeric(peek(scanner))) {
+        advance(scanner);
     }
-    return makeToken(identifierType());
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number() {
-    while (isdigit((int)peek())) {
-        advance();
+static Token number(Scanner* scanner) {
+    while (isDigit(peek(scanner))) {
+        advance(scanner);
     }
 
-    if (peek() == '.' && isdigit((int)peekNext())) {
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
         // consume the '.'
-        advance();
-        while (isdigit((int)peek())) {
-            advance();
+        advance(scanner);
+        while (isDigit(peek(scanner))) {
+            advance(scanner);
         }
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        advance();
+static Token string(Scanner* scanner) {
+    // 文字列の中身は'"'か改行か終端までまとめて読み飛ばす
+    for (;;) {
+        scanner->current = scanUntil(scanner->current, '"');
+        if (*scanner->current == '\n') {
+            scanner->line++;
+            advance(scanner);
+        } else if (*scanner->current != '\0' || !refill(scanner)) {
+            break;
+        }
     }
-    if (isAtEnd()) {
-        return errorToken("Unterminated string.");
+    if (isAtEnd(scanner)) {
+        return errorToken(scanner, "Unterminated string.");
     }
 
     // remove the leading and trailing quotes
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken() {
-    skipWhitespace();
-    scanner.start = scanner.current;
+Token scanToken(Scanner* scanner) {
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd()) {
-        return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) {
+        return makeToken(scanner, TOKEN_EOF);
     }
 
-    char c = advance();
+    char c = advance(scanner);
     if (isAlpha(c)) {
-        return identifier();
+        return identifier(scanner);
     }
-    if (isdigit((int)c)) {
-        return number();
+    if (isDigit(c)) {
+        return number(scanner);
     }
 
     switch (c) {
         case '(': {
-            return makeToken(TOKEN_LEFT_PAREN);
+            return makeToken(scanner, TOKEN_LEFT_PAREN);
         }
         case ')': {
-            return makeToken(TOKEN_RIGHT_PAREN);
+            return makeToken(scanner, TOKEN_RIGHT_PAREN);
         }
         case '{': {
-            return makeToken(TOKEN_LEFT_BRACE);
+            return makeToken(scanner, TOKEN_LEFT_BRACE);
         }
         case '}': {
-            return makeToken(TOKEN_RIGHT_BRACE);
+            return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        }
+        case '[': {
+            return makeToken(scanner, TOKEN_LEFT_BRACKET);
+        }
+        case ']': {
+            return makeToken(scanner, TOKEN_RIGHT_BRACKET);
         }
         case ';': {
-            return makeToken(TOKEN_SEMICOLON);
+            return makeToken(scanner, TOKEN_SEMICOLON);
+        }
+        case ':': {
+            return makeToken(scanner, TOKEN_COLON);
         }
         case ',': {
-            return makeToken(TOKEN_COMMA);
+            return makeToken(scanner, TOKEN_COMMA);
         }
         case '.': {
-            return makeToken(TOKEN_DOT);
+            return makeToken(scanner, TOKEN_DOT);
         }
         case '-': {
-            return makeToken(TOKEN_MINUS);
+            return makeToken(scanner, TOKEN_MINUS);
         }
         case '+': {
-            return makeToken(TOKEN_PLUS);
+            return makeToken(scanner, TOKEN_PLUS);
         }
         case '/': {
-            return makeToken(TOKEN_SLASH);
+            return makeToken(scanner, TOKEN_SLASH);
         }
         case '*': {
-            return makeToken(TOKEN_STAR);
+            return makeToken(scanner, TOKEN_STAR);
         }
         case '!': {
-            return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         }
         case '=': {
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         }
         case '<': {
-            return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         }
         case '>': {
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
         }
         case '"': {
-            return string();
+            return string(scanner);
         }
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
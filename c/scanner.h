@@ -7,8 +7,9 @@ typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
-  TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+  TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR, TOKEN_COLON,
   // One or two character tokens.
   TOKEN_BANG, TOKEN_BANG_EQUAL,
   TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
@@ -17,7 +18,7 @@ typedef enum {
   // Literals.
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
   // Keywords.
-  TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
+  TOKEN_AND, TOKEN_BREAK, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
   TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
   TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
   TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
@@ -32,7 +33,39 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+/**
+ * scannerの状態
+ * 1回のコンパイルごとに1つ作るので、複数のコンパイルを別々のスレッドで同時に行える
+ */
+typedef struct {
+    const char* start;
+    const char* current; // the next character to be scanned
+    int line;
+    /**
+     * streaming mode
+     * 
+     * ソース全体ではなく、fdから読んだwindowだけをメモリに置く
+     * windowの終わりは'\0'の番兵で、そこに着いたらrefillで次のwindowを読む
+     * 直前に返したtoken(parser.previous)はまだ使われるので、そのtokenを含むwindowは
+     * 次のrefillまで解放せずにretiredとして残す
+     */
+    int fd; // -1ならソース全体がメモリにある
+    bool eof;
+    char* window;
+    size_t windowCapacity;
+    char* retired;
+    size_t retiredCapacity;
+    const char* lastToken; // 最後に返したtokenの先頭
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+/**
+ * fdから少しずつ読みながらscanする(streaming mode)
+ * tokenのlexemeは次の次のscanTokenまでしか有効でないので、残すものはコピーすること
+ * @param fd ファイルやパイプのfile descriptor
+ */
+void initScannerStream(Scanner* scanner, int fd);
+void freeScanner(Scanner* scanner);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -16,16 +16,59 @@ void freeTable(Table* table) {
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
+/**
+ * 数値は-0と0が等しいので、どちらも同じhashにする
+ * 文字列以外のオブジェクトはアドレスで区別する
+ */
+static uint32_t hashValue(Value value) {
+    switch (value.type) {
+        case VAL_BOOL: {
+            return AS_BOOL(value) ? 3 : 5;
+        }
+        case VAL_NUMBER: {
+            double number = AS_NUMBER(value);
+            if (number == 0) {
+                return 0;
+            }
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            bits ^= bits >> 32;
+            return (uint32_t)(bits * 0x9e3779b97f4a7c15ull >> 32);
+        }
+        case VAL_OBJ: {
+            if (IS_STRING(value)) {
+                return AS_STRING(value)->hash;
+            }
+            uintptr_t address = (uintptr_t)AS_OBJ(value);
+            return (uint32_t)((address >> 4) * 0x9e3779b97f4a7c15ull >> 32);
+        }
+        default:
+            return 0;
+    }
+}
+
+/**
+ * 文字列はinternされているので、オブジェクトはアドレスの比較だけで済む
+ */
+static inline bool keysEqual(Value a, Value b) {
+    if (IS_OBJ(a)) {
+        return IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+    }
+    return valuesEqual(a, b);
+}
+
+static inline Entry* findEntry(Entry* entries, int capacity, Value key, uint32_t hash) {
+    uint32_t index = hash % capacity;
     Entry* tombstone = NULL;
+    int probes = 1;
 
     for (;;) {
         Entry* entry = &entries[index];
-        if (entry->key == NULL) {
+        if (IS_NIL(entry->key)) {
             // entryが空いている場合
             if (IS_NIL(entry->value)) {
                 // 新しいnodeをsetするときに使用するために、tombstoneを返す
+                recordTableProbe(probes);
                 return tombstone != NULL ? tombstone : entry;
             } else {
                 // entryがtombstoneの場合
@@ -33,27 +76,37 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
                     tombstone = entry;
                 }
             }
-        } else if (entry->key == key) {
+        } else if (keysEqual(entry->key, key)) {
+            recordTableProbe(probes);
             return entry;
         }
         // collision衝突が発生
         // linear probing線形探索で次のインデックスを探す
         index = (index + 1) % capacity;
+        probes++;
     }
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) {
+static bool get(Table* table, Value key, uint32_t hash, Value* value) {
     if (table->count == 0) {
         return false;
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    Entry* entry = findEntry(table->entries, table->capacity, key, hash);
+    if (IS_NIL(entry->key)) {
         return false;
     }
     *value = entry->value;
     return true;
 }
 
+bool tableGet(Table* table, ObjString* key, Value* value) {
+    return get(table, OBJ_VAL((Obj*)key), key->hash, value);
+}
+
+bool tableGetValue(Table* table, Value key, Value* value) {
+    return get(table, key, hashValue(key), value);
+}
+
 /**
  * 配列の占有率が75%を超えたら、配列を拡張する
  * すでに存在するキーの値は新しい配列にコピーする
@@ -63,17 +116,17 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
 static void adjustCapacity(Table* table, int capacity) {
     Entry* newEntries = ALLOCATE(Entry, capacity);
     for (int i = 0; i < capacity; i++) {
-        newEntries[i].key = NULL;
+        newEntries[i].key = NIL_VAL;
         newEntries[i].value = NIL_VAL;
     }
 
     table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL) {
+        if (IS_NIL(entry->key)) {
             continue;
         }
-        Entry* dest = findEntry(newEntries, capacity, entry->key);
+        Entry* dest = findEntry(newEntries, capacity, entry->key, hashValue(entry->key));
         dest->key = entry->key;
         dest->value = entry->value;
         table->count++;
@@ -84,14 +137,14 @@ static void adjustCapacity(Table* table, int capacity) {
     table->capacity = capacity;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+static bool set(Table* table, Value key, uint32_t hash, Value value) {
     // 配列の占有率が75%を超えたら、配列を拡張する
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
+    Entry* entry = findEntry(table->entries, table->capacity, key, hash);
+    bool isNewKey = IS_NIL(entry->key);
     // tombstoneも占有率に含める
     if (isNewKey && IS_NIL(entry->value)) {
         table->count++;
@@ -101,6 +154,14 @@ bool tableSet(Table* table, ObjString* key, Value value) {
     return isNewKey;
 }
 
+bool tableSet(Table* table, ObjString* key, Value value) {
+    return set(table, OBJ_VAL((Obj*)key), key->hash, value);
+}
+
+bool tableSetValue(Table* table, Value key, Value value) {
+    return set(table, key, hashValue(key), value);
+}
+
 /**
  * キーを削除する
  * entryのクリアするだけでなく、tombstoneを使って削除を表現する
@@ -109,28 +170,33 @@ bool tableSet(Table* table, ObjString* key, Value value) {
  * @param key the key to delete
  * @return true if the key was deleted, false otherwise
  */
-bool tableDelete(Table* table, ObjString* key) {
+static bool delete(Table* table, Value key, uint32_t hash) {
     if (table->count == 0) {
         return false;
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    Entry* entry = findEntry(table->entries, table->capacity, key, hash);
+    if (IS_NIL(entry->key)) {
         return false;
     }
-    entry->key = NULL;
+    entry->key = NIL_VAL;
     // tombstoneを使って削除を表現する
     entry->value = BOOL_VAL(true);
     return true;
 }
 
+bool tableDelete(Table* table, ObjString* key) {
+    return delete(table, OBJ_VAL((Obj*)key), key->hash);
+}
+
+bool tableDeleteValue(Table* table, Value key) {
+    return delete(table, key, hashValue(key));
+}
+
 void tableAddAll(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
-        if (entry->key == NULL) {
-            continue;
-        }
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (!IS_NIL(entry->key)) {
+            tableSetValue(to, entry->key, entry->value);
         }
     }
 }
@@ -141,18 +207,25 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
     }
 
     uint32_t index = hash % table->capacity;
+    int probes = 1;
     for (;;) {
         Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
+        if (IS_NIL(entry->key)) {
             if (IS_NIL(entry->value)) {
+                recordTableProbe(probes);
                 return NULL;
             }
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            // ここで唯一文字単位の比較を行う
-            // ここ以外ではアドレスの比較でok
-            return entry->key;
+        } else {
+            ObjString* key = AS_STRING(entry->key);
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+                // ここで唯一文字単位の比較を行う
+                // ここ以外ではアドレスの比較でok
+                recordTableProbe(probes);
+                return key;
+            }
         }
 
         index = (index + 1) % table->capacity;
+        probes++;
     }
 }
\ No newline at end of file
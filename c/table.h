@@ -4,8 +4,12 @@
 #include "common.h"
 #include "value.h"
 
+/**
+ * keyがnilのentryは空き(valueもnil)かtombstone(valueがtrue)
+ * VMのintern表やグローバル変数では、keyは常に文字列
+ */
 typedef struct {
-    ObjString* key;
+    Value key;
     Value value;
 } Entry;
 
@@ -21,6 +25,13 @@ bool tableSet(Table* table, ObjString* key, Value value);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
+/**
+ * 文字列以外(数値、真偽値、オブジェクトの同一性)もキーにできる版、ObjMapで使う
+ * nilは空きのentryを表すのでキーにできない。NaNは自身と等しくないので見つからない
+ */
+bool tableGetValue(Table* table, Value key, Value* value);
+bool tableSetValue(Table* table, Value key, Value value);
+bool tableDeleteValue(Table* table, Value key);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
 #endif
\ No newline at end of file
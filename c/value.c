@@ -1,4 +1,5 @@
 #include "value.h"
+#include "dtoa.h"
 #include "memory.h"
 #include "object.h"
 #include <stdio.h>
@@ -26,21 +27,27 @@ void freeValueArray(ValueArray* array) {
 }
 
 void printValue(Value value) {
+    fprintValue(stdout, value);
+}
+
+void fprintValue(FILE* file, Value value) {
     switch (value.type) {
         case VAL_BOOL: {
-            printf(AS_BOOL(value) ? "true" : "false");
+            fputs(AS_BOOL(value) ? "true" : "false", file);
             break;
         }
         case VAL_NIL: {
-            printf("nil");
+            fputs("nil", file);
             break;
         }
         case VAL_NUMBER: {
-            printf("%g", AS_NUMBER(value));
+            char buffer[NUMBER_BUFFER_SIZE];
+            formatNumber(AS_NUMBER(value), buffer);
+            fputs(buffer, file);
             break;
         }
         case VAL_OBJ: {
-            printObject(value);
+            printObject(file, value);
             break;
         }
         default:
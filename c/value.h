@@ -2,6 +2,7 @@
 #define VALUE_H
 
 #include "common.h"
+#include <stdio.h>
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -52,5 +53,10 @@ void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
+/**
+ * valueをfileに書き出す
+ * VMごとに出力先を変えられるように、printは常にこちらを使う
+ */
+void fprintValue(FILE* file, Value value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,268 @@
+#include "verifier.h"
+#include "memory.h"
+#include "object.h"
+
+/**
+ * 命令1つ分の性質
+ * pops/pushesが-1なら、オペランドの値から求める(OP_CALLなど)
+ */
+typedef struct {
+    int length; // オペランドを含めたバイト数
+    int pops; // 実行前にスタックに必要な値の数
+    int pushes; // popした後に積む値の数
+} OpInfo;
+
+static const OpInfo opInfos[] = {
+    [OP_CONSTANT] = {2, 0, 1},
+    [OP_NIL] = {1, 0, 1},
+    [OP_TRUE] = {1, 0, 1},
+    [OP_FALSE] = {1, 0, 1},
+    [OP_POP] = {1, 1, 0},
+    [OP_GET_LOCAL] = {2, 0, 1},
+    [OP_SET_LOCAL] = {2, 1, 1},
+    [OP_GET_GLOBAL] = {2, 0, 1},
+    [OP_DEFINE_GLOBAL] = {2, 1, 0},
+    [OP_SET_GLOBAL] = {2, 1, 1},
+    [OP_EQUAL] = {1, 2, 1},
+    [OP_GREATER] = {1, 2, 1},
+    [OP_LESS] = {1, 2, 1},
+    [OP_ADD] = {1, 2, 1},
+    [OP_SUBTRACT] = {1, 2, 1},
+    [OP_MULTIPLY] = {1, 2, 1},
+    [OP_DIVIDE] = {1, 2, 1},
+    [OP_GREATER_NUM] = {1, 2, 1},
+    [OP_LESS_NUM] = {1, 2, 1},
+    [OP_ADD_NUM] = {1, 2, 1},
+    [OP_SUBTRACT_NUM] = {1, 2, 1},
+    [OP_MULTIPLY_NUM] = {1, 2, 1},
+    [OP_DIVIDE_NUM] = {1, 2, 1},
+    [OP_NOT] = {1, 1, 1},
+    [OP_NEGATE] = {1, 1, 1},
+    [OP_PRINT] = {1, 1, 0},
+    [OP_JUMP] = {3, 0, 0},
+    [OP_JUMP_IF_FALSE] = {3, 1, 1},
+    [OP_LOOP] = {3, 0, 0},
+    [OP_CALL] = {2, -1, 1},
+    [OP_TAIL_CALL] = {2, -1, 1},
+    [OP_BUILD_LIST] = {2, -1, 1},
+    [OP_BUILD_MAP] = {2, -1, 1},
+    [OP_INDEX_GET] = {1, 2, 1},
+    [OP_INDEX_SET] = {1, 3, 1},
+    [OP_RETURN] = {1, 1, 0},
+};
+
+#define OP_COUNT ((int)(sizeof(opInfos) / sizeof(opInfos[0])))
+
+/**
+ * 検査の途中の状態
+ * depths[i]はcode[i]の命令を実行する直前のスタックの深さ(まだ着いていなければ-1)
+ * 命令の先頭でない位置は-2にしておき、そこへのジャンプを見つける
+ */
+typedef struct {
+    Chunk* chunk;
+    int start;
+    int* depths;
+    int* worklist; // 深さが決まって、まだ調べていない命令
+    int worklistCount;
+    int maxDepth;
+    FILE* err;
+} Verifier;
+
+static bool verifyCode(Chunk* chunk, int offset, int initialDepth, FILE* err, int** depths);
+
+static bool fail(Verifier* verifier, int offset, const char* message) {
+    fprintf(verifier->err, "Invalid bytecode at offset %d: %s\n", offset, message);
+    return false;
+}
+
+/**
+ * 次に実行されうる命令にスタックの深さを伝える
+ */
+static bool flowTo(Verifier* verifier, int from, int target, int depth) {
+    if (target < verifier->start || target >= verifier->chunk->count) {
+        return fail(verifier, from, "jump target out of range.");
+    }
+    int* known = &verifier->depths[target - verifier->start];
+    if (*known == -2) {
+        return fail(verifier, from, "jump into the middle of an instruction.");
+    }
+    if (*known == -1) {
+        *known = depth;
+        verifier->worklist[verifier->worklistCount++] = target;
+        return true;
+    }
+    if (*known != depth) {
+        return fail(verifier, target, "stack depth differs between paths.");
+    }
+    return true;
+}
+
+/**
+ * 命令の境界を決め、オペランドと定数の番号を確かめる
+ */
+static bool decode(Verifier* verifier) {
+    Chunk* chunk = verifier->chunk;
+    for (int offset = verifier->start; offset < chunk->count;) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction >= OP_COUNT || opInfos[instruction].length == 0) {
+            return fail(verifier, offset, "unknown opcode.");
+        }
+        int length = opInfos[instruction].length;
+        if (offset + length > chunk->count) {
+            return fail(verifier, offset, "truncated instruction.");
+        }
+        switch (instruction) {
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_GLOBAL: {
+                uint8_t constant = chunk->code[offset + 1];
+                if (constant >= chunk->constants.count) {
+                    return fail(verifier, offset, "constant index out of range.");
+                }
+                Value value = chunk->constants.values[constant];
+                if (instruction != OP_CONSTANT && !IS_STRING(value)) {
+                    return fail(verifier, offset, "global name is not a string.");
+                }
+                // 関数の本体は、スロットに関数自身と引数が積まれた状態から始まる
+                if (IS_FUNCTION(value)) {
+                    ObjFunction* function = AS_FUNCTION(value);
+                    if (!verifyCode(&function->chunk, 0, function->arity + 1, verifier->err, NULL)) {
+                        return fail(verifier, offset, "invalid function body.");
+                    }
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        for (int i = 1; i < length; i++) {
+            verifier->depths[offset + i - verifier->start] = -2;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+/**
+ * 命令を1つ実行したときのスタックの深さを求め、次の命令へ伝える
+ */
+static bool step(Verifier* verifier, int offset) {
+    Chunk* chunk = verifier->chunk;
+    uint8_t instruction = chunk->code[offset];
+    OpInfo info = opInfos[instruction];
+    int depth = verifier->depths[offset - verifier->start];
+
+    int pops = info.pops;
+    if (pops == -1) {
+        uint8_t count = chunk->code[offset + 1];
+        switch (instruction) {
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                pops = count + 1; // 関数と引数
+                break;
+            }
+            case OP_BUILD_MAP: {
+                pops = count * 2; // keyとvalueの組
+                break;
+            }
+            default: {
+                pops = count;
+                break;
+            }
+        }
+    }
+    if (depth < pops) {
+        return fail(verifier, offset, "stack underflow.");
+    }
+    if (instruction == OP_GET_LOCAL || instruction == OP_SET_LOCAL) {
+        if (chunk->code[offset + 1] >= depth) {
+            return fail(verifier, offset, "local slot out of range.");
+        }
+    }
+    int next = depth - pops + info.pushes;
+    if (next > verifier->maxDepth) {
+        verifier->maxDepth = next;
+    }
+
+    int end = offset + info.length;
+    switch (instruction) {
+        case OP_RETURN: {
+            return true;
+        }
+        case OP_JUMP: {
+            uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            return flowTo(verifier, offset, end + jump, next);
+        }
+        case OP_LOOP: {
+            uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            return flowTo(verifier, offset, end - jump, next);
+        }
+        case OP_JUMP_IF_FALSE: {
+            uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            return flowTo(verifier, offset, end + jump, next) && flowTo(verifier, offset, end, next);
+        }
+        default: {
+            if (end == chunk->count) {
+                return fail(verifier, offset, "execution falls off the end of the chunk.");
+            }
+            return flowTo(verifier, offset, end, next);
+        }
+    }
+}
+
+/**
+ * @param initialDepth offsetの命令を実行する直前のスタックの深さ
+ * @param depths NULLでなければ、検査を通ったときに命令ごとの深さの配列を渡す
+ */
+static bool verifyCode(Chunk* chunk, int offset, int initialDepth, FILE* err, int** depths) {
+    int length = chunk->count - offset;
+    if (length <= 0) {
+        fprintf(err, "Invalid bytecode at offset %d: empty chunk.\n", offset);
+        return false;
+    }
+
+    Verifier verifier;
+    verifier.chunk = chunk;
+    verifier.start = offset;
+    verifier.depths = ALLOCATE(int, length);
+    verifier.worklist = ALLOCATE(int, length);
+    verifier.worklistCount = 0;
+    verifier.maxDepth = initialDepth;
+    verifier.err = err;
+    for (int i = 0; i < length; i++) {
+        verifier.depths[i] = -1;
+    }
+
+    bool ok = decode(&verifier) && flowTo(&verifier, offset, offset, initialDepth);
+    while (ok && verifier.worklistCount > 0) {
+        ok = step(&verifier, verifier.worklist[--verifier.worklistCount]);
+    }
+    if (ok && verifier.maxDepth > chunk->maxStack) {
+        chunk->maxStack = verifier.maxDepth;
+    }
+
+    if (ok && depths != NULL) {
+        *depths = verifier.depths;
+    } else {
+        FREE_ARRAY(int, verifier.depths, length);
+    }
+    FREE_ARRAY(int, verifier.worklist, length);
+    return ok;
+}
+
+bool verifyChunk(Chunk* chunk, int offset, FILE* err) {
+    return verifyCode(chunk, offset, 0, err, NULL);
+}
+
+bool verifyFunction(ObjFunction* function, FILE* err) {
+    return verifyCode(&function->chunk, 0, function->arity + 1, err, NULL);
+}
+
+int* stackDepths(Chunk* chunk, int offset, int initialDepth) {
+    int* depths = NULL;
+    if (!verifyCode(chunk, offset, initialDepth, stderr, &depths)) {
+        return NULL;
+    }
+    return depths;
+}
@@ -0,0 +1,45 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "chunk.h"
+#include "object.h"
+#include <stdio.h>
+
+/**
+ * bytecode verifier
+ *
+ * 実行する前にchunkを静的に検査する
+ * - すべての命令が既知のopcodeで、オペランドがchunkの中に収まっている
+ * - 定数の番号が定数プールの中にあり、グローバル変数の名前は文字列である
+ * - ジャンプ先がchunkの中の命令の先頭である
+ * - どの経路で命令に着いてもスタックの深さが同じで、足りない値をpopしない
+ * - ローカル変数のスロットがその時点のスタックの中にある
+ * - 定数プールの関数の本体も同じ条件を満たす
+ *
+ * 検査を通ったchunkはrun()が範囲の確認なしで実行してよい
+ * スタックの最大の深さをchunk->maxStackに記録するので(関数ならそのスロットの先頭から数えた深さ)、VMはスタックをその大きさだけ確保すればよい
+ */
+
+/**
+ * chunkのoffsetから末尾までを検査する
+ * REPLのように追記していくchunkでは、追記した部分だけを検査する
+ * 検査する部分は空のスタックから始まり、その外へジャンプしないこと
+ * @param err 検査に失敗したときのエラーの出力先
+ * @return 検査を通ればtrue
+ */
+bool verifyChunk(Chunk* chunk, int offset, FILE* err);
+/**
+ * 関数の本体を検査する
+ * 本体はスロットに関数自身と引数が積まれた状態から始まる
+ * heap imageから読んだ関数のように、どのchunkの定数にも入っていない関数に使う
+ */
+bool verifyFunction(ObjFunction* function, FILE* err);
+/**
+ * 検査を通ったchunkの、命令ごとの実行する直前のスタックの深さを求める(allocateRegistersが使う)
+ * @param initialDepth offsetの命令を実行する直前のスタックの深さ
+ * @return offsetから数えた位置ごとの深さ、命令の途中と到達しない命令は負の値
+ *         FREE_ARRAY(int, depths, chunk->count - offset)で解放する。検査を通らなければNULL
+ */
+int* stackDepths(Chunk* chunk, int offset, int initialDepth);
+
+#endif
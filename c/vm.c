@@ -1,203 +1,1400 @@
 #include "vm.h"
 #include "compiler.h"
 #include "debug.h"
+#include "dtoa.h"
+#include "jit.h"
 #include "memory.h"
+#include "native.h"
 #include "object.h"
+#include "profiler.h"
+#include "verifier.h"
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
-VM vm;
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
+    vm->slots = vm->stack;
+    vm->function = NULL;
+    vm->frameCount = 0;
+    vm->returnFrame = -1;
+}
+
+/**
+ * 値スタックを少なくともcapacityの深さにする
+ * 確保し直したらスタックを指すポインタをすべて付け替える
+ */
+static void reserveStack(VM* vm, int capacity) {
+    if (capacity <= vm->stackCapacity) {
+        return;
+    }
+    // 再帰が深くなるたびに確保し直さないように、少なくとも倍にする
+    if (capacity < vm->stackCapacity * 2) {
+        capacity = vm->stackCapacity * 2;
+    }
+    Value* oldStack = vm->stack;
+    vm->stack = GROW_ARRAY(Value, vm->stack, vm->stackCapacity, capacity);
+    vm->stackCapacity = capacity;
+    vm->stackTop = vm->stack + (vm->stackTop - oldStack);
+    vm->slots = vm->stack + (vm->slots - oldStack);
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = vm->stack + (vm->frames[i].slots - oldStack);
+    }
+}
+
+/**
+ * printBufferにたまった出力をoutに書き出す
+ */
+static void flushOutput(VM* vm) {
+    if (vm->printLength > 0) {
+        fwrite(vm->printBuffer, 1, vm->printLength, vm->out);
+        vm->printLength = 0;
+    }
+}
 
-static void resetStack() {
-    vm.stackTop = vm.stack;
+static void writeOutput(VM* vm, const char* chars, size_t length) {
+    if (vm->printBuffer == NULL) {
+        vm->printBuffer = ALLOCATE(char, PRINT_BUFFER_SIZE);
+    }
+    if (vm->printLength + length > PRINT_BUFFER_SIZE) {
+        flushOutput(vm);
+        if (length > PRINT_BUFFER_SIZE) {
+            fwrite(chars, 1, length, vm->out);
+            return;
+        }
+    }
+    memcpy(vm->printBuffer + vm->printLength, chars, length);
+    vm->printLength += length;
 }
 
-static void runtimeError(const char* message, ...) {
+/**
+ * printの1回分(値と改行)をprintBufferに書く
+ * stdioを1回も呼ばずに済むので、printの多いスクリプトで速い
+ */
+void printToBuffer(VM* vm, Value value) {
+    switch (value.type) {
+        case VAL_BOOL: {
+            if (AS_BOOL(value)) {
+                writeOutput(vm, "true", 4);
+            } else {
+                writeOutput(vm, "false", 5);
+            }
+            break;
+        }
+        case VAL_NIL: {
+            writeOutput(vm, "nil", 3);
+            break;
+        }
+        case VAL_NUMBER: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            writeOutput(vm, buffer, formatNumber(AS_NUMBER(value), buffer));
+            break;
+        }
+        case VAL_OBJ: {
+            if (IS_STRING(value)) {
+                writeOutput(vm, AS_CSTRING(value), AS_STRING(value)->length);
+            } else {
+                flushOutput(vm);
+                fprintValue(vm->out, value);
+            }
+            break;
+        }
+    }
+    writeOutput(vm, "\n", 1);
+}
+
+static void runtimeError(VM* vm, const char* message, ...) {
+    // エラーより前のprintが先に見えるようにする
+    flushOutput(vm);
+    fflush(vm->out);
     va_list args;
     va_start(args, message);
-    vfprintf(stderr, message, args);
+    vfprintf(vm->err, message, args);
     va_end(args);
-    fputc('\n', stderr);
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+    fputc('\n', vm->err);
+    // 実行中の関数から呼び出し元へ順にたどる
+    ObjFunction* function = vm->function;
+    Chunk* chunk = vm->chunk;
+    uint8_t* ip = vm->ip;
+    uint32_t* registerIp = vm->registerIp;
+    for (int i = vm->frameCount; i >= 0; i--) {
+        int line = vm->registerEngine
+            ? chunk->registerLines[registerIp - chunk->registerCode - 1]
+            : chunk->lines[ip - chunk->code - 1];
+        if (function == NULL) {
+            fprintf(vm->err, "[line %d] in script\n", line);
+        } else {
+            fprintf(vm->err, "[line %d] in %s()\n", line, function->name->chars);
+        }
+        if (i > 0) {
+            CallFrame* frame = &vm->frames[i - 1];
+            function = frame->function;
+            chunk = frame->chunk;
+            ip = frame->ip;
+            registerIp = frame->registerIp;
+        }
+    }
+    resetStack(vm);
 }
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.strings);
+void initVM(VM* vm) {
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    resetStack(vm);
+    vm->objects = NULL;
+    vm->printCode = false;
+    vm->traceExecution = false;
+    vm->profileExecution = false;
+    vm->registerEngine = false;
+    vm->registerIp = NULL;
+    vm->jitThreshold = -1;
+    vm->out = stdout;
+    vm->err = stderr;
+    vm->printBuffer = NULL;
+    vm->printLength = 0;
+    initTable(&vm->globals);
+    initTable(&vm->strings);
+    defineStandardNatives(vm);
 }
 
-void freeVM() {
-    freeTable(&vm.strings);
-    freeObjects();
+void freeVM(VM* vm) {
+    flushOutput(vm);
+    FREE_ARRAY(char, vm->printBuffer, vm->printBuffer == NULL ? 0 : PRINT_BUFFER_SIZE);
+    FREE_ARRAY(Value, vm->stack, vm->stackCapacity);
+    freeTable(&vm->globals);
+    freeTable(&vm->strings);
+    freeObjects(vm);
 }
 
-void push(Value value) {
-    *(vm.stackTop) = value;
-    vm.stackTop++;
+void defineNative(VM* vm, const char* name, int arity, NativeFn function) {
+    ObjString* string = copyString(vm, name, (int)strlen(name));
+    tableSet(&vm->globals, string, OBJ_VAL((Obj*)newNative(vm, string, function, arity)));
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *(vm.stackTop);
+void push(VM* vm, Value value) {
+    *(vm->stackTop) = value;
+    vm->stackTop++;
 }
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+Value pop(VM* vm) {
+    vm->stackTop--;
+    return *(vm->stackTop);
+}
+
+static Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* bString = AS_STRING(pop());
-    ObjString* aString = AS_STRING(pop());
-
+ObjString* concatenateStrings(VM* vm, ObjString* aString, ObjString* bString) {
     int length = aString->length + bString->length;
     char* chars = ALLOCATE(char, length + 1);
     memcpy(chars, aString->chars, aString->length);
     memcpy(chars + aString->length, bString->chars, bString->length);
     chars[length] = '\0';
 
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL((Obj*)result));
+    return takeString(vm, chars, length);
+}
+
+static void concatenate(VM* vm) {
+    ObjString* bString = AS_STRING(pop(vm));
+    ObjString* aString = AS_STRING(pop(vm));
+    push(vm, OBJ_VAL((Obj*)concatenateStrings(vm, aString, bString)));
+}
+
+/**
+ * 関数の本体に入る
+ * 呼び出し元の状態をframesに積み、[関数, 引数...]を新しい関数のスロットにする
+ * @return 引数の数が合わないか、呼び出しが深すぎればエラーを表示してfalse
+ */
+static bool call(VM* vm, ObjFunction* function, int argCount) {
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if (vm->frameCount == FRAMES_MAX) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    CallFrame* frame = &vm->frames[vm->frameCount++];
+    frame->function = vm->function;
+    frame->chunk = vm->chunk;
+    frame->ip = vm->ip;
+    frame->registerIp = vm->registerIp;
+    frame->slots = vm->slots;
+
+    vm->function = function;
+    vm->chunk = &function->chunk;
+    vm->ip = function->chunk.code;
+    vm->slots = vm->stackTop - argCount - 1;
+    reserveStack(vm, (int)(vm->slots - vm->stack) + function->chunk.maxStack);
+    return true;
+}
+
+/**
+ * 末尾呼び出し: return f(...)
+ * 呼び出し元にはもう戻らないので、framesには積まずに
+ * [関数, 引数...]を今の関数のスロットの位置に移して、そのまま関数を入れ替える
+ * 再帰がいくら深くなってもframesもスタックも増えない
+ */
+static bool tailCall(VM* vm, ObjFunction* function, int argCount) {
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    memmove(vm->slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm->stackTop = vm->slots + argCount + 1;
+
+    vm->function = function;
+    vm->chunk = &function->chunk;
+    vm->ip = function->chunk.code;
+    reserveStack(vm, (int)(vm->slots - vm->stack) + function->chunk.maxStack);
+    return true;
+}
+
+/**
+ * 組み込み関数を呼ぶ
+ * 引数はスタック上にあるものをそのまま渡し、戻り値は関数のスロットに書き込まれる
+ */
+static bool callNative(VM* vm, ObjNative* native, int argCount) {
+    if (argCount != native->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+        return false;
+    }
+    // Loxの関数を呼ぶ組み込み関数(map)はスタックを確保し直すことがあるので、位置で覚えておく
+    ptrdiff_t base = vm->stackTop - argCount - vm->stack;
+    bool succeeded = native->function(vm, argCount, vm->stackTop - argCount);
+    Value* args = vm->stack + base;
+    if (!succeeded) {
+        // nilなら呼んだLoxの関数の中の実行時エラーで、すでに表示されている
+        if (!IS_NIL(args[-1])) {
+            runtimeError(vm, "%s", AS_CSTRING(args[-1]));
+        }
+        return false;
+    }
+    vm->stackTop = args;
+    return true;
+}
+
+static bool callValue(VM* vm, Value callee, int argCount) {
+    if (IS_FUNCTION(callee)) {
+        return call(vm, AS_FUNCTION(callee), argCount);
+    }
+    if (IS_NATIVE(callee)) {
+        return callNative(vm, AS_NATIVE(callee), argCount);
+    }
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
+}
+
+/**
+ * list[index]の添字を確かめる
+ * @param slot 範囲内の整数ならその値を書き込む
+ * @return 使えない添字ならエラーを表示してfalse
+ */
+static bool checkListIndex(VM* vm, Value list, Value index, int* slot) {
+    if (!IS_LIST(list)) {
+        runtimeError(vm, "Only lists and maps can be indexed.");
+        return false;
+    }
+    if (!IS_NUMBER(index)) {
+        runtimeError(vm, "List index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    // NaNはどの比較もfalseになるので、範囲内であることを確かめてから整数に変換する
+    // (範囲外の値やNaNをintに変換するのは未定義動作)
+    if (!(number >= 0 && number < AS_LIST(list)->items.count) || number != (int)number) {
+        runtimeError(vm, "List index out of bounds.");
+        return false;
+    }
+    *slot = (int)number;
+    return true;
+}
+
+static bool checkMapKey(VM* vm, Value key) {
+    if (!isMapKey(key)) {
+        runtimeError(vm, "Map key cannot be nil or NaN.");
+        return false;
+    }
+    return true;
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceInstruction(VM* vm) {
+    printf("          ");
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
+}
+#endif
+
+#ifdef TEMPLATE_JIT
+/**
+ * --jit: 実行中のchunkをJITしてあれば、vm->ipの命令からそのコードで実行する
+ * まだならchunkのhotnessを数え、閾値に達したらJITする
+ * JITしたコードはOP_CALLなどでvm->ipをその命令にして戻るので、run()はそのまま続けてディスパッチする
+ */
+static void enterJit(VM* vm) {
+    Chunk* chunk = vm->chunk;
+    if (chunk->jit == NULL) {
+        if (++chunk->hotness < vm->jitThreshold) {
+            return;
+        }
+        if (!compileJit(chunk)) {
+            // 実行可能なメモリを確保できなければ、以降はJITしない
+            vm->jitThreshold = -1;
+            return;
+        }
+    }
+    runJit(vm);
 }
+#endif
 
-static InterpretResult run() {
-    #define READ_BYTE() (*vm.ip++)
-    #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+static InterpretResult run(VM* vm) {
+    #define READ_BYTE() (*vm->ip++)
+    #define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+    #define READ_SHORT() (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | vm->ip[-1]))
+    #define READ_STRING() AS_STRING(READ_CONSTANT())
     /**
      * do whileを使うことでマクロ内で複数の文をブロック内で書くことができる
      * マクロの裏技的なテクニック
      * do whileを使わないでif文の条件分岐をするとセミコロンを使ったタイミングでマクロの処理が終わりと認識される
+     *
+     * 結果は左オペランドのスロットに直接書き込む
+     * pop, pop, pushの代わりにstackTopを1回減らすだけで済む
+     * 命令の実装の中だけの小さな最適化で、ローカル変数をOP_GET_LOCALで積んでから演算する流れは変わらない
+     * スロットを直接オペランドにする実行はrunRegister(--engine=register)が行う
     */
-    #define BINARY_OP(valueType, op) { \
+    #define BINARY_OP(valueType, op, numberOp) { \
         do { \
-            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-                runtimeError("Operands must be numbers."); \
+            if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+                runtimeError(vm, "Operands must be numbers."); \
                 return INTERPRET_RUNTIME_ERROR; \
             } \
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push(valueType(a op b)); \
+            vm->ip[-1] = numberOp; \
+            double b = AS_NUMBER(vm->stackTop[-1]); \
+            double a = AS_NUMBER(vm->stackTop[-2]); \
+            vm->stackTop--; \
+            vm->stackTop[-1] = valueType(a op b); \
         } while (false); \
     }
+    /**
+     * quickening
+     * 
+     * 汎用の算術命令は一度数値で実行されると、その場で数値専用の命令に書き換えられる
+     * 数値専用の命令は両オペランドが数値かだけを確認する
+     * 数値でなかった場合は汎用の命令に書き戻し(deoptimize)、同じ命令を汎用の命令として実行し直す
+     * エラーメッセージは汎用の命令が出すので変わらない
+     * DISPATCH()がcontinueの場合があるのでdo whileで囲まない
+    */
+    #define NUMBER_OP(valueType, op, genericOp) { \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            vm->ip[-1] = genericOp; \
+            vm->ip--; \
+            recordInstructions(-1); \
+            DISPATCH(); \
+        } \
+        double b = AS_NUMBER(vm->stackTop[-1]); \
+        double a = AS_NUMBER(vm->stackTop[-2]); \
+        vm->stackTop--; \
+        vm->stackTop[-1] = valueType(a op b); \
+    }
+    #ifdef DEBUG_TRACE_EXECUTION
+    #define TRACE_INSTRUCTION() do { if (vm->traceExecution) { traceInstruction(vm); } } while (false)
+    #else
+    #define TRACE_INSTRUCTION() do {} while (false)
+    #endif
+    #ifdef PROFILE_EXECUTION
+    #define PROFILE_INSTRUCTION() do { if (vm->profileExecution) { profileInstruction(vm); } } while (false)
+    #else
+    #define PROFILE_INSTRUCTION() do {} while (false)
+    #endif
+    /**
+     * --jit: 関数に入ったとき、関数から戻ったとき、ループの先頭に戻ったときにJITしたコードへ入る
+     * JITしたコードは呼び出しと戻りを実行しないので、この3か所でインタプリタから機械語へ戻ってくる
+     */
+    #ifdef TEMPLATE_JIT
+    #define ENTER_JIT() do { if (vm->jitThreshold >= 0) { enterJit(vm); } } while (false)
+    #else
+    #define ENTER_JIT() do {} while (false)
+    #endif
+
+    /**
+     * threaded dispatch
+     * 
+     * 各命令の最後で次の命令のラベルへ直接ジャンプする
+     * switchの先頭へ戻る共通の分岐がなくなり、分岐予測も命令ごとに分かれる
+     * 最初の1命令だけはswitchでディスパッチする
+     *
+     * 減らせるのはディスパッチの分岐だけで、命令ごとの処理はswitchのときと同じ
+     * よく実行するchunkを機械語にするのは--jit(jit.c)
+     * -DNO_COMPUTED_GOTOでswitchに戻して比べられる(bench/arith.loxやfib(30)で1割弱速い)
+     */
+    #ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_POP] = &&op_OP_POP,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_LESS_NUM] = &&op_OP_LESS_NUM,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_MULTIPLY_NUM] = &&op_OP_MULTIPLY_NUM,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_DIVIDE_NUM] = &&op_OP_DIVIDE_NUM,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+        [OP_BUILD_LIST] = &&op_OP_BUILD_LIST,
+        [OP_BUILD_MAP] = &&op_OP_BUILD_MAP,
+        [OP_INDEX_GET] = &&op_OP_INDEX_GET,
+        [OP_INDEX_SET] = &&op_OP_INDEX_SET,
+        [OP_RETURN] = &&op_OP_RETURN,
+    };
+    #define CASE(opcode) case opcode: op_##opcode
+    #define DISPATCH() do { TRACE_INSTRUCTION(); PROFILE_INSTRUCTION(); recordInstructions(1); goto *dispatchTable[READ_BYTE()]; } while (false)
+    #else
+    #define CASE(opcode) case opcode
+    #define DISPATCH() continue
+    #endif
+
+    // トップレベルとcallFromNativeで呼ばれた関数の最初
+    ENTER_JIT();
     for (;;) {
-        #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-        #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
+        TRACE_INSTRUCTION();
+        PROFILE_INSTRUCTION();
+        recordInstructions(1);
+        switch (READ_BYTE()) {
             // dispatching, decoding instruction
-            case OP_CONSTANT: {
+            CASE(OP_CONSTANT): {
                 Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: {
-                push(NIL_VAL);
-                break;
-            }
-            case OP_TRUE: {
-                push(BOOL_VAL(true));
-                break;
-            }
-            case OP_FALSE: {
-                push(BOOL_VAL(false));
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER: {
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            }
-            case OP_LESS: {
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            }
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                push(vm, constant);
+                DISPATCH();
+            }
+            CASE(OP_NIL): {
+                push(vm, NIL_VAL);
+                DISPATCH();
+            }
+            CASE(OP_TRUE): {
+                push(vm, BOOL_VAL(true));
+                DISPATCH();
+            }
+            CASE(OP_FALSE): {
+                push(vm, BOOL_VAL(false));
+                DISPATCH();
+            }
+            CASE(OP_POP): {
+                pop(vm);
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL): {
+                uint8_t slot = READ_BYTE();
+                push(vm, vm->slots[slot]);
+                DISPATCH();
+            }
+            CASE(OP_SET_LOCAL): {
+                // 代入は式なので値はスタックに残す
+                uint8_t slot = READ_BYTE();
+                vm->slots[slot] = peek(vm, 0);
+                DISPATCH();
+            }
+            CASE(OP_GET_GLOBAL): {
+                ObjString* name = READ_STRING();
+                Value value;
+                if (!tableGet(&vm->globals, name, &value)) {
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(vm, value);
+                DISPATCH();
+            }
+            CASE(OP_DEFINE_GLOBAL): {
+                ObjString* name = READ_STRING();
+                tableSet(&vm->globals, name, peek(vm, 0));
+                pop(vm);
+                DISPATCH();
+            }
+            CASE(OP_SET_GLOBAL): {
+                ObjString* name = READ_STRING();
+                // 新しいキーだった場合は未定義の変数への代入なので元に戻す
+                if (tableSet(&vm->globals, name, peek(vm, 0))) {
+                    tableDelete(&vm->globals, name);
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                DISPATCH();
+            }
+            CASE(OP_EQUAL): {
+                Value b = pop(vm);
+                vm->stackTop[-1] = BOOL_VAL(valuesEqual(vm->stackTop[-1], b));
+                DISPATCH();
+            }
+            CASE(OP_GREATER): {
+                BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+                DISPATCH();
+            }
+            CASE(OP_GREATER_NUM): {
+                NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+                DISPATCH();
+            }
+            CASE(OP_LESS): {
+                BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+                DISPATCH();
+            }
+            CASE(OP_LESS_NUM): {
+                NUMBER_OP(BOOL_VAL, <, OP_LESS);
+                DISPATCH();
+            }
+            CASE(OP_ADD): {
+                if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                    concatenate(vm);
+                } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                    vm->ip[-1] = OP_ADD_NUM;
+                    double b = AS_NUMBER(pop(vm));
+                    vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm->stackTop[-1]) + b);
                 } else {
-                    runtimeError("Operands must be two numbers or two strings.");
+                    runtimeError(vm, "Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                DISPATCH();
+            }
+            CASE(OP_ADD_NUM): {
+                NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT): {
+                BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT_NUM): {
+                NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+                DISPATCH();
+            }
+            CASE(OP_MULTIPLY): {
+                BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+                DISPATCH();
+            }
+            CASE(OP_MULTIPLY_NUM): {
+                NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+                DISPATCH();
+            }
+            CASE(OP_DIVIDE): {
+                BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+                DISPATCH();
+            }
+            CASE(OP_DIVIDE_NUM): {
+                NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+                DISPATCH();
+            }
+            CASE(OP_NOT): {
+                vm->stackTop[-1] = BOOL_VAL(isFalsey(vm->stackTop[-1]));
+                DISPATCH();
+            }
+            CASE(OP_NEGATE): {
+                if (!IS_NUMBER(peek(vm, 0))) {
+                    runtimeError(vm, "Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm->stackTop[-1]));
+                DISPATCH();
             }
-            case OP_SUBTRACT: {
-                BINARY_OP(NUMBER_VAL, -);
-                break;
+            CASE(OP_PRINT): {
+                printToBuffer(vm, pop(vm));
+#ifdef DEBUG_TRACE_EXECUTION
+                // トレースの出力と順番が入れ替わらないようにする
+                if (vm->traceExecution) {
+                    flushOutput(vm);
+                }
+#endif
+                DISPATCH();
+            }
+            CASE(OP_JUMP): {
+                uint16_t offset = READ_SHORT();
+                vm->ip += offset;
+                DISPATCH();
             }
-            case OP_MULTIPLY: {
-                BINARY_OP(NUMBER_VAL, *);
-                break;
+            CASE(OP_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(peek(vm, 0))) {
+                    vm->ip += offset;
+                }
+                DISPATCH();
             }
-            case OP_DIVIDE: {
-                BINARY_OP(NUMBER_VAL, /);
-                break;
+            CASE(OP_LOOP): {
+                uint16_t offset = READ_SHORT();
+                vm->ip -= offset;
+                ENTER_JIT();
+                DISPATCH();
             }
-            case OP_NOT: {
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
+            CASE(OP_CALL): {
+                int argCount = READ_BYTE();
+                if (!callValue(vm, peek(vm, argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ENTER_JIT();
+                DISPATCH();
             }
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
+            CASE(OP_TAIL_CALL): {
+                int argCount = READ_BYTE();
+                Value callee = peek(vm, argCount);
+                if (IS_FUNCTION(callee)) {
+                    if (!tailCall(vm, AS_FUNCTION(callee), argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                } else if (!callValue(vm, callee, argCount)) {
+                    // 組み込み関数は普通に呼び、戻り値は直後のOP_RETURNが返す
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+                ENTER_JIT();
+                DISPATCH();
             }
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
+            CASE(OP_BUILD_LIST): {
+                int itemCount = READ_BYTE();
+                ObjList* list = newList(vm, itemCount);
+                Value* items = vm->stackTop - itemCount;
+                for (int i = 0; i < itemCount; i++) {
+                    appendToList(list, items[i]);
+                }
+                vm->stackTop = items;
+                push(vm, OBJ_VAL((Obj*)list));
+                DISPATCH();
             }
-            case OP_RETURN: {
-                // インタプリタを終了する
-                return INTERPRET_OK;
+            CASE(OP_BUILD_MAP): {
+                int entryCount = READ_BYTE();
+                ObjMap* map = newMap(vm);
+                Value* entries = vm->stackTop - entryCount * 2;
+                for (int i = 0; i < entryCount; i++) {
+                    if (!checkMapKey(vm, entries[i * 2])) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    setMapEntry(map, entries[i * 2], entries[i * 2 + 1]);
+                }
+                vm->stackTop = entries;
+                push(vm, OBJ_VAL((Obj*)map));
+                DISPATCH();
+            }
+            CASE(OP_INDEX_GET): {
+                if (IS_MAP(peek(vm, 1))) {
+                    // ないkeyはnil
+                    Value value;
+                    if (!tableGetValue(&AS_MAP(peek(vm, 1))->table, peek(vm, 0), &value)) {
+                        value = NIL_VAL;
+                    }
+                    vm->stackTop--;
+                    vm->stackTop[-1] = value;
+                    DISPATCH();
+                }
+                int index;
+                if (!checkListIndex(vm, peek(vm, 1), peek(vm, 0), &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm->stackTop--;
+                vm->stackTop[-1] = AS_LIST(vm->stackTop[-1])->items.values[index];
+                DISPATCH();
+            }
+            CASE(OP_INDEX_SET): {
+                if (IS_MAP(peek(vm, 2))) {
+                    if (!checkMapKey(vm, peek(vm, 1))) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    Value value = peek(vm, 0);
+                    setMapEntry(AS_MAP(peek(vm, 2)), peek(vm, 1), value);
+                    vm->stackTop -= 2;
+                    vm->stackTop[-1] = value;
+                    DISPATCH();
+                }
+                int index;
+                if (!checkListIndex(vm, peek(vm, 2), peek(vm, 1), &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // 代入は式なので代入した値を残す
+                Value value = peek(vm, 0);
+                setListItem(AS_LIST(peek(vm, 2)), index, value);
+                vm->stackTop -= 2;
+                vm->stackTop[-1] = value;
+                DISPATCH();
+            }
+            CASE(OP_RETURN): {
+                Value result = pop(vm);
+                if (vm->frameCount == 0) {
+                    // スクリプトのトップレベルの終わり
+                    return INTERPRET_OK;
+                }
+                // 関数のスロット(関数自身、引数、ローカル変数)をまとめて捨てる
+                vm->stackTop = vm->slots;
+                CallFrame* frame = &vm->frames[--vm->frameCount];
+                vm->function = frame->function;
+                vm->chunk = frame->chunk;
+                vm->ip = frame->ip;
+                vm->slots = frame->slots;
+                push(vm, result);
+                // callFromNativeで呼ばれた関数から戻ったら、呼び出した組み込み関数に戻る
+                if (vm->frameCount == vm->returnFrame) {
+                    return INTERPRET_OK;
+                }
+                ENTER_JIT();
+                DISPATCH();
             }
         }
     }
     #undef READ_BYTE
     #undef READ_CONSTANT
+    #undef READ_SHORT
+    #undef READ_STRING
     #undef BINARY_OP
+    #undef NUMBER_OP
+    #undef TRACE_INSTRUCTION
+    #undef PROFILE_INSTRUCTION
+    #undef ENTER_JIT
+    #undef CASE
+    #undef DISPATCH
+}
+
+/**
+ * 関数を初めて呼ぶときにレジスタ命令に翻訳する
+ */
+static bool translateFunction(VM* vm, ObjFunction* function) {
+    if (!allocateRegisters(&function->chunk, 0, function->arity + 1)) {
+        runtimeError(vm, "Function '%s' needs too many registers.", function->name->chars);
+        return false;
+    }
+    if (vm->printCode) {
+        disassembleRegisters(&function->chunk, function->name->chars);
+    }
+    return true;
+}
+
+/**
+ * --engine=registerで関数の本体に入る
+ * call()と同じだが、関数のスロットはbaseから始まり、stackTopはいつもフレームの末尾(slots + frameSize)にある
+ * @param base 関数と引数が並んでいる位置
+ */
+static bool enterRegisters(VM* vm, ObjFunction* function, int argCount, Value* base) {
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if (vm->frameCount == FRAMES_MAX) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    if (function->chunk.registerCode == NULL && !translateFunction(vm, function)) {
+        return false;
+    }
+    CallFrame* frame = &vm->frames[vm->frameCount++];
+    frame->function = vm->function;
+    frame->chunk = vm->chunk;
+    frame->ip = vm->ip;
+    frame->registerIp = vm->registerIp;
+    frame->slots = vm->slots;
+
+    vm->function = function;
+    vm->chunk = &function->chunk;
+    vm->registerIp = function->chunk.registerCode;
+    vm->slots = base;
+    reserveStack(vm, (int)(vm->slots - vm->stack) + function->chunk.frameSize);
+    vm->stackTop = vm->slots + function->chunk.frameSize;
+    return true;
+}
+
+/**
+ * --engine=registerの末尾呼び出し、関数と引数をスロットの先頭に移して関数を入れ替える
+ */
+static bool tailCallRegisters(VM* vm, ObjFunction* function, int argCount, int base) {
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if (function->chunk.registerCode == NULL && !translateFunction(vm, function)) {
+        return false;
+    }
+    memmove(vm->slots, vm->slots + base, sizeof(Value) * (argCount + 1));
+    vm->function = function;
+    vm->chunk = &function->chunk;
+    vm->registerIp = function->chunk.registerCode;
+    reserveStack(vm, (int)(vm->slots - vm->stack) + function->chunk.frameSize);
+    vm->stackTop = vm->slots + function->chunk.frameSize;
+    return true;
+}
+
+/**
+ * REG_CALL: レジスタbaseの関数をその後ろのargCount個のレジスタを引数にして呼ぶ
+ * 戻り値はレジスタbaseに置かれる
+ */
+static bool callRegisters(VM* vm, int base, int argCount) {
+    Value callee = vm->slots[base];
+    if (IS_FUNCTION(callee)) {
+        return enterRegisters(vm, AS_FUNCTION(callee), argCount, vm->slots + base);
+    }
+    if (IS_NATIVE(callee)) {
+        // 組み込み関数はstackTopの手前を引数として受け取る
+        vm->stackTop = vm->slots + base + argCount + 1;
+        if (!callNative(vm, AS_NATIVE(callee), argCount)) {
+            return false;
+        }
+        vm->stackTop = vm->slots + vm->chunk->frameSize;
+        return true;
+    }
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
+}
+
+/**
+ * --engine=registerの実行ループ
+ *
+ * allocateRegistersが翻訳した3番地の命令を実行する
+ * ローカル変数を積んでから演算する代わりに、フレームのスロットを直接オペランドにするので
+ * 実行する命令の数もスタックへの読み書きも減る(bench/engines.shで比べられる)
+ * quickeningはしない(命令がオペランドの場所を持つので、型の確認だけで済む)
+ */
+static InterpretResult runRegister(VM* vm) {
+    // 実行中のフレームの状態はローカル変数に持ち、関数を呼ぶ前と実行時エラーの前にvmに書き戻す
+    uint32_t* ip;
+    Value* slots;
+    Value* constants;
+    uint32_t instruction;
+    #define LOAD_FRAME() \
+        do { \
+            ip = vm->registerIp; \
+            slots = vm->slots; \
+            constants = vm->chunk->constants.values; \
+        } while (false)
+    #define SAVE_IP() (vm->registerIp = ip)
+    #define RA (slots[REG_A(instruction)])
+    #define RB (slots[REG_B(instruction)])
+    #define RC (slots[REG_C(instruction)])
+    #define KB (constants[REG_B(instruction)])
+    #define KC (constants[REG_C(instruction)])
+    #define RUNTIME_ERROR(...) \
+        do { \
+            SAVE_IP(); \
+            runtimeError(vm, __VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+    // ジャンプする命令は次の32bitにジャンプ先を持つ
+    #define JUMP_IF(condition) \
+        do { \
+            if (condition) { \
+                ip = vm->chunk->registerCode + *ip; \
+            } else { \
+                ip++; \
+            } \
+        } while (false)
+    #define ARITHMETIC(valueType, op, right) \
+        do { \
+            Value a = RB; \
+            Value b = right; \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            RA = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } while (false)
+    #define ADD(right) \
+        do { \
+            Value a = RB; \
+            Value b = right; \
+            if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+                RA = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+            } else if (IS_STRING(a) && IS_STRING(b)) { \
+                RA = OBJ_VAL((Obj*)concatenateStrings(vm, AS_STRING(a), AS_STRING(b))); \
+            } else { \
+                RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+            } \
+        } while (false)
+    #define COMPARE_JUMP(op, right, jumpIf) \
+        do { \
+            Value a = RB; \
+            Value b = right; \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            JUMP_IF((AS_NUMBER(a) op AS_NUMBER(b)) == jumpIf); \
+        } while (false)
+
+    #ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [REG_MOVE] = &&op_REG_MOVE,
+        [REG_LOAD_CONSTANT] = &&op_REG_LOAD_CONSTANT,
+        [REG_LOAD_NIL] = &&op_REG_LOAD_NIL,
+        [REG_LOAD_TRUE] = &&op_REG_LOAD_TRUE,
+        [REG_LOAD_FALSE] = &&op_REG_LOAD_FALSE,
+        [REG_GET_GLOBAL] = &&op_REG_GET_GLOBAL,
+        [REG_DEFINE_GLOBAL] = &&op_REG_DEFINE_GLOBAL,
+        [REG_SET_GLOBAL] = &&op_REG_SET_GLOBAL,
+        [REG_EQUAL] = &&op_REG_EQUAL,
+        [REG_EQUAL_K] = &&op_REG_EQUAL_K,
+        [REG_GREATER] = &&op_REG_GREATER,
+        [REG_GREATER_K] = &&op_REG_GREATER_K,
+        [REG_LESS] = &&op_REG_LESS,
+        [REG_LESS_K] = &&op_REG_LESS_K,
+        [REG_ADD] = &&op_REG_ADD,
+        [REG_ADD_K] = &&op_REG_ADD_K,
+        [REG_SUBTRACT] = &&op_REG_SUBTRACT,
+        [REG_SUBTRACT_K] = &&op_REG_SUBTRACT_K,
+        [REG_MULTIPLY] = &&op_REG_MULTIPLY,
+        [REG_MULTIPLY_K] = &&op_REG_MULTIPLY_K,
+        [REG_DIVIDE] = &&op_REG_DIVIDE,
+        [REG_DIVIDE_K] = &&op_REG_DIVIDE_K,
+        [REG_NOT] = &&op_REG_NOT,
+        [REG_NEGATE] = &&op_REG_NEGATE,
+        [REG_PRINT] = &&op_REG_PRINT,
+        [REG_JUMP] = &&op_REG_JUMP,
+        [REG_JUMP_IF_FALSE] = &&op_REG_JUMP_IF_FALSE,
+        [REG_JUMP_IF_EQUAL] = &&op_REG_JUMP_IF_EQUAL,
+        [REG_JUMP_IF_EQUAL_K] = &&op_REG_JUMP_IF_EQUAL_K,
+        [REG_JUMP_IF_NOT_EQUAL] = &&op_REG_JUMP_IF_NOT_EQUAL,
+        [REG_JUMP_IF_NOT_EQUAL_K] = &&op_REG_JUMP_IF_NOT_EQUAL_K,
+        [REG_JUMP_IF_GREATER] = &&op_REG_JUMP_IF_GREATER,
+        [REG_JUMP_IF_GREATER_K] = &&op_REG_JUMP_IF_GREATER_K,
+        [REG_JUMP_IF_NOT_GREATER] = &&op_REG_JUMP_IF_NOT_GREATER,
+        [REG_JUMP_IF_NOT_GREATER_K] = &&op_REG_JUMP_IF_NOT_GREATER_K,
+        [REG_JUMP_IF_LESS] = &&op_REG_JUMP_IF_LESS,
+        [REG_JUMP_IF_LESS_K] = &&op_REG_JUMP_IF_LESS_K,
+        [REG_JUMP_IF_NOT_LESS] = &&op_REG_JUMP_IF_NOT_LESS,
+        [REG_JUMP_IF_NOT_LESS_K] = &&op_REG_JUMP_IF_NOT_LESS_K,
+        [REG_CALL] = &&op_REG_CALL,
+        [REG_TAIL_CALL] = &&op_REG_TAIL_CALL,
+        [REG_BUILD_LIST] = &&op_REG_BUILD_LIST,
+        [REG_BUILD_MAP] = &&op_REG_BUILD_MAP,
+        [REG_INDEX_GET] = &&op_REG_INDEX_GET,
+        [REG_INDEX_SET] = &&op_REG_INDEX_SET,
+        [REG_RETURN] = &&op_REG_RETURN,
+    };
+    #define CASE(opcode) case opcode: op_##opcode
+    #define DISPATCH() do { recordInstructions(1); instruction = *ip++; goto *dispatchTable[REG_OP(instruction)]; } while (false)
+    #else
+    #define CASE(opcode) case opcode
+    #define DISPATCH() continue
+    #endif
+
+    LOAD_FRAME();
+    for (;;) {
+        recordInstructions(1);
+        instruction = *ip++;
+        switch (REG_OP(instruction)) {
+            CASE(REG_MOVE): {
+                RA = RB;
+                DISPATCH();
+            }
+            CASE(REG_LOAD_CONSTANT): {
+                RA = KB;
+                DISPATCH();
+            }
+            CASE(REG_LOAD_NIL): {
+                RA = NIL_VAL;
+                DISPATCH();
+            }
+            CASE(REG_LOAD_TRUE): {
+                RA = BOOL_VAL(true);
+                DISPATCH();
+            }
+            CASE(REG_LOAD_FALSE): {
+                RA = BOOL_VAL(false);
+                DISPATCH();
+            }
+            CASE(REG_GET_GLOBAL): {
+                ObjString* name = AS_STRING(KB);
+                if (!tableGet(&vm->globals, name, &RA)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+                }
+                DISPATCH();
+            }
+            CASE(REG_DEFINE_GLOBAL): {
+                tableSet(&vm->globals, AS_STRING(KB), RA);
+                DISPATCH();
+            }
+            CASE(REG_SET_GLOBAL): {
+                ObjString* name = AS_STRING(KB);
+                // 新しいキーだった場合は未定義の変数への代入なので元に戻す
+                if (tableSet(&vm->globals, name, RA)) {
+                    tableDelete(&vm->globals, name);
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+                }
+                DISPATCH();
+            }
+            CASE(REG_EQUAL): {
+                RA = BOOL_VAL(valuesEqual(RB, RC));
+                DISPATCH();
+            }
+            CASE(REG_EQUAL_K): {
+                RA = BOOL_VAL(valuesEqual(RB, KC));
+                DISPATCH();
+            }
+            CASE(REG_GREATER): {
+                ARITHMETIC(BOOL_VAL, >, RC);
+                DISPATCH();
+            }
+            CASE(REG_GREATER_K): {
+                ARITHMETIC(BOOL_VAL, >, KC);
+                DISPATCH();
+            }
+            CASE(REG_LESS): {
+                ARITHMETIC(BOOL_VAL, <, RC);
+                DISPATCH();
+            }
+            CASE(REG_LESS_K): {
+                ARITHMETIC(BOOL_VAL, <, KC);
+                DISPATCH();
+            }
+            CASE(REG_ADD): {
+                ADD(RC);
+                DISPATCH();
+            }
+            CASE(REG_ADD_K): {
+                ADD(KC);
+                DISPATCH();
+            }
+            CASE(REG_SUBTRACT): {
+                ARITHMETIC(NUMBER_VAL, -, RC);
+                DISPATCH();
+            }
+            CASE(REG_SUBTRACT_K): {
+                ARITHMETIC(NUMBER_VAL, -, KC);
+                DISPATCH();
+            }
+            CASE(REG_MULTIPLY): {
+                ARITHMETIC(NUMBER_VAL, *, RC);
+                DISPATCH();
+            }
+            CASE(REG_MULTIPLY_K): {
+                ARITHMETIC(NUMBER_VAL, *, KC);
+                DISPATCH();
+            }
+            CASE(REG_DIVIDE): {
+                ARITHMETIC(NUMBER_VAL, /, RC);
+                DISPATCH();
+            }
+            CASE(REG_DIVIDE_K): {
+                ARITHMETIC(NUMBER_VAL, /, KC);
+                DISPATCH();
+            }
+            CASE(REG_NOT): {
+                RA = BOOL_VAL(isFalsey(RB));
+                DISPATCH();
+            }
+            CASE(REG_NEGATE): {
+                if (!IS_NUMBER(RB)) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                RA = NUMBER_VAL(-AS_NUMBER(RB));
+                DISPATCH();
+            }
+            CASE(REG_PRINT): {
+                printToBuffer(vm, RA);
+                DISPATCH();
+            }
+            CASE(REG_JUMP): {
+                JUMP_IF(true);
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_FALSE): {
+                JUMP_IF(isFalsey(RA));
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_EQUAL): {
+                JUMP_IF(valuesEqual(RB, RC));
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_EQUAL_K): {
+                JUMP_IF(valuesEqual(RB, KC));
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_NOT_EQUAL): {
+                JUMP_IF(!valuesEqual(RB, RC));
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_NOT_EQUAL_K): {
+                JUMP_IF(!valuesEqual(RB, KC));
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_GREATER): {
+                COMPARE_JUMP(>, RC, true);
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_GREATER_K): {
+                COMPARE_JUMP(>, KC, true);
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_NOT_GREATER): {
+                COMPARE_JUMP(>, RC, false);
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_NOT_GREATER_K): {
+                COMPARE_JUMP(>, KC, false);
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_LESS): {
+                COMPARE_JUMP(<, RC, true);
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_LESS_K): {
+                COMPARE_JUMP(<, KC, true);
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_NOT_LESS): {
+                COMPARE_JUMP(<, RC, false);
+                DISPATCH();
+            }
+            CASE(REG_JUMP_IF_NOT_LESS_K): {
+                COMPARE_JUMP(<, KC, false);
+                DISPATCH();
+            }
+            CASE(REG_CALL): {
+                SAVE_IP();
+                if (!callRegisters(vm, REG_A(instruction), REG_B(instruction))) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(REG_TAIL_CALL): {
+                SAVE_IP();
+                Value callee = RA;
+                if (IS_FUNCTION(callee)) {
+                    if (!tailCallRegisters(vm, AS_FUNCTION(callee), REG_B(instruction), REG_A(instruction))) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                } else if (!callRegisters(vm, REG_A(instruction), REG_B(instruction))) {
+                    // 組み込み関数は普通に呼び、戻り値は直後のREG_RETURNが返す
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(REG_BUILD_LIST): {
+                int itemCount = REG_B(instruction);
+                ObjList* list = newList(vm, itemCount);
+                Value* items = &RA;
+                for (int i = 0; i < itemCount; i++) {
+                    appendToList(list, items[i]);
+                }
+                RA = OBJ_VAL((Obj*)list);
+                DISPATCH();
+            }
+            CASE(REG_BUILD_MAP): {
+                int entryCount = REG_B(instruction);
+                ObjMap* map = newMap(vm);
+                Value* entries = &RA;
+                for (int i = 0; i < entryCount; i++) {
+                    if (!isMapKey(entries[i * 2])) {
+                        RUNTIME_ERROR("Map key cannot be nil or NaN.");
+                    }
+                    setMapEntry(map, entries[i * 2], entries[i * 2 + 1]);
+                }
+                RA = OBJ_VAL((Obj*)map);
+                DISPATCH();
+            }
+            CASE(REG_INDEX_GET): {
+                Value container = RB;
+                if (IS_MAP(container)) {
+                    // ないkeyはnil
+                    Value value;
+                    if (!tableGetValue(&AS_MAP(container)->table, RC, &value)) {
+                        value = NIL_VAL;
+                    }
+                    RA = value;
+                    DISPATCH();
+                }
+                int index;
+                SAVE_IP();
+                if (!checkListIndex(vm, container, RC, &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                RA = AS_LIST(container)->items.values[index];
+                DISPATCH();
+            }
+            CASE(REG_INDEX_SET): {
+                Value container = RA;
+                SAVE_IP();
+                if (IS_MAP(container)) {
+                    if (!checkMapKey(vm, RB)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    setMapEntry(AS_MAP(container), RB, RC);
+                    DISPATCH();
+                }
+                int index;
+                if (!checkListIndex(vm, container, RB, &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                setListItem(AS_LIST(container), index, RC);
+                DISPATCH();
+            }
+            CASE(REG_RETURN): {
+                Value result = RA;
+                if (vm->frameCount == 0) {
+                    // スクリプトのトップレベルの終わり
+                    SAVE_IP();
+                    return INTERPRET_OK;
+                }
+                // 戻り値は呼び出し元のREG_CALLのAのレジスタ(関数を置いていたスロット)に置く
+                slots[0] = result;
+                CallFrame* frame = &vm->frames[--vm->frameCount];
+                vm->function = frame->function;
+                vm->chunk = frame->chunk;
+                vm->registerIp = frame->registerIp;
+                vm->slots = frame->slots;
+                vm->stackTop = vm->slots + vm->chunk->frameSize;
+                // callFromNativeで呼ばれた関数から戻ったら、呼び出した組み込み関数に戻る
+                if (vm->frameCount == vm->returnFrame) {
+                    return INTERPRET_OK;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+        }
+    }
+    #undef LOAD_FRAME
+    #undef SAVE_IP
+    #undef RA
+    #undef RB
+    #undef RC
+    #undef KB
+    #undef KC
+    #undef RUNTIME_ERROR
+    #undef JUMP_IF
+    #undef ARITHMETIC
+    #undef ADD
+    #undef COMPARE_JUMP
+    #undef CASE
+    #undef DISPATCH
+}
+
+bool callFromNative(VM* vm, ObjFunction* function, int argCount, const Value* arguments, Value* result) {
+    // 呼び出し元のchunkのmaxStackには組み込み関数が積む分が入っていない
+    reserveStack(vm, (int)(vm->stackTop - vm->stack) + argCount + 1);
+    push(vm, OBJ_VAL((Obj*)function));
+    for (int i = 0; i < argCount; i++) {
+        push(vm, arguments[i]);
+    }
+
+    // 戻り値は関数を積んだ位置に置かれる
+    ptrdiff_t base = vm->stackTop - argCount - 1 - vm->stack;
+    int returnFrame = vm->returnFrame;
+    bool called = vm->registerEngine
+        ? enterRegisters(vm, function, argCount, vm->stack + base)
+        : call(vm, function, argCount);
+    if (!called) {
+        return false;
+    }
+    vm->returnFrame = vm->frameCount - 1;
+    InterpretResult status = vm->registerEngine ? runRegister(vm) : run(vm);
+    vm->returnFrame = returnFrame;
+    if (status != INTERPRET_OK) {
+        return false;
+    }
+    *result = vm->stack[base];
+    vm->stackTop = vm->stack + base;
+    return true;
 }
 
-InterpretResult interpret(const char* source) {
+/**
+ * コンパイル済みのchunkを実行して解放する
+ */
+InterpretResult interpretChunk(VM* vm, Chunk* chunk, int offset) {
+    // 検査を通ったchunkはスタックの深さも定数の番号も範囲内なので、run()では確かめない
+    if (!verifyChunk(chunk, offset, vm->err)) {
+        return INTERPRET_COMPILE_ERROR;
+    }
+    resetStack(vm);
+    reserveStack(vm, chunk->maxStack);
+    vm->chunk = chunk;
+    vm->ip = vm->chunk->code + offset;
+#ifdef TEMPLATE_JIT
+    // REPLで追記したコードと定数はJITしたコードに入っていないので、JITし直す
+    freeJit(chunk);
+#endif
+
+    InterpretResult result;
+    if (vm->registerEngine) {
+        // REPLでは追記した部分だけを翻訳し直す
+        if (!allocateRegisters(chunk, offset, 0)) {
+            fprintf(vm->err, "Script needs too many registers.\n");
+            return INTERPRET_COMPILE_ERROR;
+        }
+        if (vm->printCode) {
+            disassembleRegisters(chunk, "code");
+        }
+        vm->registerIp = chunk->registerCode;
+        vm->stackTop = vm->stack + chunk->frameSize;
+        result = runRegister(vm);
+    } else {
+        result = run(vm);
+    }
+    flushOutput(vm);
+#ifdef PROFILE_EXECUTION
+    if (vm->profileExecution) {
+        profileFlush();
+    }
+#endif
+    return result;
+}
+
+static InterpretResult runChunk(VM* vm, Chunk* chunk) {
+    InterpretResult result = interpretChunk(vm, chunk, 0);
+    freeChunk(chunk);
+    return result;
+}
+
+InterpretResult interpret(VM* vm, const char* source) {
     Chunk chunk;
     initChunk(&chunk);
     
-    if(!compile(source, &chunk)) {
+    if(!compile(vm, source, &chunk)) {
         freeChunk(&chunk);
         return INTERPRET_COMPILE_ERROR;
     }
+    return runChunk(vm, &chunk);
+}
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+InterpretResult interpretEntry(VM* vm, const char* name) {
+    // name(); と同じ命令を組み立てる(ソースがないので行番号は0)
+    Chunk chunk;
+    initChunk(&chunk);
+    int constant = addConstant(&chunk, OBJ_VAL((Obj*)copyString(vm, name, (int)strlen(name))));
+    writeChunk(&chunk, OP_GET_GLOBAL, 0);
+    writeChunk(&chunk, (uint8_t)constant, 0);
+    writeChunk(&chunk, OP_CALL, 0);
+    writeChunk(&chunk, 0, 0);
+    writeChunk(&chunk, OP_POP, 0);
+    writeChunk(&chunk, OP_NIL, 0);
+    writeChunk(&chunk, OP_RETURN, 0);
+    return runChunk(vm, &chunk);
+}
 
-    InterpretResult result = run();
-    freeChunk(&chunk);
-    return result;
+InterpretResult interpretStream(VM* vm, int fd) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    if (!compileStream(vm, fd, &chunk)) {
+        freeChunk(&chunk);
+        return INTERPRET_COMPILE_ERROR;
+    }
+    return runChunk(vm, &chunk);
 }
\ No newline at end of file
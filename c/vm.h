@@ -2,17 +2,71 @@
 #define VM_H
 
 #include "chunk.h"
+#include "object.h"
 #include "table.h"
 
-#define STACK_MAX 256
+// 関数呼び出しの深さの上限(末尾呼び出しは深さを増やさない)
+#define FRAMES_MAX 256
+// printの出力をためておくバッファの大きさ
+#define PRINT_BUFFER_SIZE (64 * 1024)
 
+/**
+ * 呼び出し元の関数の状態
+ * 関数を呼ぶときに保存し、OP_RETURNで戻す
+ */
 typedef struct {
+    ObjFunction* function; // NULLならスクリプトのトップレベル
+    Chunk* chunk;
+    uint8_t* ip; // 戻ったときに再開する命令
+    uint32_t* registerIp; // --engine=registerで戻ったときに再開する命令
+    Value* slots;
+} CallFrame;
+
+typedef struct VM {
+    // 実行中の関数の状態(呼び出し元の状態はframesに積む)
+    ObjFunction* function; // NULLならスクリプトのトップレベル
     Chunk* chunk;
     uint8_t* ip; // next instruction pointer
-    Value stack[STACK_MAX];
+    uint32_t* registerIp; // --engine=registerのときの次の命令(runRegisterは実行中はローカル変数に持つ)
+    Value* slots; // ローカル変数のスロット0(関数ならスロット0は関数自身)
+    CallFrame frames[FRAMES_MAX];
+    int frameCount;
+    /**
+     * OP_RETURNでframeCountがこの値に戻ったらrun()から戻る
+     * 組み込み関数がLoxの関数を呼ぶとき(callFromNative)だけ使い、普段は-1
+     */
+    int returnFrame;
+    /**
+     * 値スタック
+     * 実行するchunkを検査して求めた深さ(maxStack)だけ確保するので、pushで溢れることはない
+     */
+    Value* stack;
+    int stackCapacity;
     Value* stackTop; // next free slot in the stack
+    Table globals; // グローバル変数
     Table strings; // すべての文字列を格納するテーブル
     Obj* objects;
+    bool printCode; // --dump: コンパイルしたchunkを逆アセンブルして表示する
+    bool traceExecution; // --trace: 命令ごとにスタックと命令を表示する(debugビルドのみ)
+    bool profileExecution; // --profile: 命令ごとの回数と時間を集計する(profileビルドのみ)
+    /**
+     * --engine=register: スタック命令をレジスタ命令に翻訳して実行する
+     * トップレベルは実行する前に、関数は最初に呼ばれたときに翻訳する
+     */
+    bool registerEngine;
+    /**
+     * --jit=N: chunkに入った回数とループした回数の合計がNに達したらJITする(jit.h)
+     * -1ならJITしない
+     */
+    int jitThreshold;
+    FILE* out; // printの出力先
+    FILE* err; // コンパイルエラーと実行時エラーの出力先
+    /**
+     * printの出力はここにためて、まとめてoutに書き出す
+     * 実行の終わり、実行時エラーの前、いっぱいになったときにflushする
+     */
+    char* printBuffer; // 最初のprintで確保する
+    size_t printLength;
 } VM;
 
 typedef enum {
@@ -21,17 +75,61 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
+/**
+ * VMはグローバル変数ではなく、すべての関数に明示的に渡す
+ * VMごとにヒープ(objects, strings)を持つので、1つのプロセスで複数のVMを別々のスレッドで動かせる
+ * ただし1つのVMを同時に複数のスレッドから使ってはいけない
+ */
+void initVM(VM* vm);
+void freeVM(VM* vm);
 /**
  * Interprets a chunk of code.
  * @param chunk the chunk to interpret
  * @return the result of the interpretation
  */
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+InterpretResult interpret(VM* vm, const char* source);
+/**
+ * fdから読みながらコンパイルして実行する
+ * @param fd ファイルやパイプのfile descriptor
+ */
+InterpretResult interpretStream(VM* vm, int fd);
+/**
+ * グローバル変数nameの関数を引数なしで呼ぶ(--entry)
+ * heap imageから復元した関数を、スクリプトなしで実行するときに使う
+ * 戻り値は捨てる。未定義なら実行時エラー
+ */
+InterpretResult interpretEntry(VM* vm, const char* name);
+/**
+ * コンパイル済みのchunkをoffsetの位置から実行する
+ * REPLのように1つのchunkにコードを追記していく場合に使う。chunkは解放しない
+ * 実行する前にoffsetから末尾までをverifyChunkで検査し、通らなければINTERPRET_COMPILE_ERROR
+ * @param offset 実行を始める命令の位置
+ */
+InterpretResult interpretChunk(VM* vm, Chunk* chunk, int offset);
+/**
+ * Cの関数をグローバル変数nameとして登録する
+ * @param arity 引数の数、呼び出すときにVMが確かめる
+ */
+void defineNative(VM* vm, const char* name, int arity, NativeFn function);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+/**
+ * 組み込み関数からLoxの関数を呼び、戻るまでrun()を入れ子で回す
+ * 値スタックは確保し直されることがあるので、呼び出し側はスタックを指すポインタ(args)を付け直すこと
+ * @param arguments 引数の配列、値スタックの中を指してはいけない
+ * @param result 戻り値を書き込む
+ * @return 実行時エラーならfalse(エラーは表示済みで、スタックは空に戻っている)
+ */
+bool callFromNative(VM* vm, ObjFunction* function, int argCount, const Value* arguments, Value* result);
+/**
+ * print文の1回分(値と改行)を出力する
+ * JITしたコードからも呼ぶ
+ */
+void printToBuffer(VM* vm, Value value);
+/**
+ * 2つの文字列を連結した文字列を返す
+ * JITしたコードからも呼ぶ
+ */
+ObjString* concatenateStrings(VM* vm, ObjString* aString, ObjString* bString);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,13 @@
+package com.craftinginterpreters.lox;
+
+/**
+ * 文の実行がどう終わったか
+ *
+ * returnとbreakは例外を投げずに、この値を文の実行結果として呼び出し元へ返していく
+ * returnの値はInterpreterが1つだけ持っておき、関数の呼び出し側が受け取る
+ */
+enum Completion {
+    NORMAL,
+    BREAK, // 一番内側のwhileまで戻る
+    RETURN, // 関数の本体まで戻る
+}
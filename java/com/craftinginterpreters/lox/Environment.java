@@ -3,22 +3,44 @@ package com.craftinginterpreters.lox;
 import java.util.HashMap;
 import java.util.Map;
 
+/**
+ * 変数の環境
+ *
+ * グローバル環境だけは名前で引く(REPLで後から定義される変数もあるため)
+ * ブロックや関数の環境は、Resolverが振ったslot番号で引く固定長の配列
+ */
 public class Environment {
     final Environment enclosing; // parent environment
-    private final Map<String, Object> values = new HashMap<>();
+    private final Map<String, Object> values; // グローバル環境の変数、ローカル環境ならnull
+    private final Object[] slots; // ローカル環境の変数、グローバル環境ならnull
 
+    /**
+     * グローバル環境を作る
+     */
     Environment() {
         enclosing = null;
+        values = new HashMap<>();
+        slots = null;
     }
 
-    Environment(Environment enclosing) {
+    /**
+     * ローカル環境を作る
+     * @param slotCount このscopeで宣言される変数の数(Resolverが数えたもの)
+     */
+    Environment(Environment enclosing, int slotCount) {
         this.enclosing = enclosing;
+        values = null;
+        slots = new Object[slotCount];
     }
 
     void define(String name, Object value) {
         values.put(name, value);
     }
 
+    void define(int slot, Object value) {
+        slots[slot] = value;
+    }
+
     Environment ancestor(int distance) {
         Environment environment = this;
         for (int i = 0; i < distance; i++) {
@@ -27,8 +49,12 @@ public class Environment {
         return environment;
     }
 
-    Object getAt(int distance, String name) {
-        return ancestor(distance).values.get(name);
+    Object getAt(int distance, int slot) {
+        return ancestor(distance).slots[slot];
+    }
+
+    void assignAt(int distance, int slot, Object value) {
+        ancestor(distance).slots[slot] = value;
     }
 
     Object get(Token name) {
@@ -41,16 +67,12 @@ public class Environment {
             return value;
         }
 
-        if (enclosing != null) {
-            return enclosing.get(name);
-        }   
-
         throw new RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
     }
 
     /**
-     * Assigns a value to a variable in the current environment or in the enclosing environment.
-     * 
+     * Assigns a value to a global variable.
+     *
      * @param name the token representing the variable
      * @param value the value to assign to the variable
      * @throws RuntimeError if the variable is not defined
@@ -61,11 +83,6 @@ public class Environment {
             return;
         }
 
-        if (enclosing != null) {
-            enclosing.assign(name, value);
-            return;
-        }
-
         throw new RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
     }
 
@@ -5,11 +5,11 @@ import java.util.HashMap;
 import java.util.List;
 import java.util.Map;
 
-public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
+public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Completion> {
     final Environment globals = new Environment();
     private Environment environment = globals;
-    private final Map<Expr, Integer> locals = new HashMap<>();
-    private static class BreakException extends RuntimeException {}
+    // Completion.RETURNを返した文の値、呼び出し側がtakeReturnValueで受け取る
+    private Object returnValue = null;
 
     Interpreter() {
         globals.define("clock", new LoxCallable() {
@@ -62,7 +62,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
     @Override
     public Object visitSetExpr(Expr.Set expr) {
-        Object object = evaluate(expr.value);
+        Object object = evaluate(expr.object);
 
         if (!(object instanceof LoxInstance)) {
             throw new RuntimeError(expr.name, "Only instances have fields.");
@@ -75,9 +75,10 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
     @Override
     public Object visitSuperExpr(Expr.Super expr) {
-        int distance = locals.get(expr);
-        LoxClass superclass = (LoxClass)environment.getAt(distance, "super");
-        LoxInstance object = (LoxInstance)environment.getAt(distance - 1, "this");
+        // superもthisもそれぞれのscopeのslot 0にある
+        int distance = expr.depth;
+        LoxClass superclass = (LoxClass)environment.getAt(distance, 0);
+        LoxInstance object = (LoxInstance)environment.getAt(distance - 1, 0);
 
         LoxFucntion method = superclass.findMethod(expr.method.lexeme);
         if (method == null) {
@@ -88,7 +89,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
     @Override
     public Object visitThisExpr(Expr.This expr) {
-        return lookupVariable(expr.keyword, expr);
+        return environment.getAt(expr.depth, 0);
     }
 
     @Override
@@ -181,10 +182,10 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
             arguments.add(evaluate(argument));
         }
 
-        LoxCallable function = (LoxCallable)callee;
         if (!(callee instanceof LoxCallable)) {
             throw new RuntimeError(expr.paren, "Can only call functions and classes.");
         }
+        LoxCallable function = (LoxCallable)callee;
         if (arguments.size() != function.arity()) {
             throw new RuntimeError(expr.paren, "Expected " + function.arity() + " arguments but got " + arguments.size() + ".");
         }
@@ -231,29 +232,41 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
         return expr.accept(this);
     }
 
-    private void execute(Stmt stmt) {
-        stmt.accept(this);
+    private Completion execute(Stmt stmt) {
+        return stmt.accept(this);
     }
 
-    void resolve(Expr expr, int depth) {
-        locals.put(expr, depth);
+    /**
+     * 直前にCompletion.RETURNで終わった文の値を受け取る
+     */
+    Object takeReturnValue() {
+        Object value = returnValue;
+        returnValue = null;
+        return value;
     }
 
-    void executeBlock(List<Stmt> statements, Environment environment) {
+    /**
+     * @return breakかreturnで抜けたらそのCompletion、最後まで実行したらNORMAL
+     */
+    Completion executeBlock(List<Stmt> statements, Environment environment) {
         Environment previous = this.environment;
         try {
             // a new environment for the block.
             this.environment = environment;
             for (Stmt statement : statements) {
-                execute(statement);
+                Completion completion = execute(statement);
+                if (completion != Completion.NORMAL) {
+                    return completion;
+                }
             }
+            return Completion.NORMAL;
         } finally {
             this.environment = previous;
         }
     }
 
     @Override
-    public Void visitClassStmt(Stmt.Class stmt) {
+    public Completion visitClassStmt(Stmt.Class stmt) {
         Object superclass = null;
         if (stmt.superclass != null) {
             superclass = evaluate(stmt.superclass);
@@ -261,10 +274,10 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
                 throw new RuntimeError(stmt.superclass.name, "Superclass must be a class.");
             }
         }
-        environment.define(stmt.name.lexeme, null);
+        define(stmt.name, stmt.slot, null);
         if (stmt.superclass != null) {
-            environment = new Environment(environment);
-            environment.define("super", superclass);
+            environment = new Environment(environment, 1);
+            environment.define(0, superclass);
         }
 
         Map<String, LoxFucntion> methods = new HashMap<>();
@@ -277,86 +290,92 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
         if (stmt.superclass != null) {
             environment = environment.enclosing;
         }
-        environment.assign(stmt.name, klass);
-        return null;
+        define(stmt.name, stmt.slot, klass);
+        return Completion.NORMAL;
     }
 
     @Override
-    public Void visitBlockStmt(Stmt.Block stmt) {
-        executeBlock(stmt.statements, new Environment(this.environment));
-        return null;
+    public Completion visitBlockStmt(Stmt.Block stmt) {
+        return executeBlock(stmt.statements, new Environment(this.environment, stmt.slotCount));
     }
 
     @Override
-    public Void visitExpressionStmt(Stmt.Expression stmt) {
+    public Completion visitExpressionStmt(Stmt.Expression stmt) {
         evaluate(stmt.expression);
-        return null;
+        return Completion.NORMAL;
     }
 
     @Override
-    public Void visitFunctionStmt(Stmt.Function stmt) {
+    public Completion visitFunctionStmt(Stmt.Function stmt) {
         LoxCallable function = new LoxFucntion(stmt, environment, false);
-        environment.define(stmt.name.lexeme, function);
-        return null;
+        define(stmt.name, stmt.slot, function);
+        return Completion.NORMAL;
     }
 
     @Override
-    public Void visitIfStmt(Stmt.If stmt) {
+    public Completion visitIfStmt(Stmt.If stmt) {
         if (isTruthy(evaluate(stmt.condition))) {
-            execute(stmt.thenBranch);
+            return execute(stmt.thenBranch);
         } else if (stmt.elseBranch != null) {
-            execute(stmt.elseBranch);
+            return execute(stmt.elseBranch);
         }
-        return null;
+        return Completion.NORMAL;
     }
 
     @Override
-    public Void visitPrintStmt(Stmt.Print stmt) {
+    public Completion visitPrintStmt(Stmt.Print stmt) {
         Object value = evaluate(stmt.expression);
         System.out.println(stringify(value));
-        return null;
+        return Completion.NORMAL;
     }
 
     @Override
-    public Void visitReturnStmt(Stmt.Return stmt) {
+    public Completion visitReturnStmt(Stmt.Return stmt) {
         Object value = null;
         if (stmt.value != null) {
             value = evaluate(stmt.value);
         }
-        throw new Return(value);
+        returnValue = value;
+        return Completion.RETURN;
     }
 
     @Override
-    public Void visitVarStmt(Stmt.Var stmt) {
+    public Completion visitVarStmt(Stmt.Var stmt) {
         Object value = null;
         if (stmt.initializer != null) {
             value = evaluate(stmt.initializer);
         }
-        environment.define(stmt.name.lexeme, value);
-        return null;
+        define(stmt.name, stmt.slot, value);
+        return Completion.NORMAL;
     }
 
     @Override
-    public Void visitWhileStmt(Stmt.While stmt) {
-        try {
-            while (isTruthy(evaluate(stmt.condition))) {
-                execute(stmt.body);
+    public Completion visitWhileStmt(Stmt.While stmt) {
+        while (isTruthy(evaluate(stmt.condition))) {
+            Completion completion = execute(stmt.body);
+            if (completion == Completion.BREAK) {
+                break;
+            }
+            if (completion == Completion.RETURN) {
+                return completion;
             }
-        } catch (BreakException e) {
-            // do nothing
         }
-        return null;
+        return Completion.NORMAL;
     }
 
     @Override
-    public Void visitBreakStmt(Stmt.Break stmt) {
-        throw new BreakException();
+    public Completion visitBreakStmt(Stmt.Break stmt) {
+        return Completion.BREAK;
     }
 
     @Override
     public Object visitAssignExpr(Expr.Assign expr) {
         Object value = evaluate(expr.value);
-        environment.assign(expr.name, value);
+        if (expr.depth == -1) {
+            globals.assign(expr.name, value);
+        } else {
+            environment.assignAt(expr.depth, expr.slot, value);
+        }
         return value;
     }
 
@@ -376,14 +395,21 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
     @Override
     public Object visitVariableExpr(Expr.Variable expr) {
-        return lookupVariable(expr.name, expr);
+        if (expr.depth == -1) {
+            return globals.get(expr.name);
+        }
+        return environment.getAt(expr.depth, expr.slot);
     }
 
-    private Object lookupVariable(Token name, Expr expr) {
-        Integer distance = locals.get(expr);
-        if (distance != null) {
-            return environment.getAt(distance, name.lexeme);
+    /**
+     * 宣言された変数を今の環境に置く
+     * @param slot Resolverが振ったslot、グローバル変数なら-1
+     */
+    private void define(Token name, int slot, Object value) {
+        if (slot == -1) {
+            globals.define(name.lexeme, value);
+        } else {
+            environment.define(slot, value);
         }
-        return globals.get(name);
     }
 }
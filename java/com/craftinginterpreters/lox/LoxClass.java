@@ -1,5 +1,6 @@
 package com.craftinginterpreters.lox;
 
+import java.util.HashMap;
 import java.util.List;
 import java.util.Map;
 
@@ -11,17 +12,28 @@ public class LoxClass implements LoxCallable {
     LoxClass(String name, LoxClass superclass, Map<String, LoxFucntion> methods) {
         this.superclass = superclass;
         this.name = name;
-        this.methods = methods;
+        this.methods = flatten(superclass, methods);
     }
 
-    LoxFucntion findMethod(String name) {
-        if (methods.containsKey(name)) {
-            return methods.get(name);
-        }
-        if (superclass != null) {
-            return superclass.findMethod(name);
+    /**
+     * Copies the superclass methods down into this class's table (copy-down inheritance).
+     * superclassのtableはすでに祖先のmethodを含んでいるので、1段分コピーすれば十分
+     * 自身のmethodで上書きすることでoverrideを表現する
+     */
+    private static Map<String, LoxFucntion> flatten(LoxClass superclass, Map<String, LoxFucntion> methods) {
+        if (superclass == null) {
+            return methods;
         }
-        return null;
+        Map<String, LoxFucntion> flattened = new HashMap<>(superclass.methods);
+        flattened.putAll(methods);
+        return flattened;
+    }
+
+    /**
+     * 継承の深さに関係なく1回のlookupで済む
+     */
+    LoxFucntion findMethod(String name) {
+        return methods.get(name);
     }
 
     @Override
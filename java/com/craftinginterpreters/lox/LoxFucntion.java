@@ -14,8 +14,8 @@ public class LoxFucntion implements LoxCallable {
     }
 
     LoxFucntion bind(LoxInstance instance) {
-        Environment environment = new Environment(closure);
-        environment.define("this", instance);
+        Environment environment = new Environment(closure, 1);
+        environment.define(0, instance);
         return new LoxFucntion(declaration, environment, isInitializer);
     }
 
@@ -31,23 +31,21 @@ public class LoxFucntion implements LoxCallable {
 
     @Override
     public Object call(Interpreter interpreter, List<Object> arguments) {
-        Environment environment = new Environment(closure);
+        // 引数はslot 0から順に並ぶ
+        Environment environment = new Environment(closure, declaration.slotCount);
         for (int i = 0; i < declaration.params.size(); i++) {
-            environment.define(declaration.params.get(i).lexeme, arguments.get(i));
+            environment.define(i, arguments.get(i));
         }
 
-        try {
-            interpreter.executeBlock(declaration.body, environment);
-        } catch (Return returnValue) {
-            if (isInitializer) {
-                return closure.getAt(0, "this");
-            }
-            return returnValue.value;
+        Completion completion = interpreter.executeBlock(declaration.body, environment);
+        Object value = null;
+        if (completion == Completion.RETURN) {
+            value = interpreter.takeReturnValue();
         }
 
         if (isInitializer) {
-            return closure.getAt(0, "this");
+            return closure.getAt(0, 0);
         }
-        return null;
+        return value;
     }
 }
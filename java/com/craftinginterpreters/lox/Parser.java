@@ -5,7 +5,9 @@ import java.util.Arrays;
 import java.util.List;
 
 public class Parser {
-    private static class ParseError extends RuntimeException {}
+    private static class ParseError extends RuntimeException {
+        private static final long serialVersionUID = 1L;
+    }
     private static final int MAX_ARGUMENTS = 255;
 
     private final List<Token> tokens;
@@ -258,8 +260,15 @@ public class Parser {
         }
         consume(TokenType.RIGHT_PAREN, "Expect ')' after parameters.");
         consume(TokenType.LEFT_BRACE, "Expect '{' before " + kind + " body.");
-        List<Stmt> body = block();
-        return new Stmt.Function(name, parameters, body);
+        // 関数の外側のループはbreakできない
+        int enclosingLoopDepth = loopDepth;
+        loopDepth = 0;
+        try {
+            List<Stmt> body = block();
+            return new Stmt.Function(name, parameters, body);
+        } finally {
+            loopDepth = enclosingLoopDepth;
+        }
     }
 
     private List<Stmt> block() {
@@ -6,8 +6,20 @@ import java.util.Map;
 import java.util.Stack;
 
 public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
-    private final Interpreter interpreter;
-    private final Stack<Map<String, Boolean>> scopes = new Stack<>();
+    /**
+     * scopeの中のローカル変数
+     * slotは宣言した順に0から振り、実行時の環境の配列の添字になる
+     */
+    private static class Local {
+        final int slot;
+        boolean defined = false; // falseの間は初期化子の中 (var a = a; を弾くため)
+
+        Local(int slot) {
+            this.slot = slot;
+        }
+    }
+
+    private final Stack<Map<String, Local>> scopes = new Stack<>();
     private FunctionType currentFunction = FunctionType.NONE;
     private enum FunctionType {
         NONE,
@@ -24,15 +36,11 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     private ClassType currentClass = ClassType.NONE;
 
-    Resolver(Interpreter interpreter) {
-        this.interpreter = interpreter;
-    }
-
     @Override
     public Void visitBlockStmt(Stmt.Block stmt) {
         beginScope();
         resolve(stmt.statements);
-        endScope();
+        stmt.slotCount = endScope();
         return null;
     }
 
@@ -40,7 +48,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     public Void visitClassStmt(Stmt.Class stmt) {
         ClassType enclosingClass = currentClass;
         currentClass = ClassType.CLASS;
-        declare(stmt.name);
+        stmt.slot = declare(stmt.name);
         if (stmt.superclass != null && stmt.name.lexeme.equals(stmt.superclass.name.lexeme)) {
             Lox.error(stmt.superclass.name, "A class cannot inherit from itself.");
         }
@@ -49,10 +57,10 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
             currentClass = ClassType.SUBCLASS;
             resolve(stmt.superclass);
             beginScope();
-            scopes.peek().put("super", true);
+            defineImplicit("super");
         }
         beginScope();
-        scopes.peek().put("this", true);
+        defineImplicit("this");
 
         for (Stmt.Function method : stmt.methods) {
             FunctionType declaration = FunctionType.METHOD;
@@ -117,7 +125,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     @Override
     public Void visitVarStmt(Stmt.Var stmt) {
-        declare(stmt.name);
+        stmt.slot = declare(stmt.name);
         if (stmt.initializer != null) {
             resolve(stmt.initializer);
         }
@@ -127,18 +135,23 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     @Override
     public Void visitVariableExpr(Expr.Variable expr) {
-        if (!scopes.isEmpty() && scopes.peek().get(expr.name.lexeme) == Boolean.FALSE) {
-            Lox.error(expr.name, "Cannot read local variable in its own initializer.");
+        if (!scopes.isEmpty()) {
+            Local local = scopes.peek().get(expr.name.lexeme);
+            if (local != null && !local.defined) {
+                Lox.error(expr.name, "Cannot read local variable in its own initializer.");
+            }
         }
 
-        resolveLocal(expr, expr.name);
+        expr.depth = resolveDepth(expr.name.lexeme);
+        expr.slot = resolveSlot(expr.name.lexeme, expr.depth);
         return null;
     }
 
     @Override
     public Void visitAssignExpr(Expr.Assign expr) {
         resolve(expr.value);
-        resolveLocal(expr, expr.name);
+        expr.depth = resolveDepth(expr.name.lexeme);
+        expr.slot = resolveSlot(expr.name.lexeme, expr.depth);
         return null;
     }
 
@@ -197,7 +210,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
         } else if (currentClass != ClassType.SUBCLASS) {
             Lox.error(expr.keyword, "Cannot use 'super' in a class with no superclass.");
         }
-        resolveLocal(expr, expr.keyword);
+        expr.depth = resolveDepth("super");
         return null;
     }
 
@@ -207,7 +220,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
             Lox.error(expr.keyword, "Cannot use 'this' outside of a class.");
             return null;
         }
-        resolveLocal(expr, expr.keyword);
+        expr.depth = resolveDepth("this");
         return null;
     }
 
@@ -219,7 +232,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     @Override
     public Void visitFunctionStmt(Stmt.Function stmt) {
-        declare(stmt.name);
+        stmt.slot = declare(stmt.name);
         define(stmt.name);
         resolveFunction(stmt, FunctionType.FUNCTION);
         return null;
@@ -249,50 +262,81 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
         FunctionType enclosingFunction = currentFunction;
         currentFunction = type;
 
+        // 引数はslot 0から順に並ぶので、呼び出し時にそのまま詰めればよい
         beginScope();
         for (Token param : function.params) {
             declare(param);
             define(param);
         }
         resolve(function.body);
-        endScope();
+        function.slotCount = endScope();
         currentFunction = enclosingFunction;
     }
 
     private void beginScope() {
-        scopes.push(new HashMap<String, Boolean>());
+        scopes.push(new HashMap<String, Local>());
     }
 
-    private void endScope() {
-        scopes.pop();
+    /**
+     * @return そのscopeの変数の数(実行時の環境の大きさ)
+     */
+    private int endScope() {
+        return scopes.pop().size();
     }
 
-    private void declare(Token name) {
+    /**
+     * @return 変数に振ったslot、グローバル変数なら-1
+     */
+    private int declare(Token name) {
         if (scopes.isEmpty()) {
-            return;
+            return -1;
         }
 
-        Map<String, Boolean> scope = scopes.peek();
-        if (scope.containsKey(name.lexeme)) {
+        Map<String, Local> scope = scopes.peek();
+        Local local = scope.get(name.lexeme);
+        if (local != null) {
             Lox.error(name, "Already a variable with this name in this scope.");
+            local.defined = false;
+            return local.slot;
         }
 
-        scope.put(name.lexeme, false);
+        local = new Local(scope.size());
+        scope.put(name.lexeme, local);
+        return local.slot;
     }
 
     private void define(Token name) {
         if (scopes.isEmpty()) {
             return;
         }
-        scopes.peek().put(name.lexeme, true);
+        scopes.peek().get(name.lexeme).defined = true;
+    }
+
+    /**
+     * thisやsuperのように、ソースに宣言のない変数をscopeのslot 0に置く
+     */
+    private void defineImplicit(String name) {
+        Local local = new Local(scopes.peek().size());
+        local.defined = true;
+        scopes.peek().put(name, local);
     }
 
-    private void resolveLocal(Expr expr, Token name) {
+    /**
+     * @return 変数を宣言したscopeまでの距離、グローバル変数なら-1
+     */
+    private int resolveDepth(String name) {
         for (int i = scopes.size() - 1; i >= 0; i--) {
-            if (scopes.get(i).containsKey(name.lexeme)) {
-                interpreter.resolve(expr, scopes.size() - 1 - i);
-                return;
+            if (scopes.get(i).containsKey(name)) {
+                return scopes.size() - 1 - i;
             }
         }
+        return -1;
+    }
+
+    private int resolveSlot(String name, int depth) {
+        if (depth == -1) {
+            return -1;
+        }
+        return scopes.get(scopes.size() - 1 - depth).get(name).slot;
     }
 }
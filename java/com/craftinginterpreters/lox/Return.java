@@ -1,10 +0,0 @@
-package com.craftinginterpreters.lox;
-
-public class Return extends RuntimeException {
-    final Object value;
-
-    Return(Object value) {
-        super(null, null, false, false);
-        this.value = value;
-    }
-}
@@ -1,6 +1,8 @@
 package com.craftinginterpreters.lox;
 
 public class RuntimeError extends RuntimeException {
+    private static final long serialVersionUID = 1L;
+
     final Token token;
 
     RuntimeError(Token token, String message) {
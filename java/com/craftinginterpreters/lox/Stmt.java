@@ -26,6 +26,7 @@ abstract class Stmt {
         }
 
         final List<Stmt> statements;
+        int slotCount;
     }
     static class Class extends Stmt {
         Class(Token name, Expr.Variable superclass, List<Stmt.Function> methods) {
@@ -42,6 +43,7 @@ abstract class Stmt {
         final Token name;
         final Expr.Variable superclass;
         final List<Stmt.Function> methods;
+        int slot = -1;
     }
     static class Break extends Stmt {
         Break() {
@@ -80,6 +82,8 @@ abstract class Stmt {
         final Token name;
         final List<Token> params;
         final List<Stmt> body;
+        int slot = -1;
+        int slotCount;
     }
     static class If extends Stmt {
         If(Expr condition, Stmt thenBranch, Stmt elseBranch) {
@@ -136,6 +140,7 @@ abstract class Stmt {
 
         final Token name;
         final Expr initializer;
+        int slot = -1;
     }
     static class While extends Stmt {
         While(Expr condition, Stmt body) {
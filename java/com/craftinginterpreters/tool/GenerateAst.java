@@ -12,8 +12,9 @@ public class GenerateAst {
             System.exit(64);
         }
         String outputDir = args[0];
+        // ";" の後ろはResolverが書き込む可変のフィールド(変数の解決結果)
         defineAst(outputDir, "Expr", Arrays.asList(
-            "Assign   : Token name, Expr value",
+            "Assign   : Token name, Expr value ; int depth = -1, int slot = -1",
             "Binary   : Expr left, Token operator, Expr right",
             "Call     : Expr callee, Token paren, List<Expr> arguments",
             "Get      : Expr object, Token name",
@@ -21,22 +22,22 @@ public class GenerateAst {
             "Literal  : Object value",
             "Logical  : Expr left, Token operator, Expr right",
             "Set      : Expr object, Token name, Expr value",
-            "Super    : Token keyword, Token method",
-            "This     : Token keyword",
+            "Super    : Token keyword, Token method ; int depth = -1",
+            "This     : Token keyword ; int depth = -1",
             "Unary    : Token operator, Expr right",
-            "Variable : Token name"
+            "Variable : Token name ; int depth = -1, int slot = -1"
         ));
 
         defineAst(outputDir, "Stmt", Arrays.asList(
-            "Block      : List<Stmt> statements",
-            "Class      : Token name, Expr.Variable superclass, List<Stmt.Function> methods",
+            "Block      : List<Stmt> statements ; int slotCount",
+            "Class      : Token name, Expr.Variable superclass, List<Stmt.Function> methods ; int slot = -1",
             "Break      : ",
             "Expression : Expr expression",
-            "Function   : Token name, List<Token> params, List<Stmt> body",
+            "Function   : Token name, List<Token> params, List<Stmt> body ; int slot = -1, int slotCount",
             "If         : Expr condition, Stmt thenBranch, Stmt elseBranch",
             "Print      : Expr expression",
             "Return     : Token keyword, Expr value",
-            "Var        : Token name, Expr initializer",
+            "Var        : Token name, Expr initializer ; int slot = -1",
             "While      : Expr condition, Stmt body"
         ));
     }
@@ -56,8 +57,10 @@ public class GenerateAst {
         for (String type : types) {
             String[] parts = type.split(":");
             String className = parts[0].trim();
-            String fields = parts[1].trim();
-            defineType(writer, baseName, className, fields);
+            String[] fieldParts = parts[1].split(";");
+            String fields = fieldParts[0].trim();
+            String resolvedFields = fieldParts.length > 1 ? fieldParts[1].trim() : "";
+            defineType(writer, baseName, className, fields, resolvedFields);
         }
 
         writer.println();
@@ -69,7 +72,7 @@ public class GenerateAst {
         writer.close();
     }
 
-    private static void defineType(PrintWriter writer, String baseName, String className, String fieldList) {
+    private static void defineType(PrintWriter writer, String baseName, String className, String fieldList, String resolvedFieldList) {
         writer.println("    static class " + className + " extends " + baseName + " {");
         // constructor
         writer.println("        " + className + "(" + fieldList + ") {");
@@ -98,6 +101,12 @@ public class GenerateAst {
         for (String field : fields) {
             writer.println("        final " + field + ";");
         }
+        // Resolverが書き込むので、finalにせず初期値を付けたまま出力する
+        if (!resolvedFieldList.isEmpty()) {
+            for (String field : resolvedFieldList.split(", ")) {
+                writer.println("        " + field + ";");
+            }
+        }
 
         writer.println("    }");
     }
@@ -0,0 +1,256 @@
+#!/usr/bin/env bash
+#
+# Golden-output conformance runner.
+#
+# Runs every test/*.lox on each available interpreter and compares stdout,
+# stderr and the exit code against the annotations in the script:
+#
+#   // expect: <line>                 a line printed to stdout, in order
+#   // expect error: <line>           a compile error line on stderr (exit 65)
+#   // expect runtime error: <msg>    the first stderr line (exit 70)
+#   // skip: <reason>                 skip the script on every interpreter
+#   // skip <name>: <reason>          skip the script on one interpreter
+#
+# Runtime errors only compare the message, because clox and jlox print the
+# line information differently.
+#
+# The expectations were written by hand from the Lox semantics. They were
+# not generated from jlox output, and jlox has not been built in the
+# environment where they were written. Every script that clox runs has been
+# checked against clox. The scripts skipped on clox (class, closure,
+# inheritance, subclass) were checked only by reading, so they are the
+# first to look at if jlox disagrees. main.lox was checked on clox with its
+# trailing block comment removed.
+#
+# clox additionally runs every non-skipped script again with
+# --engine=register and with --jit=0 (every chunk is compiled to machine code
+# on its first entry; skipped when the build has no JIT) against the same
+# annotations, runs them through --pool
+# and checks that the combined stdout comes back in input order, and runs
+# each script again with --symbols test/symbols.txt (which lists every native function's
+# name) to check that pre-interned names still resolve to the same globals.
+# It also saves a heap image from test/image/init.lox, runs test/image/use.lox
+# on top of it, and checks that an image with a corrupted string hash is
+# rejected. test/image/function.lox is saved with its functions and run with
+# --entry main, and an image whose function bytecode was corrupted must fail
+# verification on load.
+# When clox-profile is built (make test builds it), test/profile/calls.lox
+# checks that the folded profile lists call stacks and that a quickened
+# instruction that falls back is counted once.
+#
+# Usage: test/run.sh [interpreter...]   (default: ./clox ./jlox)
+
+set -u
+
+script_dir=$(cd "$(dirname "$0")" && pwd)
+root_dir=$(dirname "${script_dir}")
+
+if [ $# -gt 0 ]; then
+    interpreters=("$@")
+else
+    interpreters=("${root_dir}/clox" "${root_dir}/jlox")
+fi
+
+available() {
+    case "$(basename "$1")" in
+        jlox) [ -d "${root_dir}/build/java" ] && command -v java > /dev/null ;;
+        *) [ -x "$1" ] ;;
+    esac
+}
+
+# awk 1 adds the newline that sed drops on a last line without one.
+annotations() {
+    sed -n "s|.*// $1: \(.*\)$|\1|p" "$2" | awk 1
+}
+
+passed=0
+failed=0
+skipped=0
+tmp=$(mktemp -d)
+trap 'rm -rf "${tmp}"' EXIT
+
+# Runs one script and compares it with its annotations.
+# Usage: check_script interpreter test_name script [option...]
+check_script() {
+    local interpreter=$1 test_name=$2 test=$3
+    shift 3
+    annotations "expect" "${test}" > "${tmp}/expected_out"
+    annotations "expect error" "${test}" > "${tmp}/expected_err"
+    runtime_error=$(annotations "expect runtime error" "${test}")
+    expected_code=0
+    if [ -s "${tmp}/expected_err" ]; then
+        expected_code=65
+    elif [ -n "${runtime_error}" ]; then
+        expected_code=70
+        echo "${runtime_error}" > "${tmp}/expected_err"
+    fi
+
+    "${interpreter}" "$@" "${test}" > "${tmp}/out" 2> "${tmp}/err"
+    code=$?
+    if [ "${expected_code}" -eq 70 ]; then
+        head -n 1 "${tmp}/err" > "${tmp}/err_first"
+        mv "${tmp}/err_first" "${tmp}/err"
+    fi
+
+    failure=""
+    if [ "${code}" -ne "${expected_code}" ]; then
+        failure="${failure}  expected exit code ${expected_code} but got ${code}\n"
+    fi
+    if ! diff -u "${tmp}/expected_out" "${tmp}/out" > "${tmp}/diff_out"; then
+        failure="${failure}  stdout differs:\n$(cat "${tmp}/diff_out")\n"
+    fi
+    if ! diff -u "${tmp}/expected_err" "${tmp}/err" > "${tmp}/diff_err"; then
+        failure="${failure}  stderr differs:\n$(cat "${tmp}/diff_err")\n"
+    fi
+
+    if [ -z "${failure}" ]; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL ${test_name}"
+        printf "%b" "${failure}"
+    fi
+}
+
+for interpreter in "${interpreters[@]}"; do
+    name=$(basename "${interpreter}")
+    if ! available "${interpreter}"; then
+        echo "skipping ${name}: not built" >&2
+        continue
+    fi
+
+    for test in "${script_dir}"/*.lox; do
+        if grep -q -e "// skip:" -e "// skip ${name}:" "${test}"; then
+            skipped=$((skipped + 1))
+            continue
+        fi
+        check_script "${interpreter}" "${name} $(basename "${test}")" "${test}"
+    done
+
+    if [ "${name}" = "clox" ]; then
+        # レジスタ命令に翻訳しても同じ期待値を満たすことを確かめる
+        for test in "${script_dir}"/*.lox; do
+            if ! grep -q -e "// skip:" -e "// skip ${name}:" "${test}"; then
+                check_script "${interpreter}" "${name} --engine=register $(basename "${test}")" "${test}" --engine=register
+            fi
+        done
+
+        # 最初からJITしても同じ期待値を満たすことを確かめる(x86-64のLinux以外のビルドは--jitを受け付けない)
+        if echo "" | "${interpreter}" --jit=0 - > /dev/null 2>&1; then
+            for test in "${script_dir}"/*.lox; do
+                if ! grep -q -e "// skip:" -e "// skip ${name}:" "${test}"; then
+                    check_script "${interpreter}" "${name} --jit=0 $(basename "${test}")" "${test}" --jit=0
+                fi
+            done
+        fi
+
+        # --poolで同じスクリプトをまとめて実行し、入力順どおりに出力が並ぶことを確かめる
+        : > "${tmp}/pool_list"
+        : > "${tmp}/pool_expected"
+        for test in "${script_dir}"/*.lox; do
+            if ! grep -q -e "// skip:" -e "// skip ${name}:" "${test}"; then
+                echo "${test}" >> "${tmp}/pool_list"
+                annotations "expect" "${test}" >> "${tmp}/pool_expected"
+            fi
+        done
+        "${interpreter}" --pool 4 "${tmp}/pool_list" > "${tmp}/pool_out" 2> /dev/null
+        if diff -u "${tmp}/pool_expected" "${tmp}/pool_out" > "${tmp}/diff_out"; then
+            passed=$((passed + 1))
+        else
+            failed=$((failed + 1))
+            echo "FAIL ${name} --pool"
+            cat "${tmp}/diff_out"
+        fi
+
+        # 共有intern表に組み込み関数の名前があっても、同じグローバル変数を指すことを確かめる
+        for test in "${script_dir}"/*.lox; do
+            if grep -q -e "// skip:" -e "// skip ${name}:" "${test}"; then
+                continue
+            fi
+            annotations "expect" "${test}" > "${tmp}/expected_out"
+            "${interpreter}" --symbols "${script_dir}/symbols.txt" "${test}" > "${tmp}/out" 2> /dev/null
+            if diff -u "${tmp}/expected_out" "${tmp}/out" > "${tmp}/diff_out"; then
+                passed=$((passed + 1))
+            else
+                failed=$((failed + 1))
+                echo "FAIL ${name} --symbols $(basename "${test}")"
+                cat "${tmp}/diff_out"
+            fi
+        done
+
+        # heap imageに保存したグローバル変数を別のプロセスで復元して使う
+        annotations "expect" "${script_dir}/image/use.lox" > "${tmp}/expected_out"
+        "${interpreter}" --save-image "${tmp}/image" "${script_dir}/image/init.lox" > /dev/null 2>&1 \
+            && "${interpreter}" --load-image "${tmp}/image" "${script_dir}/image/use.lox" > "${tmp}/out" 2>&1
+        if diff -u "${tmp}/expected_out" "${tmp}/out" > "${tmp}/diff_out"; then
+            passed=$((passed + 1))
+        else
+            failed=$((failed + 1))
+            echo "FAIL ${name} --save-image/--load-image"
+            cat "${tmp}/diff_out"
+        fi
+
+        # 最初の文字列のhash(ヘッダの64バイトと長さの4バイトの後)を1ビット壊したimageは読まない
+        cp "${tmp}/image" "${tmp}/bad_image"
+        byte=$(od -A n -t u1 -j 68 -N 1 "${tmp}/image" | tr -d ' ')
+        printf "$(printf '\\%03o' $((byte ^ 1)))" \
+            | dd of="${tmp}/bad_image" bs=1 seek=68 conv=notrunc 2> /dev/null
+        "${interpreter}" --load-image "${tmp}/bad_image" "${script_dir}/image/use.lox" > /dev/null 2> "${tmp}/err"
+        code=$?
+        if [ "${code}" -eq 74 ] && grep -q "Invalid heap image" "${tmp}/err"; then
+            passed=$((passed + 1))
+        else
+            failed=$((failed + 1))
+            echo "FAIL ${name} --load-image with a corrupted hash"
+            echo "  expected exit code 74 and 'Invalid heap image' but got ${code}: $(cat "${tmp}/err")"
+        fi
+
+        # profileビルドがあれば、folded stackに呼び出しの経路が出ることと、
+        # 汎用の命令に戻って実行し直した命令を1回だけ数えることを確かめる
+        if [ -x "${root_dir}/clox-profile" ]; then
+            "${root_dir}/clox-profile" --profile="${tmp}/folded" "${script_dir}/profile/calls.lox" > /dev/null 2> "${tmp}/err"
+            adds=$(awk '$1 == "OP_ADD" || $1 == "OP_ADD_NUM" { sum += $2 } END { print sum + 0 }' "${tmp}/err")
+            if grep -q "^script;twice;add;line 4 " "${tmp}/folded" && [ "${adds}" -eq 4 ]; then
+                passed=$((passed + 1))
+            else
+                failed=$((failed + 1))
+                echo "FAIL clox-profile --profile"
+                echo "  expected a 'script;twice;add;line 4' stack and 4 additions but got ${adds}:"
+                cat "${tmp}/folded"
+            fi
+        fi
+
+        # 関数を含むimageを復元して、スクリプトなしで--entry mainを呼ぶ
+        annotations "expect" "${script_dir}/image/function.lox" > "${tmp}/expected_out"
+        "${interpreter}" --save-image "${tmp}/function_image" "${script_dir}/image/function.lox" > "${tmp}/out" 2>&1 \
+            && [ ! -s "${tmp}/out" ] \
+            && "${interpreter}" --load-image "${tmp}/function_image" --entry main > "${tmp}/out" 2>&1
+        if diff -u "${tmp}/expected_out" "${tmp}/out" > "${tmp}/diff_out"; then
+            passed=$((passed + 1))
+        else
+            failed=$((failed + 1))
+            echo "FAIL ${name} --save-image/--load-image --entry main with functions"
+            cat "${tmp}/diff_out"
+        fi
+
+        # identityのOP_GET_LOCAL 1(5 1)とOP_RETURN(35)を探し、スロットを範囲外の127にする
+        # 読み込むときのverifyFunctionが弾くので、壊れたimageとして読まない
+        offset=$(grep -obUaP '\x05\x01\x23\x01\x23' "${tmp}/function_image" | head -n 1 | cut -d: -f1)
+        cp "${tmp}/function_image" "${tmp}/bad_image"
+        if [ -n "${offset}" ]; then
+            printf '\177' | dd of="${tmp}/bad_image" bs=1 seek=$((offset + 1)) conv=notrunc 2> /dev/null
+        fi
+        "${interpreter}" --load-image "${tmp}/bad_image" --entry main > /dev/null 2> "${tmp}/err"
+        code=$?
+        if [ -n "${offset}" ] && [ "${code}" -eq 74 ] && grep -q "Invalid heap image" "${tmp}/err"; then
+            passed=$((passed + 1))
+        else
+            failed=$((failed + 1))
+            echo "FAIL ${name} --load-image with invalid function bytecode"
+            echo "  expected to find identity's code (at '${offset}'), exit code 74 and 'Invalid heap image' but got ${code}: $(cat "${tmp}/err")"
+        fi
+    fi
+done
+
+echo "${passed} passed, ${failed} failed, ${skipped} skipped"
+[ "${failed}" -eq 0 ]